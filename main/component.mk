@@ -6,3 +6,17 @@
 # in the build directory. This behaviour is entirely configurable,
 # please read the ESP-IDF documents if you need to do this.
 #
+
+# The static host table of sti_resolv.c is generated from a hosts file
+ifdef CONFIG_STI_RESOLV_STATIC_HOSTS
+STATIC_HOSTS_FILE := $(subst ",,$(CONFIG_STI_RESOLV_STATIC_HOSTS_FILE))
+STATIC_HOSTS_FILE := $(if $(filter /%,$(STATIC_HOSTS_FILE)),$(STATIC_HOSTS_FILE),$(COMPONENT_PATH)/$(STATIC_HOSTS_FILE))
+
+CPPFLAGS += -I$(COMPONENT_BUILD_DIR)
+COMPONENT_EXTRA_CLEAN := static_hosts.h
+
+sti_resolv.o: static_hosts.h
+
+static_hosts.h: $(COMPONENT_PATH)/gen_static_hosts.py $(STATIC_HOSTS_FILE) $(SDKCONFIG_MAKEFILE)
+	$(PYTHON) $(COMPONENT_PATH)/gen_static_hosts.py --file $(STATIC_HOSTS_FILE) --list $(CONFIG_STI_RESOLV_STATIC_HOSTS_LIST) --output $@
+endif
@@ -80,13 +80,35 @@ static void event_handler(void* arg, esp_event_base_t event_base,
         ip_event_got_ip_t* event = (ip_event_got_ip_t*) event_data;
         ESP_LOGI(TAG, "got ip:" IPSTR, IP2STR(&event->ip_info.ip));
         s_retry_num = 0;
+        // after a DHCP renewal or roaming, move the resolver to the network's
+        // DNS servers but keep the answers it already has
+        if (resolv_getserver() != 0){
+            esp_netif_dns_info_t dns_main, dns_backup;
+            ip_addr_t dns_servers[2];
+            u8_t count = 0;
+            if (esp_netif_get_dns_info(event->esp_netif, ESP_NETIF_DNS_MAIN, &dns_main) == ESP_OK &&
+                !ip_addr_isany((ip_addr_t *)&dns_main.ip)){
+                memcpy(&dns_servers[count++], &dns_main.ip, sizeof(ip_addr_t));
+            }
+            if (esp_netif_get_dns_info(event->esp_netif, ESP_NETIF_DNS_BACKUP, &dns_backup) == ESP_OK &&
+                !ip_addr_isany((ip_addr_t *)&dns_backup.ip)){
+                memcpy(&dns_servers[count++], &dns_backup.ip, sizeof(ip_addr_t));
+            }
+            if (count > 0){
+                resolv_set_servers(dns_servers, count, 0);
+            }
+        }
         xEventGroupSetBits(s_wifi_event_group, WIFI_CONNECTED_BIT);
     }
 }
 
-void sti_cb (char *name, struct ip4_addr *addr){
+void sti_cb (char *name, ip_addr_t *addr, err_t status, u32_t ttl){
     static const char *TAG = "sti_cb     ";
-    ESP_LOGI(TAG, "...DNS information for %s IP is: "IPSTR"", name, IP2STR(addr));
+    if (addr == NULL){
+      ESP_LOGI(TAG, "...DNS information for %s not found (err %d, ttl %u)", name, (int)status, (unsigned)ttl);
+      return;
+    }
+    ESP_LOGI(TAG, "...DNS information for %s IP is: %s (ttl %u)", name, ipaddr_ntoa(addr), (unsigned)ttl);
 }
 
 void wifi_init_sta(void)
@@ -239,6 +261,12 @@ void wifi_init_sta(void)
       ESP_LOGI(TAG, "... Error initializing resolver " );
     }
     ESP_LOGI(TAG, "...Returned from resolver init");
+#ifdef CONFIG_STI_RESOLV_BENCH
+    resolv_bench();
+#endif
+#ifdef CONFIG_STI_RESOLV_STRESS
+    resolv_stress(10000);
+#endif
 
     //The user can check if the DNS server was configured.
     if (resolv_getserver() != 0){
@@ -249,7 +277,9 @@ void wifi_init_sta(void)
       ESP_LOGI(TAG, "...DNS server from resolv_getserver not found");
     }
 
-    struct hostent *hp;
+    struct hostent host, *hp;
+    char host_buf[128];
+    int host_err;
     struct ip4_addr *ip4_addr;
 
     char full_hostname[] = EXAMPLE_FULL_HOSTNAME;
@@ -267,9 +297,10 @@ void wifi_init_sta(void)
     }
 
     /* create test call to resolv_query_jps */
-    unsigned char an[100];
-    memset(an,0,100);
-    int anslen = 0;
+    /* with EDNS the server may send more than 512 bytes, the reply is cut to anslen */
+    unsigned char an[512];
+    memset(an,0,sizeof(an));
+    int anslen = sizeof(an);
     int res;
 
     /* Message class is Internet */
@@ -285,7 +316,7 @@ void wifi_init_sta(void)
     ESP_LOGI(TAG, "");
     ESP_LOGI(TAG, "...Start of res_query_jps for SRV records");
 
-    memset(an,0,100); // re-initialize an to zero
+    memset(an,0,sizeof(an)); // re-initialize an to zero
     /* Message class is Internet */
     /* Message Type Request is for SRV records*/
     res = res_query_jps(full_hostname_1, MESSAGE_C_IN, MESSAGE_T_SRV, an, anslen);
@@ -327,23 +358,37 @@ void wifi_init_sta(void)
       ESP_LOGI(TAG, "...IP address from resolv_lookup not found");
     }
 
-    ESP_LOGI(TAG, "\n");
-    ESP_LOGI(TAG, ".Begin gethostbyname");
-    hp = gethostbyname(full_hostname);
-
-    ip4_addr = (struct ip4_addr *)hp->h_addr_list[0];
-
-    ESP_LOGI(TAG, "...Gathering DNS records for %s ", full_hostname);
-    ESP_LOGI(TAG, "...Address No. 0 from DNS: " IPSTR, IP2STR(ip4_addr));
+    // Round robin names return several addresses, all of them are kept
+    ip_addr_t all_addrs[4];
+    int naddrs = resolv_lookup_all(full_hostname, RESOLV_FAMILY_DUAL_V4, all_addrs, 4);
+    for (int k = 0; k < naddrs; k++){
+      ESP_LOGI(TAG, "...Address No. %d from resolv_lookup_all: %s", k, ipaddr_ntoa(&all_addrs[k]));
+    }
 
-    if (hp->h_addr_list[1] != NULL){
-      ip4_addr = (struct ip4_addr *)hp->h_addr_list[1];
-      ESP_LOGI(TAG, "...Address No. 1 DNS: " IPSTR, IP2STR(ip4_addr));
+    ESP_LOGI(TAG, "\n");
+    ESP_LOGI(TAG, ".Begin sti_gethostbyname_r");
+    // served from the dns table, no second query for the same name
+    if (sti_gethostbyname_r(full_hostname, &host, host_buf, sizeof(host_buf), &hp, &host_err) == 0){
+      ip4_addr = (struct ip4_addr *)hp->h_addr_list[0];
+
+      ESP_LOGI(TAG, "...Gathering DNS records for %s ", full_hostname);
+      ESP_LOGI(TAG, "...Address No. 0 from DNS: " IPSTR, IP2STR(ip4_addr));
+
+      if (hp->h_addr_list[1] != NULL){
+        ip4_addr = (struct ip4_addr *)hp->h_addr_list[1];
+        ESP_LOGI(TAG, "...Address No. 1 DNS: " IPSTR, IP2STR(ip4_addr));
+      }
+      else{
+        ESP_LOGI(TAG, "...Address No. 1 from DNS was null");
+      }
     }
     else{
-      ESP_LOGI(TAG, "...Address No. 1 from DNS was null");
+      ESP_LOGI(TAG, "...sti_gethostbyname_r failed, h_errno %d", host_err);
     }
 
+    // keep the answers for the next boot when the persistent cache is enabled
+    resolv_save();
+
     ESP_LOGI(TAG, "Done with connection... Now shutdown handlers");
 
 
@@ -0,0 +1,134 @@
+#!/usr/bin/env python3
+#
+# Generate static_hosts.h, the compile time host table of sti_resolv.c
+#
+# The input is a hosts style file, one "address name [name...]" line per
+# address with # comments, and an optional list of the same entries separated
+# by commas (the STI_RESOLV_STATIC_HOSTS_LIST menuconfig option).
+#
+# The output is a set of const tables, kept in flash, with a minimal perfect
+# hash over the names (hash and displace): a name is found with two hashes and
+# one string compare, whatever the number of names. static_hash() below must
+# match static_hash() in sti_resolv.c.
+
+import argparse
+import ipaddress
+import sys
+
+FNV_OFFSET = 2166136261
+FNV_PRIME = 16777619
+MAX_DISP = 0xffff
+
+
+def static_hash(name, seed):
+    """FNV-1a over the lower case name, started from a seed"""
+    h = (FNV_OFFSET ^ seed) & 0xffffffff
+    for c in name.lower().encode('ascii'):
+        h ^= c
+        h = (h * FNV_PRIME) & 0xffffffff
+    return h
+
+
+def parse_line(line, where, hosts):
+    line = line.split('#', 1)[0].strip()
+    if not line:
+        return
+    fields = line.split()
+    if len(fields) < 2:
+        sys.exit('%s: expected "address name [name...]"' % where)
+    try:
+        addr = ipaddress.ip_address(fields[0])
+    except ValueError:
+        sys.exit('%s: bad address %s' % (where, fields[0]))
+    for name in fields[1:]:
+        name = name.rstrip('.').lower()
+        if not name or len(name) > 253:
+            sys.exit('%s: bad name %s' % (where, name))
+        addrs = hosts.setdefault(name, [])
+        if addr not in addrs:
+            addrs.append(addr)
+
+
+def build_hash(names):
+    """Find a displacement for every bucket so that each name lands in a slot
+    of its own. Returns the displacements and the names in slot order."""
+    n = len(names)
+    nbuckets = max(1, (n + 1) // 2)
+    while True:
+        buckets = [[] for _ in range(nbuckets)]
+        for name in names:
+            buckets[static_hash(name, 0) % nbuckets].append(name)
+        disp = [0] * nbuckets
+        slots = [None] * n
+        ok = True
+        # the biggest buckets are the hardest to place, do them first
+        for b in sorted(range(nbuckets), key=lambda b: -len(buckets[b])):
+            if not buckets[b]:
+                continue
+            for d in range(1, MAX_DISP + 1):
+                pos = [static_hash(name, d) % n for name in buckets[b]]
+                if len(set(pos)) == len(pos) and all(slots[p] is None for p in pos):
+                    for p, name in zip(pos, buckets[b]):
+                        slots[p] = name
+                    disp[b] = d
+                    break
+            else:
+                ok = False
+                break
+        if ok:
+            return disp, slots
+        nbuckets *= 2
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Generate the static host table of sti_resolv.c')
+    parser.add_argument('--file', help='hosts style input file')
+    parser.add_argument('--list', default='', help='extra entries separated by commas')
+    parser.add_argument('--output', required=True)
+    args = parser.parse_args()
+
+    hosts = {}
+    if args.file:
+        with open(args.file) as f:
+            for k, line in enumerate(f, 1):
+                parse_line(line, '%s:%d' % (args.file, k), hosts)
+    for k, entry in enumerate(args.list.split(','), 1):
+        parse_line(entry, 'list entry %d' % k, hosts)
+
+    names = sorted(hosts)
+    disp, slots = build_hash(names) if names else ([0], [])
+
+    pool = []
+    rows = []
+    for name in slots:
+        v4 = [a for a in hosts[name] if a.version == 4][:255]
+        v6 = [a for a in hosts[name] if a.version == 6][:255]
+        rows.append('  { "%s", %d, %d, %d },' % (name, len(v4), len(v6), len(pool)))
+        for a in v4 + v6:
+            pool.extend(a.packed)
+    if len(pool) > 0xffff:
+        sys.exit('too many addresses for the static host table')
+
+    out = []
+    out.append('/* Generated by gen_static_hosts.py, do not edit. */')
+    out.append('#define STATIC_HOSTS_COUNT %d' % len(slots))
+    out.append('#define STATIC_HOSTS_BUCKETS %d' % len(disp))
+    out.append('static const u16_t static_hosts_disp[STATIC_HOSTS_BUCKETS] = {')
+    out.append('  %s' % ', '.join(str(d) for d in disp))
+    out.append('};')
+    out.append('static const u8_t static_hosts_addrs[] = {')
+    for k in range(0, len(pool), 16):
+        out.append('  %s,' % ', '.join(str(b) for b in pool[k:k + 16]))
+    if not pool:
+        out.append('  0')
+    out.append('};')
+    out.append('static const STATIC_HOST static_hosts[] = {')
+    out.extend(rows if rows else ['  { "", 0, 0, 0 }'])
+    out.append('};')
+
+    with open(args.output, 'w') as f:
+        f.write('\n'.join(out) + '\n')
+
+
+if __name__ == '__main__':
+    main()
@@ -61,46 +61,459 @@
 
  */
 
+#include <stddef.h>
 #include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
 #include <ctype.h>
 #include "lwip/stats.h"
 #include "lwip/mem.h"
 #include "lwip/udp.h"
+#include "lwip/tcp.h"
 #include "lwip/ip_addr.h"
 #include "lwip/netif.h"
 #include "lwip/inet.h"
 #include "netif/etharp.h"
 #include "lwip/sys.h"
 #include "lwip/opt.h"
+#include "lwip/timeouts.h"
+#include "lwip/tcpip.h"
+#include "lwip/priv/tcpip_priv.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "freertos/queue.h"
+#include "lwip/sockets.h"
+#include "lwip/netdb.h"
 
 #include "sti_resolv.h"
 //#include "esp_system.h"
 //#include "esp_event.h"
 #include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_system.h"
+#include "nvs.h"
+#ifdef CONFIG_STI_RESOLV_BENCH
+#include "xtensa/core-macros.h"
+#endif
 //added to get error checks
 #include "esp_netif.h"
 //#include "esp_netif_ppp.h"
 
 /* The maximum length of a host name supported in the name table. */
+#ifdef CONFIG_STI_RESOLV_MAX_NAME_LEN
+#define MAX_NAME_LENGTH CONFIG_STI_RESOLV_MAX_NAME_LEN
+#else
 #define MAX_NAME_LENGTH 32
+#endif
 /* The maximum number of retries when asking for a name. */
+#ifdef CONFIG_STI_RESOLV_MAX_RETRIES
+#define MAX_RETRIES CONFIG_STI_RESOLV_MAX_RETRIES
+#else
 #define MAX_RETRIES 8
+#endif
+
+/* IPv6 addresses (AAAA). Without them the dns table holds the A family only
+ * and every lookup is an IPv4 lookup */
+#ifdef CONFIG_STI_RESOLV_AAAA
+#define RESOLV_AAAA 1
+#else
+#define RESOLV_AAAA 0
+#endif
+
+/* The raw query API, res_query_jps() */
+#ifdef CONFIG_STI_RESOLV_RES_QUERY
+#define RESOLV_RES_QUERY 1
+#else
+#define RESOLV_RES_QUERY 0
+#endif
+
+/* How long res_query_jps() waits for the reply */
+#define RES_QUERY_TIMEOUT_MS 2000
+
+/* The ID res_query_jps() queries carry. Table queries use the entry index */
+#define RES_QUERY_ID 99
 
 /* The maximum number of table entries to maintain locally */
 #ifndef LWIP_RESOLV_ENTRIES
+#ifdef CONFIG_STI_RESOLV_ENTRIES
+#define LWIP_RESOLV_ENTRIES CONFIG_STI_RESOLV_ENTRIES
+#else
 #define LWIP_RESOLV_ENTRIES 4
 #endif
+#endif
+
+/* The callbacks one query in flight reports to; a request for a name already
+   being asked for joins its query */
+#define RESOLV_CALLERS 4
 
 #ifndef DNS_SERVER_PORT
 #define DNS_SERVER_PORT 53
 #endif
 
+/* The most DNS servers resolv_set_servers() takes. Retries move on to the next */
+#ifndef RESOLV_MAX_SERVERS
+#define RESOLV_MAX_SERVERS 3
+#endif
+
 
 #define MESSAGE_HEADER_LEN 12
 #define MESSAGE_RESPONSE 1
+#define MESSAGE_T_A 1
+#define MESSAGE_T_CNAME 5
 #define MESSAGE_T_SRV 33
+#define MESSAGE_T_TXT 16
+#define MESSAGE_T_AAAA 28
+#define MESSAGE_T_OPT 41
+#define MESSAGE_T_SOA 6
+#define MESSAGE_T_PTR 12
 #define MESSAGE_C_IN 1
 
+/* EDNS(0) support (RFC 6891). The UDP payload size we advertise in the OPT
+ * record is set in menuconfig */
+#ifdef CONFIG_STI_RESOLV_EDNS
+#define RESOLV_EDNS 1
+#define RESOLV_EDNS_UDP_SIZE CONFIG_STI_RESOLV_EDNS_UDP_SIZE
+#else
+#define RESOLV_EDNS 0
+#endif
+
+/* The longest UDP reply taken: the size advertised with EDNS, else the 512
+ * bytes of RFC 1035 */
+#if RESOLV_EDNS
+#define RESOLV_RX_MAX RESOLV_EDNS_UDP_SIZE
+#else
+#define RESOLV_RX_MAX 512
+#endif
+
+/* An OPT record is a root name (1), type (2), UDP size (2), TTL (4) and RDLEN (2) */
+#define MESSAGE_OPT_LEN 11
+
+/* read a 16 bit big endian value from a buffer that may not be aligned */
+#define GET16(ptr) ((u16_t)(((ptr)[0] << 8) | (ptr)[1]))
+
+/* The longest name on the wire as text with its NUL, RFC 1035 2.3.4 */
+#define DNS_WIRE_NAME 256
+
+/* Answer records of class IN a reply is parsed into, the rest are ignored */
+#define RESOLV_PARSE_RRS 32
+
+/* Dual stack lookups. When A and AAAA are both asked for and the less
+ * preferred family answers first, the callback waits this long for the
+ * preferred one (Happy Eyeballs, RFC 8305 section 3) */
+#ifdef CONFIG_STI_RESOLV_HE_DELAY_MS
+#define RESOLV_HE_DELAY_MS CONFIG_STI_RESOLV_HE_DELAY_MS
+#else
+#define RESOLV_HE_DELAY_MS 50
+#endif
+
+/* The most addresses of one family kept for a name. Extra records in a
+ * reply are dropped */
+#ifdef CONFIG_STI_RESOLV_MAX_ADDRS
+#define RESOLV_MAX_ADDRS CONFIG_STI_RESOLV_MAX_ADDRS
+#else
+#define RESOLV_MAX_ADDRS 4
+#endif
+
+/* The family resolv_query() asks for */
+#if defined(CONFIG_STI_RESOLV_FAMILY_DUAL_V6)
+#define RESOLV_FAMILY_DEFAULT RESOLV_FAMILY_DUAL_V6
+#elif defined(CONFIG_STI_RESOLV_FAMILY_DUAL_V4)
+#define RESOLV_FAMILY_DEFAULT RESOLV_FAMILY_DUAL_V4
+#else
+#define RESOLV_FAMILY_DEFAULT RESOLV_FAMILY_IPV4
+#endif
+
+/* How long sti_getaddrinfo() and sti_gethostbyname_r() wait for a name that
+ * is not in the dns table */
+#ifdef CONFIG_STI_RESOLV_WAIT_MS
+#define RESOLV_WAIT_MS CONFIG_STI_RESOLV_WAIT_MS
+#else
+#define RESOLV_WAIT_MS 5000
+#endif
+
+/* While it waits a blocking lookup calls check_entries() this often, so the
+ * query is sent and retried without help from the application */
+#define RESOLV_WAIT_POLL_MS 250
+
+/* Serve stale (RFC 8767). When the DNS server does not answer, an address
+ * that expired less than RESOLV_SERVE_STALE_S ago is used again for
+ * RESOLV_STALE_TTL seconds. TTLs are capped so the stale window cannot wrap */
+#ifdef CONFIG_STI_RESOLV_SERVE_STALE_S
+#define RESOLV_SERVE_STALE_S CONFIG_STI_RESOLV_SERVE_STALE_S
+#else
+#define RESOLV_SERVE_STALE_S 0
+#endif
+#define RESOLV_STALE_TTL 30
+#define RESOLV_MAX_TTL 604800
+
+/* Persistent cache. resolv_save() writes the dns table to NVS and
+ * resolv_init() loads it again after a reboot or deep sleep */
+#ifdef CONFIG_STI_RESOLV_PERSIST
+#define RESOLV_PERSIST 1
+#else
+#define RESOLV_PERSIST 0
+#endif
+#define RESOLV_NVS_NAMESPACE "sti_resolv"
+#define RESOLV_NVS_KEY "cache"
+
+/* Snapshot format. A header of magic (4), version (1), entry count (1) and
+ * the wall clock time of the save in seconds (4). Then for every entry the
+ * name length (1) and name, and for each family the address count (1), the
+ * seconds left of the TTL (4, negative once expired) and the addresses of 4
+ * or 16 bytes. Multi byte fields are big endian */
+#define RESOLV_SNAP_MAGIC 0x53544952 /* "STIR" */
+#define RESOLV_SNAP_VERSION 1
+#define RESOLV_SNAP_HDR_LEN 10
+#define RESOLV_SNAP_MAX (RESOLV_SNAP_HDR_LEN + LWIP_RESOLV_ENTRIES * \
+  (1 + MAX_NAME_LENGTH + SNAP_FAMILIES * (5 + RESOLV_MAX_ADDRS * 16)))
+/* A and AAAA are both in every snapshot, whatever the build keeps */
+#define SNAP_FAMILIES 2
+
+/* Wall clock times before this (2020-01-01) mean the clock was never set */
+#define RESOLV_SANE_TIME 1577836800
+
+/* DNS over TCP (RFC 7766). Queries to a server are pipelined on one TCP
+ * connection, opened on demand and closed after RESOLV_TCP_IDLE_S idle seconds */
+#ifdef CONFIG_STI_RESOLV_TCP
+#define RESOLV_TCP 1
+#define RESOLV_TCP_IDLE_S CONFIG_STI_RESOLV_TCP_IDLE_S
+#else
+#define RESOLV_TCP 0
+#define RESOLV_TCP_IDLE_S 10
+#endif
+/* lwIP calls the poll callback every RESOLV_TCP_POLL * 500 ms */
+#define RESOLV_TCP_POLL 2
+/* Longest reply taken over TCP, the rest of a longer one is skipped */
+#define RESOLV_TCP_MAX_MSG 4096
+/* Longest query sent over TCP, a longer one goes over UDP */
+#define RESOLV_TCP_MAX_QUERY 512
+
+/* Static host table, generated from a hosts file at build time by
+ * gen_static_hosts.py. Its names are answered from flash without a query */
+#ifdef CONFIG_STI_RESOLV_STATIC_HOSTS
+#define RESOLV_STATIC_HOSTS 1
+#else
+#define RESOLV_STATIC_HOSTS 0
+#endif
+/* TTL of a static address in a reply made up by res_query_jps() */
+#define RESOLV_STATIC_TTL 86400
+
+/* Capture of every query sent and reply received, into a ring buffer that
+ * resolv_capture_export() writes out as pcap, and replay of such a capture */
+#ifdef CONFIG_STI_RESOLV_CAPTURE
+#define RESOLV_CAPTURE 1
+#define RESOLV_CAPTURE_SIZE CONFIG_STI_RESOLV_CAPTURE_SIZE
+#else
+#define RESOLV_CAPTURE 0
+#endif
+#define PCAP_MAGIC 0xa1b2c3d4
+#define PCAP_LINKTYPE_RAW 101 /* packets start with the IPv4 or IPv6 header */
+#define PCAP_HDR_LEN 24
+#define PCAP_REC_LEN 16
+#define CAPTURE_OUT 0
+#define CAPTURE_IN 1
+
+/* Negative answers (NXDOMAIN, or no record of the type) are cached for the
+ * TTL the SOA record in the reply gives (RFC 2308), at most this long */
+#define RESOLV_MAX_NEG_TTL 10800
+
+/* Search list. A name that does not end in a dot is also tried with each
+ * search domain appended; all candidates are asked for at once */
+#ifndef RESOLV_MAX_SEARCH
+#define RESOLV_MAX_SEARCH 3
+#endif
+#define RESOLV_MAX_CANDIDATES (RESOLV_MAX_SEARCH + 1)
+#ifdef CONFIG_STI_RESOLV_SEARCH
+#define RESOLV_SEARCH CONFIG_STI_RESOLV_SEARCH
+#else
+#define RESOLV_SEARCH ""
+#endif
+#ifdef CONFIG_STI_RESOLV_NDOTS
+#define RESOLV_NDOTS CONFIG_STI_RESOLV_NDOTS
+#else
+#define RESOLV_NDOTS 1
+#endif
+
+/* The most short names being expanded through the search list at a time */
+#ifndef RESOLV_SEARCH_GROUPS
+#define RESOLV_SEARCH_GROUPS 4
+#endif
+
+/* Outbound rate limit, queries per second with a burst allowance. 0 means
+   no limit. */
+#ifdef CONFIG_STI_RESOLV_RATE
+#define RESOLV_RATE CONFIG_STI_RESOLV_RATE
+#else
+#define RESOLV_RATE 0
+#endif
+#ifdef CONFIG_STI_RESOLV_BURST
+#define RESOLV_BURST CONFIG_STI_RESOLV_BURST
+#else
+#define RESOLV_BURST 8
+#endif
+
+/* Table entries a low priority query may not take for a query in flight */
+#ifdef CONFIG_STI_RESOLV_PRIO_RESERVE
+#define RESOLV_PRIO_RESERVE CONFIG_STI_RESOLV_PRIO_RESERVE
+#else
+#define RESOLV_PRIO_RESERVE 1
+#endif
+#define RESOLV_PRIO_COUNT (RESOLV_PRIO_LOW + 1)
+
+/* .local names are asked by multicast DNS, one-shot queries as in RFC 6762
+   section 5.1 */
+#ifdef CONFIG_STI_RESOLV_MDNS
+#define RESOLV_MDNS 1
+#else
+#define RESOLV_MDNS 0
+#endif
+#define MDNS_PORT 5353
+/* a responder answers at once or not at all, so give up sooner */
+#define MDNS_MAX_RETRIES 3
+
+/* Hooks for a simulation with a virtual clock and an in-memory network, and
+   fault injection on the queries sent, see resolv_sim_hooks() */
+#ifdef CONFIG_STI_RESOLV_SIM
+#define RESOLV_SIM 1
+#else
+#define RESOLV_SIM 0
+#endif
+#define RESOLV_SIM_HOLD 8 /* queries the fault injector can delay at a time */
+#define RESOLV_SIM_MSG 512 /* the longest query it can delay */
+/* timeouts on the virtual clock: the Happy Eyeballs delays, rate_resume()
+   and replay_next() */
+#define RESOLV_SIM_TIMERS (LWIP_RESOLV_ENTRIES + 2)
+
+/* Micro-benchmarks of the name and record parsers, see resolv_bench() */
+#ifdef CONFIG_STI_RESOLV_BENCH
+#define RESOLV_BENCH 1
+#else
+#define RESOLV_BENCH 0
+#endif
+#define RESOLV_BENCH_RUNS 100 /* passes over the corpus, the fastest counts */
+#define BENCH_MSGS 4
+#define BENCH_MSG_LEN 512
+
+/* Stress test of the seqlock, see resolv_stress() */
+#ifdef CONFIG_STI_RESOLV_STRESS
+#define RESOLV_STRESS 1
+#else
+#define RESOLV_STRESS 0
+#endif
+#define RESOLV_STRESS_READERS 4 /* reader tasks, spread over the cores */
+#define RESOLV_STRESS_WRITES 64 /* changes of the entry per call to the writer */
+#define RESOLV_STRESS_STACK 3072
+
+/* Caching forwarder for downstream clients, see resolv_forward_start().
+   RESOLV_FORWARD_CLIENTS queries of clients can wait for a lookup at once */
+#ifdef CONFIG_STI_RESOLV_FORWARD
+#define RESOLV_FORWARD 1
+#define RESOLV_FORWARD_CLIENTS CONFIG_STI_RESOLV_FORWARD_CLIENTS
+#else
+#define RESOLV_FORWARD 0
+#define RESOLV_FORWARD_CLIENTS 1
+#endif
+#define FWD_QUERY_LEN 512 /* the part of a client query read */
+
+/* Completion queue. The results of queries are kept as events from a fixed
+   pool and run by resolv_dispatch(), in a task of the application or in a task
+   of the resolver, instead of in the lwIP tcpip thread. Only a wakeup is posted
+   to the dispatching task */
+#ifdef CONFIG_STI_RESOLV_COMPLETION_QUEUE
+#define RESOLV_COMPLETION_QUEUE 1
+#define RESOLV_COMPLETION_SPARE CONFIG_STI_RESOLV_COMPLETION_SPARE
+#else
+#define RESOLV_COMPLETION_QUEUE 0
+#endif
+#ifdef CONFIG_STI_RESOLV_COMPLETION_TASK
+#define RESOLV_COMPLETION_TASK 1
+#define RESOLV_COMPLETION_STACK CONFIG_STI_RESOLV_COMPLETION_TASK_STACK
+#define RESOLV_COMPLETION_PRIO CONFIG_STI_RESOLV_COMPLETION_TASK_PRIO
+#else
+#define RESOLV_COMPLETION_TASK 0
+#endif
+
+/* Address health. resolv_report_connect() feeds back how connects to an
+   address went, and the lookups return the addresses of a name cheapest
+   first: the smoothed connect RTT plus a penalty for each failure that
+   halves every RESOLV_HEALTH_HALF_LIFE_S. An address never reported costs
+   RESOLV_HEALTH_UNKNOWN_MS, so without feedback the order is unchanged */
+#ifdef CONFIG_STI_RESOLV_HEALTH
+#define RESOLV_HEALTH 1
+#define RESOLV_HEALTH_ENTRIES CONFIG_STI_RESOLV_HEALTH_ENTRIES
+#define RESOLV_HEALTH_HALF_LIFE_S CONFIG_STI_RESOLV_HEALTH_HALF_LIFE_S
+#else
+#define RESOLV_HEALTH 0
+#define RESOLV_HEALTH_ENTRIES 1
+#define RESOLV_HEALTH_HALF_LIFE_S 300
+#endif
+#define RESOLV_HEALTH_UNKNOWN_MS 200
+#define RESOLV_HEALTH_FAIL_MS 2000 /* penalty of one failed connect */
+#define RESOLV_HEALTH_MAX_MS 60000 /* the most penalty an address builds up */
+/* resolv_lookup_next() passes over an address with this much penalty, one
+   that failed within the last half life */
+#define RESOLV_HEALTH_SKIP_MS RESOLV_HEALTH_FAIL_MS
+
+/* DNS-SD browsing (RFC 6763), see resolv_browse(). One browse runs at a time
+   and follows up to RESOLV_BROWSE_INSTANCES instances, keeping up to
+   RESOLV_BROWSE_TXT bytes of the TXT record of each */
+#ifdef CONFIG_STI_RESOLV_BROWSE
+#define RESOLV_BROWSE 1
+#define RESOLV_BROWSE_INSTANCES CONFIG_STI_RESOLV_BROWSE_INSTANCES
+#define RESOLV_BROWSE_TXT CONFIG_STI_RESOLV_BROWSE_TXT
+#else
+#define RESOLV_BROWSE 0
+#define RESOLV_BROWSE_INSTANCES 1
+#define RESOLV_BROWSE_TXT 1
+#endif
+
+/* Entries of the reverse index, address to name */
+#ifdef CONFIG_STI_RESOLV_REVERSE_ENTRIES
+#define RESOLV_REVERSE_ENTRIES CONFIG_STI_RESOLV_REVERSE_ENTRIES
+#else
+#define RESOLV_REVERSE_ENTRIES 8
+#endif
+/* The longest reverse name, 32 nibble labels of an IPv6 address and ip6.arpa */
+#define REVERSE_QNAME_LEN 74
+
+/* CNAME chains. A reply is followed through at most RESOLV_CNAME_DEPTH
+   aliases, and each alias learned is cached on its own in one of
+   RESOLV_CNAME_ENTRIES links */
+#ifdef CONFIG_STI_RESOLV_CNAME_DEPTH
+#define RESOLV_CNAME_DEPTH CONFIG_STI_RESOLV_CNAME_DEPTH
+#else
+#define RESOLV_CNAME_DEPTH 8
+#endif
+#ifdef CONFIG_STI_RESOLV_CNAME_ENTRIES
+#define RESOLV_CNAME_ENTRIES CONFIG_STI_RESOLV_CNAME_ENTRIES
+#else
+#define RESOLV_CNAME_ENTRIES 8
+#endif
+
+/* The err of a family whose retries ran out without a reply */
+#define DNS_RCODE_TIMEOUT 0xffff
+
+/* index of the A and AAAA results in a dns table entry */
+#define FAM_V4 0
+#define FAM_V6 1
+#define FAM_COUNT (1 + RESOLV_AAAA)
+/* the query ID family of a PTR query, whose entry is an index in rev_table */
+#define FAM_PTR 2
+/* the query ID families of the queries of resolv_browse(): the PTR browse,
+   entry 0, and the SRV and TXT queries, whose entry is an index in
+   browse_inst */
+#define FAM_BROWSE_PTR 3
+#define FAM_BROWSE_SRV 4
+#define FAM_BROWSE_TXT 5
+
+/* The query ID is the index of the entry in the dns table, the upper byte
+ * says which of the entry's families the query is for */
+#define QUERY_ID(i, fam) ((u16_t)(((fam) << 8) | (i)))
+#define QUERY_ID_ENTRY(id) ((id) & 0xff)
+#define QUERY_ID_FAM(id) ((id) >> 8)
+
 #define MAX_DOMAIN_LEN 25
 
 /** @brief The DNS message header. \n
@@ -117,13 +530,19 @@ typedef struct s_dns_hdr {
 #define DNS_FLAG1_OPCODE_STATUS   0x10
 #define DNS_FLAG1_OPCODE_INVERSE  0x08
 #define DNS_FLAG1_OPCODE_STANDARD 0x00
+#define DNS_FLAG1_OPCODE_MASK     0x78
 #define DNS_FLAG1_AUTHORATIVE     0x04
 #define DNS_FLAG1_TRUNC           0x02
 #define DNS_FLAG1_RD              0x01
 #define DNS_FLAG2_RA              0x80
 #define DNS_FLAG2_ERR_MASK        0x0f
 #define DNS_FLAG2_ERR_NONE        0x00
+#define DNS_FLAG2_ERR_FORMAT      0x01
+#define DNS_FLAG2_ERR_SERVER      0x02
 #define DNS_FLAG2_ERR_NAME        0x03
+#define DNS_FLAG2_ERR_NOTIMP      0x04
+#define DNS_FLAG2_ERR_REFUSED     0x05
+#define DNS_RCODE_BADVERS         16 /**< extended RCODE, needs the OPT record */
   u16_t numquestions; /**< Number of questions asked of DNS server */
   u16_t numanswers; /**< Number of answers from DNS server */
   u16_t numauthrr; /**< number of name server resource records in the authority records*/
@@ -162,10 +581,26 @@ typedef struct resolver_srv_rr_struc {
     struct resolver_srv_rr_struc *next;
 } resolver_srv_rr_t;
 
+/** @brief Result of the query for one address family of a table entry.\n
+  * The A and AAAA queries of an entry run in parallel and each family keeps
+  * its own state and time to live.
+  */
+typedef struct s_dns_family {
+ u8_t state; /**< STATE_UNUSED if not asked for, else asking, done or error */
+ u8_t edns; /**< set to 1 if the last query sent for this family carried an OPT record */
+ u16_t err; /**< RCODE of the reply, including the EDNS extended bits */
+ u8_t count; /**< number of addresses in addrs */
+ u32_t expires; /**< resolv_now() time in seconds when the addresses stop being valid */
+ u32_t stale_until; /**< resolv_now() time in seconds until the addresses may be served stale */
+ ip_addr_t addrs[RESOLV_MAX_ADDRS]; /**< If DNS success, the addresses in the order received */
+} DNS_FAMILY;
+
 /** @brief Hostnames and DNS results information Table entry\n
   *Whenever a DNS search is requested for a hostname, an entry is created in the dns table.
   *When information is returned from a dns querry, the table is updated with the data. status
   *of the entry changes changes over time from new, to asking etc.
+  *@note Only the writer context, the lwIP tcpip thread, changes an entry. See
+  *entry_write_begin() for how readers on other tasks get a consistent copy.
   */
 typedef struct namemap {
 #define STATE_UNUSED 0
@@ -173,546 +608,6450 @@ typedef struct namemap {
 #define STATE_ASKING 2
 #define STATE_DONE   3
 #define STATE_ERROR  4
+ u32_t seq; /**< even while the entry is stable, odd while the writer changes it */
  u8_t state; /**< entry can be unused, new, asking, done, error */
  u8_t tmr; /**< timer is used to age entry information  */
  u8_t retries;
  u8_t seqno;
- u8_t err;
+ u8_t asked; /**< bit (1 << FAM_V4) and/or (1 << FAM_V6), the families asked for */
+ u8_t prefer; /**< FAM_V4 or FAM_V6, the family reported first */
+ u8_t reported; /**< set to 1 once the callback has been called */
+ u8_t he_wait; /**< set to 1 while waiting for the preferred family */
+ u8_t server; /**< index in servers of the DNS server the last query went to */
+ u8_t prio; /**< RESOLV_PRIORITY, the most urgent of the requests sharing the entry */
+ u8_t deferred; /**< set to 1 while a send waits for the rate limiter */
+ u8_t mdns; /**< set to 1 for a .local name, asked by multicast DNS */
  char name[MAX_NAME_LENGTH]; /**< Hostname as ASCI characters  */
- struct ip4_addr ipaddr; /**< If DNS success, The IP4 address is placed here */
- void (* found)(char *name, struct ip4_addr *ipaddr); /**< pointer to callback on DNS query done */
+ DNS_FAMILY fam[FAM_COUNT]; /**< A results in fam[FAM_V4], AAAA results in fam[FAM_V6] */
+ user_cb_fn found[RESOLV_CALLERS]; /**< callbacks of the requests sharing the query, NULL after the last */
 }DNS_TABLE_ENTRY;
 
 static DNS_TABLE_ENTRY dns_table[LWIP_RESOLV_ENTRIES];
+/* The rotation counters of resolv_lookup_next(), by entry and family. They
+   are outside the entries so readers can bump them atomically while the
+   writer changes an entry; the writer never touches them */
+static u32_t lookup_rotate[LWIP_RESOLV_ENTRIES][FAM_COUNT];
 static u8_t seqno = 0;
-static struct udp_pcb *resolv_pcb = NULL; /**< UDP connection to DNS server */
-static struct ip4_addr serverIP; /**<the adress of the DNS server to use */
-static u8_t initFlag; /**< set to 1 if initialized*/
-static u8_t respFlag = 0; /**< set to 1 if responce received*/
-static u8_t payload_len = 0; /**< length of the received payload buffer*/
-static unsigned char * user_buffer_ptr;
+/** @brief An upstream DNS server */
+typedef struct s_dns_server {
+  ip_addr_t addr; /**< IPv4 or IPv6 address, queries go to port DNS_SERVER_PORT */
+  u8_t edns_off; /**< set to 1 if the server does not understand EDNS */
+  u8_t tcp_off; /**< set to 1 if the server refused a TCP connection, UDP is used */
+} DNS_SERVER;
 
-//sti Test Line follows
-struct ip_addr ipaddr1;
+#if RESOLV_TCP
+/** @brief The TCP connection to one DNS server\n
+  * Only used in the writer context. Queries are written with their 2 byte
+  * length prefix as they come, without waiting for earlier replies, and
+  * replies are matched to their queries by ID in any order.
+  */
+typedef struct s_dns_tcp {
+  struct tcp_pcb *pcb; /**< NULL while there is no connection */
+  u8_t open; /**< set to 1 once the connection is established */
+  u32_t last_used; /**< resolv_now() time of the last query or reply */
+  struct pbuf *rx; /**< received bytes not yet making up a whole reply */
+  u32_t skip; /**< bytes of an overlong reply still to be dropped */
+} DNS_TCP;
 
-/** print_buf prints out a buffer. This makes it easier to troubleshoot
-  * buffers sent or ceived from the DNS server */
-void print_buf(unsigned char *buf, int length) {
-  unsigned char * buf_char_ptr;
-  static const char *TAG = "print_buf   ";
-  buf_char_ptr = buf;
-  for (int i=0; i < length; i++){
-    if ((*buf_char_ptr > 64 && *buf_char_ptr <91) ||
-      (*buf_char_ptr > 96 && *buf_char_ptr <123)){
-      ESP_LOGI(TAG, "....%d Letter in received buffer: %c", i+1, *buf_char_ptr);
-    }
-    else{
-      ESP_LOGI(TAG, "....%d Hex in received buffer   : %X", i+1, *buf_char_ptr);
-    }
-    buf_char_ptr++;
-  } // check printer buffer end *
-}
+static DNS_TCP tcp_conns[RESOLV_MAX_SERVERS]; /**< one per entry in servers */
+/** a query and its length prefix, written in one piece; only used in the
+  * writer context */
+static u8_t tcp_frame[2 + RESOLV_TCP_MAX_QUERY];
+#endif
 
-/** Parse_Name finds the end of QNAME.
-  * The DNS RFC-1035 specification requires hostnames to be specially encoded.
-  * A domain name is represented as a sequence of labels, where each label consists
-  * of a length octet followed by that number of octets of asci chars. The domain
-  * name terminates with the zero length octet for the null label of the root. This
-  * routine finds the end of the name.
-  *
-  * @param querry a pointer to the start of the name section of the buffer
-  * @returns pointer to end of the name*/
-static unsigned char *
-parse_name(unsigned char *query)
-{
-  unsigned char n;
+#if RESOLV_CAPTURE
+/** @brief Header of a message in the capture ring\n
+  * Followed in the ring by the len bytes of the DNS message.
+  */
+typedef struct s_capture_rec {
+  u32_t sec; /**< time since boot */
+  u32_t usec;
+  u16_t len; /**< length of the DNS message */
+  u8_t dir; /**< CAPTURE_OUT for a query, CAPTURE_IN for a reply */
+  u16_t port; /**< port of the peer, DNS_SERVER_PORT or MDNS_PORT */
+  ip_addr_t peer; /**< the DNS server, or the mDNS group or responder */
+} CAPTURE_REC;
 
-  do
-  {
-    n = *query++;
+/* The ring is only written in the writer context. The oldest messages are
+   dropped to make room. */
+static u8_t capture_ring[RESOLV_CAPTURE_SIZE];
+static size_t capture_head = 0; /**< where the next message goes */
+static size_t capture_tail = 0; /**< the oldest message */
+static size_t capture_used = 0; /**< bytes in the ring */
+static u8_t capture_on = 0; /**< set to 1 by resolv_capture() */
 
-    while(n > 0)
-    {
-      /*      printf("%c", *query);*/
-      ++query;
-      --n;
-    };
-  } while(*query != 0);
+/* A capture being replayed, see resolv_replay() */
+static const u8_t *replay_buf = NULL; /**< NULL unless a replay is running */
+static size_t replay_len;
+static size_t replay_off; /**< the next pcap record */
+static u8_t replay_swap; /**< set to 1 if the capture has the other byte order */
+static u8_t replay_gen = 0; /**< changes with every resolv_replay() */
+static u32_t replay_t0; /**< time of the first record, ms */
+static int64_t replay_start; /**< esp_timer time the replay started, us */
+#endif
 
-  return query + 1;
-}
+#if RESOLV_STATIC_HOSTS
+/** @brief A name of the static host table\n
+  * The table and its addresses are const and stay in flash. static_hosts[]
+  * is in the order of the perfect hash, see static_find().
+  */
+typedef struct s_static_host {
+  const char *name; /**< lower case, without a trailing dot */
+  u8_t n4; /**< number of IPv4 addresses */
+  u8_t n6; /**< number of IPv6 addresses, after the IPv4 ones */
+  u16_t addr; /**< offset of the first address in static_hosts_addrs */
+} STATIC_HOST;
 
-/** @brief * get_qname_len() - Walk through the encoded answer buffer and return
- * the length of the encoded name in chars. length of zero indicates a Problem
- * condition
- *---------------------------------------------------------------------------*/
-int
-get_qname_len(unsigned char *name_ptr){
+#include "static_hosts.h"
+#endif
 
-  int qname_len =0;
+static struct udp_pcb *resolv_pcb = NULL; /**< UDP pcb all queries are sent from */
+static DNS_SERVER servers[RESOLV_MAX_SERVERS]; /**< only used in the writer context */
+static u8_t nservers = 0; /**< number of entries in servers */
+static u8_t cur_server = 0; /**< the server that answered last, new queries go there first */
+static struct ip4_addr serverIP; /**<the adress of the DNS server in use, for resolv_getserver() */
+static u8_t initFlag; /**< set to 1 if initialized*/
+static TaskHandle_t writer_task = NULL; /**< the lwIP tcpip thread, the only task that changes dns_table */
+#if RESOLV_RES_QUERY
+static u16_t payload_len = 0; /**< length of the received payload buffer*/
+static u8_t resp_edns_retry = 0; /**< set to 1 if the server rejected the OPT record of res_query_jps */
+static unsigned char * user_buffer_ptr; /**< NULL unless res_query_jps() is waiting */
+static int user_buffer_len; /**< size of the buffer user_buffer_ptr points to */
+static unsigned char *res_query_msg; /**< the query res_query_jps() is waiting on */
+static u16_t res_query_len; /**< length of res_query_msg */
+static u8_t res_query_opt; /**< set to 1 if res_query_msg carries an OPT record */
+static SemaphoreHandle_t res_query_mutex = NULL; /**< lets one res_query_jps() run at a time */
+static SemaphoreHandle_t res_query_sem = NULL; /**< given when the reply to res_query_jps() arrives */
+#endif
 
-  while(qname_len < MAX_NAME_LENGTH){
-    if (*name_ptr == 0){
-      qname_len++;
-      break;
-    }
-    else if (*name_ptr == 0xC0){
-      qname_len += 2;
-      break;
-    }
-    else{
-      qname_len += (*name_ptr + 1);
-      name_ptr += (*name_ptr + 1);
-    }
-  } //end while loop
+/** @brief A call from a user task into the writer context.\n
+  * The public functions that change the dns table or use the UDP pcb pack their
+  * arguments in one of these and run in the lwIP tcpip thread through
+  * tcpip_api_call(), which waits for the result.
+  */
+typedef struct s_resolv_call {
+  struct tcpip_api_call_data call; /**< must be first, used by tcpip_api_call() */
+  char *name;
+  user_cb_fn cb;
+  RESOLV_FAMILY family;
+  RESOLV_PRIORITY prio;
+  ip_addr_t *server;
+  unsigned char *msg; /**< a query built by the caller */
+  u16_t len; /**< length of msg, the writer may add an OPT record to it */
+  unsigned char *answer; /**< buffer for the reply */
+  int anslen; /**< size of answer */
+  struct s_resolv_waiter *waiter; /**< set by the blocking lookups */
+  const ip_addr_t *addr; /**< for resolv_reverse() and resolv_report_connect(), the listen
+                             address of resolv_forward_start() */
+  u8_t ok; /**< for resolv_report_connect() */
+  u32_t rtt_ms; /**< for resolv_report_connect() */
+  reverse_cb_fn rev_cb; /**< for resolv_reverse() */
+#if RESOLV_BROWSE
+  browse_cb_fn browse_cb; /**< for resolv_browse() */
+#endif
+  u8_t *snap; /**< snapshot for resolv_init() to load, capture for resolv_replay(), or NULL */
+  size_t snap_len; /**< length of snap */
+  s32_t snap_age; /**< seconds since the snapshot was saved, -1 if not known */
+  const ip_addr_t *server_list; /**< for resolv_set_servers() */
+  u8_t server_count; /**< entries in server_list */
+  u8_t flush; /**< set to 1 to drop the cached answers */
+  const char *search; /**< for resolv_set_search() */
+  u8_t ndots; /**< for resolv_set_search() */
+  const RESOLV_SIM_HOOKS *sim_hooks; /**< for resolv_sim_hooks() */
+  const RESOLV_SIM_FAULTS *sim_faults; /**< for resolv_sim_faults() */
+  struct pbuf *p; /**< for resolv_sim_deliver() */
+  u16_t port; /**< for resolv_sim_deliver() */
+  int64_t sim_next; /**< from resolv_sim_run() */
+} RESOLV_CALL;
 
-  if (qname_len == MAX_NAME_LENGTH){
-    qname_len = 0;
-  }
-  return qname_len;
-}
+/** @brief A task blocked in a lookup until a name is answered.\n
+  * Lives on the stack of the waiting task and sits on the waiters list of the
+  * writer context until the entry for its name reports or finishes.
+  */
+typedef struct s_resolv_waiter {
+  struct s_resolv_waiter *next;
+  char name[MAX_NAME_LENGTH]; /**< the name the answer is reported under */
+  SemaphoreHandle_t sem; /**< given when the waiter is taken off the list */
+} RESOLV_WAITER;
 
-void
-check_entries(void)
-{
-  static const char *TAG = "chck_entries";
-  ESP_LOGI(TAG, "...begin check entries" );
-  register DNS_HDR *hdr;
-  char *query, *nptr, *pHostname;
-  static u16_t i; //i is index to dns_table
-  static u8_t n;
-  register DNS_TABLE_ENTRY *pEntry;
-  struct pbuf *p;
+static RESOLV_WAITER *waiters = NULL; /**< only used in the writer context */
 
-  for(i = 0; i < LWIP_RESOLV_ENTRIES; ++i)
-  {
-    pEntry = &dns_table[i];
-    if(pEntry->state == STATE_NEW || pEntry->state == STATE_ASKING)
-    {
-      if(pEntry->state == STATE_ASKING)
-      {
-        if(--pEntry->tmr == 0)
-        {
-          if(++pEntry->retries == MAX_RETRIES)
-          {
-            pEntry->state = STATE_ERROR;
-            if (pEntry->found) /* call specified callback function if provided */
-              (*pEntry->found)(pEntry->name, NULL);
-            continue;
-          }
-          pEntry->tmr = pEntry->retries;
-        }
-        else
-        {
-          /*  printf("Timer %d\n", pEntry->tmr);*/
-          /* Its timer has not run out, so we move on to next
-          entry. */
-          continue;
-        }
-      }
-      else
-      {
-        pEntry->state = STATE_ASKING;
-        pEntry->tmr = 1;
-        pEntry->retries = 0;
-      }
-      /* if here, we have either a new query or a retry on a previous query to process */
-      p = pbuf_alloc(PBUF_TRANSPORT, sizeof(DNS_HDR)+MAX_NAME_LENGTH+5, PBUF_RAM);
-      hdr = (DNS_HDR *)p->payload;
-      memset(hdr, 0, sizeof(DNS_HDR));
-
-      /* Fill in header information observing Big Endian / Little Endian considerations*/
-      hdr->id = htons(i);
-      hdr->flags1 = DNS_FLAG1_RD; //This is 8bits so no need to worry about htons
-      hdr->numquestions = htons(1);
-      query = (char *)hdr + sizeof(DNS_HDR);
-      pHostname = pEntry->name;
-      --pHostname;
-      /* Convert hostname into suitable query format. */
-
-      int qname_len = 0;
-      do
-      {
-        ++pHostname;
-        nptr = query;
-        ++query;
-        for(n = 0; *pHostname != '.' && *pHostname != 0; ++pHostname)
-        {
-          *query = *pHostname;
-          ++query;
-          ++n;
-          qname_len ++;
-        }
-        *nptr = n;
-        qname_len ++;
-      }
-      while(*pHostname != 0);
+/** @brief The search list and ndots, as in resolv.conf\n
+  * Changed by the writer context only, read by any task with seq_read().
+  */
+typedef struct s_search_conf {
+  u32_t seq; /**< see entry_write_begin() */
+  u8_t count; /**< number of entries in domains */
+  u8_t ndots; /**< a name with fewer dots tries the search domains first */
+  char domains[RESOLV_MAX_SEARCH][MAX_NAME_LENGTH]; /**< without a trailing dot */
+} SEARCH_CONF;
 
-      static unsigned char endquery[] = {0,0,1,0,1};
-      // write a trailing 0 on qname and write q_type and q_class
-      // order is MSB, LSB (network)
-      memcpy(query, endquery, 5);
+static SEARCH_CONF search_conf;
 
-      //pbuf_realloc(p, qname_len + 12 + 5);
-      pbuf_realloc(p, sizeof(DNS_HDR) + qname_len + 5);
-      udp_send(resolv_pcb, p);
-      ESP_LOGI(TAG, "...query sent to DNS server" );
-      pbuf_free(p);
-      break;
-    }
-  }
-}
+/** @brief A short name being expanded through the search list\n
+  * Every candidate is asked for at once, each as an entry of its own in the
+  * dns table. The group reports the answer of the first candidate in search
+  * order that has an address, once every candidate before it has failed.
+  */
+typedef struct s_search_group {
+  u8_t active;
+  u8_t gen; /**< changes every time the group is taken */
+  u8_t ncand; /**< number of entries in cand */
+  u8_t done; /**< bit (1 << k) once candidate k has reported */
+  u8_t ok; /**< bit (1 << k) if candidate k reported an address */
+  RESOLV_FAMILY family;
+  user_cb_fn found; /**< callback of the user, or NULL */
+  char name[MAX_NAME_LENGTH]; /**< the name as asked for */
+  char cand[RESOLV_MAX_CANDIDATES][MAX_NAME_LENGTH]; /**< in search order */
+  ip_addr_t addr[RESOLV_MAX_CANDIDATES]; /**< the address candidate k reported */
+  u32_t ttl[RESOLV_MAX_CANDIDATES]; /**< the TTL candidate k reported */
+  err_t err; /**< ERR_VAL once a candidate was answered without an address */
+} SEARCH_GROUP;
 
-/**Querry a DNS server and return a buffer with the answer(s)
- * The res_query_jps() function provides an interface to the server query mechanism.
- * It constructs a query, sends it to the DNS server, awaits a response, and
- * makes preliminary checks on the reply. The query requests information of the
- * specified type and class for the specified fully-qualified domain name dname.
- * The reply message is left in the answer buffer
- */
+static SEARCH_GROUP search_groups[RESOLV_SEARCH_GROUPS]; /**< only used in the writer context */
 
-int
-res_query_jps(const char *dname, int class, int type, unsigned char *answer, int anslen){
-  static const char *TAG = "res_query_jps";
-  ESP_LOGI(TAG, "");
-  ESP_LOGI(TAG, ".Begin res_query_jps function");
+/** @brief An entry of the reverse index\n
+  * Maps an address to a name, learned from the answer to a PTR query of
+  * resolv_reverse() or from a forward A or AAAA answer. Changed by the writer
+  * context only, read by any task with seq_read().
+  */
+typedef struct s_reverse_entry {
+  u32_t seq; /**< see entry_write_begin() */
+  u8_t state; /**< STATE_NEW or STATE_ASKING while in flight, STATE_DONE with a name,
+                   STATE_ERROR if the address has none */
+  u8_t tmr; /**< retry timer, as in DNS_TABLE_ENTRY */
+  u8_t retries;
+  u8_t server; /**< index in servers of the DNS server the last query went to */
+  u8_t edns; /**< set to 1 if the last query carried an OPT record */
+  u8_t deferred; /**< set to 1 while a send waits for the rate limiter */
+  u8_t from_ptr; /**< set to 1 if the name comes from a PTR answer */
+  ip_addr_t addr;
+  u32_t expires; /**< resolv_now() time in seconds when the answer stops being valid */
+  u32_t stale_until; /**< resolv_now() time in seconds until the name may be served stale */
+  char name[MAX_NAME_LENGTH];
+  reverse_cb_fn found; /**< callback of resolv_reverse(), or NULL */
+} REVERSE_ENTRY;
 
-  static u8_t n;
-  DNS_HDR *hdr;
-  struct pbuf *p;
-  char *query, *nptr;
-  const char *pHostname;
+static REVERSE_ENTRY rev_table[RESOLV_REVERSE_ENTRIES];
 
-  p = pbuf_alloc(PBUF_TRANSPORT, sizeof(DNS_HDR)+MAX_NAME_LENGTH+5, PBUF_RAM);
-  hdr = (DNS_HDR *)p->payload;
-  memset(hdr, 0, sizeof(DNS_HDR));
+/** @brief A cached CNAME record, an alias and the name it stands for.\n
+  * Only used in the writer context.
+  */
+typedef struct s_cname_link {
+  u32_t expires; /**< resolv_now() time in seconds when the link stops being valid */
+  char owner[MAX_NAME_LENGTH]; /**< the alias */
+  char target[MAX_NAME_LENGTH]; /**< the name it stands for */
+} CNAME_LINK;
 
-  // make start of answer header globally available
-  user_buffer_ptr = answer;
+static CNAME_LINK cname_table[RESOLV_CNAME_ENTRIES];
+static char cname_chain[RESOLV_CNAME_DEPTH + 1][MAX_NAME_LENGTH]; /**< names of the chain resolv_recv() follows */
 
-  /* Fill in header information observing Big Endian / Little Endian considerations*/
-  hdr->id = htons(99);
-  hdr->flags1 = DNS_FLAG1_RD; //This is 8bits so no need to worry about htons
-  hdr->numquestions = htons(1);
-  query = (char *)hdr + sizeof(DNS_HDR);
+/** @brief A record of the answer section, as parse_msg() found it */
+typedef struct s_dns_rr {
+  u32_t hash; /**< static_hash() of the owner name */
+  u32_t ttl; /**< from get_ttl() */
+  u16_t owner; /**< offset of the owner name in the reply */
+  u16_t type;
+  u16_t rdata; /**< offset of the RDATA in the reply */
+  u16_t rdlen;
+} DNS_RR;
 
-  /* Convert hostname into suitable query format. */
-  pHostname = dname;
-  --pHostname;
-  int qname_len = 0;
-  do
-  {
-    ++pHostname;
-    nptr = query;
-    ++query;
-    for(n = 0; *pHostname != '.' && *pHostname != 0; ++pHostname)
-    {
-      *query = *pHostname;
-      ++query;
-      ++n;
-      qname_len ++;
-    }
-    *nptr = n;
-    qname_len ++;
-  }
-  while(*pHostname != 0);
+/** @brief A reply, parsed in one pass by parse_msg().\n
+  * Only used in the writer context.
+  */
+typedef struct s_dns_msg {
+  unsigned char *msg;
+  unsigned char *end; /**< first byte after the reply */
+  u16_t rcode; /**< with the upper bits from an EDNS OPT record */
+  u16_t nrrs; /**< records of the answer section in rrs */
+  u16_t nadd; /**< records of the additional section in rrs, after the answers */
+  u32_t neg_ttl; /**< how long a negative answer may be cached, from the SOA record */
+  u32_t qhash; /**< static_hash() of qname */
+  u16_t qtype; /**< type of the first question */
+  u16_t qclass; /**< class of the first question */
+  char qname[MAX_NAME_LENGTH]; /**< the first question, empty if there is none */
+  DNS_RR rrs[RESOLV_PARSE_RRS]; /**< the answers of class IN, in order, then with
+                                     DNS-SD browsing the additional records */
+} DNS_MSG;
 
-  // complete the question by (1) terminating the QNAME with 0, (2) specifying
-  // QTYPE and (3) specifying QCLASS
-  static unsigned char endquery[] = {0,0,1,0,1};
-  endquery[2] = (unsigned char) type;
-  endquery[4] = (unsigned char) class;
+static DNS_MSG rx_msg; /**< the reply resolv_recv() is working on */
+/** a reply that came in a chain of pbufs, in one piece; u32_t keeps it aligned */
+static u32_t rx_buf[(RESOLV_RX_MAX + 3) / 4];
 
-  memcpy(query, endquery, 5);
+#if RESOLV_FORWARD
+/** @brief The query of a client of the forwarder, waiting for a lookup.\n
+  * Only used in the writer context.
+  */
+typedef struct s_fwd_client {
+  u8_t used;
+  u8_t fam; /**< FAM_V4 or FAM_V6, the family that answers it */
+  u8_t rd; /**< DNS_FLAG1_RD as the client set it */
+  u16_t id; /**< ID of the query of the client */
+  u16_t qtype; /**< type of the question, echoed in the reply */
+  u16_t entry; /**< index in dns_table of the lookup */
+  u16_t port;
+  ip_addr_t addr;
+  char qname[MAX_NAME_LENGTH]; /**< the question, in the case the client used */
+} FWD_CLIENT;
 
-  pbuf_realloc(p, sizeof(DNS_HDR) + qname_len + 5);
-  respFlag = 0; //clear responce flag. It will be set to 1 when buffer received
+static struct udp_pcb *fwd_pcb = NULL; /**< listens on port 53 while the forwarder runs */
+static FWD_CLIENT fwd_clients[RESOLV_FORWARD_CLIENTS];
+#endif
 
-  udp_send(resolv_pcb, p);
-  ESP_LOGI(TAG, "...query sent to DNS server" );
-  pbuf_free(p);
+#if RESOLV_COMPLETION_QUEUE
+#define EVENT_QUERY   0 /* the result of a query, for a user_cb_fn */
+#define EVENT_REVERSE 1 /* the result of resolv_reverse(), for a reverse_cb_fn */
+#define EVENT_BROWSE  2 /* an instance or the end of resolv_browse(), for a browse_cb_fn */
 
-  for (int time =0; time < 10; time++){
-    vTaskDelay(200 / portTICK_PERIOD_MS);
-    if (respFlag == 1){
-      break;
-    }
-  }
-  if ( respFlag != 1){
-    return 0;
-  }
+/* The events of the pool: one for each caller of each entry, each reverse
+   entry, each instance of a browse and its end, and RESOLV_COMPLETION_SPARE
+   for results passed on at once, from the cache or as an error */
+#define RESOLV_COMPLETION_EVENTS (LWIP_RESOLV_ENTRIES * RESOLV_CALLERS + RESOLV_REVERSE_ENTRIES + \
+                                  RESOLV_BROWSE_INSTANCES + 1 + RESOLV_COMPLETION_SPARE)
 
-  ESP_LOGI(TAG, "...payload length from parse = %d", payload_len);
+#if RESOLV_BROWSE
+/** @brief An instance of resolv_browse() waiting in the completion queue,
+  * with the strings inst points to when it is dispatched.
+  */
+typedef struct s_resolv_event_inst {
+  struct s_resolv_event_inst *next; /**< in the free list */
+  RESOLV_SERVICE inst;
+  char name[MAX_NAME_LENGTH];
+  char target[MAX_NAME_LENGTH];
+  u8_t txt[RESOLV_BROWSE_TXT];
+} RESOLV_EVENT_INST;
+#endif
 
-  return payload_len;
-}
+/** @brief A result waiting in the completion queue for resolv_dispatch() to
+  * pass to its callback. Taken from completion_pool; the tcpip thread never
+  * allocates memory for a result.
+  */
+typedef struct s_resolv_event {
+  struct s_resolv_event *next; /**< in the queue or in the free list */
+  u8_t kind; /**< EVENT_QUERY, EVENT_REVERSE or EVENT_BROWSE */
+  user_cb_fn cb; /**< for EVENT_QUERY */
+  reverse_cb_fn rev_cb; /**< for EVENT_REVERSE */
+#if RESOLV_BROWSE
+  browse_cb_fn browse_cb; /**< for EVENT_BROWSE */
+  RESOLV_EVENT_INST *inst; /**< the instance, or NULL at the end of the browse */
+#endif
+  err_t status; /**< as the callback gets it */
+  u8_t has_addr; /**< set to 1 if addr holds the address */
+  u8_t has_name; /**< set to 1 if name holds a name, for EVENT_REVERSE */
+  u32_t ttl; /**< as the callback gets it */
+  ip_addr_t addr;
+  char name[MAX_NAME_LENGTH]; /**< the name the callback gets, the service for EVENT_BROWSE */
+} RESOLV_EVENT;
 
-/*---------------------------------------------------------------------------*
- *
- * Callback for DNS responses
- *
- *---------------------------------------------------------------------------*/
-static void
-resolv_recv(void *s, struct udp_pcb *pcb, struct pbuf *p,
-                                  const ip_addr_t *addr, u16_t port)
-{
-  const char* TAG = "resolv_recv ";
-  ESP_LOGI(TAG, "...resolv_recv function called");
+/* The completion queue, in order, and the free events. The writer appends,
+   the dispatching task takes from the head, both under completion_lock */
+static RESOLV_EVENT completion_pool[RESOLV_COMPLETION_EVENTS];
+static RESOLV_EVENT *completion_free = NULL;
+static RESOLV_EVENT *completion_head = NULL;
+static RESOLV_EVENT *completion_tail = NULL;
+#if RESOLV_BROWSE
+static RESOLV_EVENT_INST completion_inst[RESOLV_BROWSE_INSTANCES];
+static RESOLV_EVENT_INST *completion_inst_free = NULL;
+#endif
+static u32_t completion_lost = 0; /**< results lost to a full pool, logged by dispatch() */
+static SemaphoreHandle_t completion_lock = NULL; /**< created by resolv_init() */
+static SemaphoreHandle_t completion_wake = NULL; /**< given when an event is queued */
+#endif
 
-  char *pHostname;
-  //const char *aHostname; /*pointer for parsing returned buffer*/
-  DNS_ANSWER *ans;
-  DNS_HDR *hdr;
+#if RESOLV_HEALTH
+/** @brief How connects to an address went, from resolv_report_connect() */
+typedef struct s_addr_health {
+  u8_t used;
+  u16_t rtt; /**< smoothed connect RTT in ms, 0 if no connect has succeeded */
+  u16_t penalty; /**< failure penalty in ms as of stamp, see health_cost() */
+  u32_t stamp; /**< resolv_now() time in seconds of the last report */
+  ip_addr_t addr;
+} ADDR_HEALTH;
 
-  //static u8_t nquestions,
-  static u8_t nanswers;
-  static u8_t i;
-  register DNS_TABLE_ENTRY *pEntry;
-  //unsigned char * buf_char_ptr;
-  respFlag = 1;
+/** @brief The address health table.\n
+  * Changed by the writer context only, read by any task with seq_read().
+  */
+typedef struct s_health_table {
+  u32_t seq; /**< see entry_write_begin() */
+  ADDR_HEALTH addrs[RESOLV_HEALTH_ENTRIES];
+} HEALTH_TABLE;
 
-  ESP_LOGI(TAG, "....Buffer length from tot_len is %d", p->len);
+static HEALTH_TABLE health_table;
+#endif
 
-  hdr = (DNS_HDR *)p->payload;
-  ESP_LOGI(TAG, "...ID %d", htons(hdr->id));
-  ESP_LOGI(TAG, "...Query %d", hdr->flags1 & DNS_FLAG1_RESPONSE);
-  ESP_LOGI(TAG, "...Error %d", hdr->flags2 & DNS_FLAG2_ERR_MASK);
-  ESP_LOGI(TAG, "...Num questions %d, answers %d, authrr %d, extrarr %d",
-    htons(hdr->numquestions),
-    htons(hdr->numanswers),
-    htons(hdr->numauthrr),
-    htons(hdr->numextrarr));
+#if RESOLV_BROWSE
+/** @brief The state of one query of resolv_browse().\n
+  * The timer, retries and server work as in DNS_TABLE_ENTRY.
+  */
+typedef struct s_browse_query {
+  u8_t state; /**< STATE_NEW or STATE_ASKING while in flight, STATE_DONE with
+                   the record, STATE_ERROR without, STATE_UNUSED if not needed */
+  u8_t tmr;
+  u8_t retries;
+  u8_t server;
+  u8_t edns; /**< set to 1 if the last query carried an OPT record */
+  u8_t deferred; /**< set to 1 while a send waits for the rate limiter */
+} BROWSE_QUERY;
 
-  // next section if only asking for id 99 - no need to do anything with tables
+#define BROWSE_SRV 0
+#define BROWSE_TXT 1
 
-  if(htons(hdr->id) == 99){
-    payload_len = 12; /*header length*/
-    payload_len += get_qname_len((unsigned char *)p->payload + 12); /*qname len*/
-    payload_len += 4; /* Query Type and Query Class*/
-    pHostname = p->payload + payload_len; //pHostname now points to the start of the RR
-    nanswers = htons(hdr->numanswers);
-
-    while(nanswers > 0){
-      /* The first byte in the answer resource record determines if it
-         is a compressed record or a normal one. */
-
-      int rr_name_len =0; //resource record name length
-      rr_name_len = get_qname_len( (unsigned char *) pHostname);
-      //ESP_LOGI(TAG, "....rr_name_len = %d", rr_name_len);
-      payload_len += rr_name_len;
-      pHostname += rr_name_len; //phostname now points to first byte Post Hostname in RR
-
-      ans = (DNS_ANSWER *)pHostname;
-      /* printf("Answer: type %x, class %x, ttl %x, length %x\n",
-         htons(ans->type), htons(ans->class), (htons(ans->ttl[0])
-           << 16) | htons(ans->ttl[1]), htons(ans->len)); */
-
-      /* dtermine if the anser is for an A type query or and SRV query */
-      if((htons(ans->type) == 1) && (htons(ans->class) == 1) && (htons(ans->len) == 4) ){
-        payload_len += sizeof(DNS_ANSWER);
-        //ESP_LOGI(TAG, "....Header + Question + Name + DNS_Answer  length %d", payload_len);
-      }
-      else{
-        if((htons(ans->type) == 33) && (htons(ans->class) == 1) ){
-          payload_len += (sizeof(DNS_ANSWER) - 4 + htons(ans->len));
-          //ESP_LOGI(TAG, "....Header + Question + Compressed Name length %d", payload_len);
-        }
-      }
-      --nanswers;
-    }
-    memcpy(user_buffer_ptr, p->payload, payload_len);
-    free(p);
-    return;
-  }
+/** @brief A service instance of the browse, from its PTR record until it
+  * is reported.\n
+  * Only used in the writer context.
+  */
+typedef struct s_browse_inst {
+  u8_t used;
+  u8_t settled; /**< set to 1 once reported or given up */
+  u8_t addr_state; /**< STATE_UNUSED until the target is known, then as a query */
+  BROWSE_QUERY q[2]; /**< the SRV and TXT queries */
+  u16_t priority; /**< from the SRV record */
+  u16_t weight;
+  u16_t port;
+  u16_t txt_len; /**< bytes in txt */
+  u32_t ttl; /**< the lowest TTL of the records so far */
+  ip_addr_t addr;
+  char name[MAX_NAME_LENGTH]; /**< the instance as text, its labels joined with dots */
+  u8_t wire[MAX_NAME_LENGTH + 1]; /**< the instance in wire format, as the queries and
+                                       records hold it; a label may contain a dot */
+  u8_t wire_len; /**< bytes in wire, the final 0 included */
+  char target[MAX_NAME_LENGTH]; /**< the host of the SRV record */
+  u8_t txt[RESOLV_BROWSE_TXT]; /**< the strings of the TXT record that fit */
+} BROWSE_INST;
 
-  /* The ID in the DNS header should be our entry into the name table. */
-  i = htons(hdr->id);
-  pEntry = &dns_table[i];
-  if( (i < LWIP_RESOLV_ENTRIES) && (pEntry->state == STATE_ASKING) )
-  {
-    /* This entry is now finished. */
-    pEntry->state = STATE_DONE;
-    pEntry->err = hdr->flags2 & DNS_FLAG2_ERR_MASK;
+/** @brief The browse resolv_browse() runs.\n
+  * Only used in the writer context.
+  */
+typedef struct s_browse {
+  u8_t active;
+  u8_t stepping; /**< set to 1 while browse_step() runs */
+  u8_t again; /**< set to 1 if browse_step() was called while it ran */
+  BROWSE_QUERY ptr; /**< the PTR query of the service */
+  browse_cb_fn cb;
+  char service[MAX_NAME_LENGTH];
+} BROWSE;
 
-    /* Check for error. If so, call callback to inform. */
-    if(pEntry->err != 0)
-    {
-      pEntry->state = STATE_ERROR;
-      if (pEntry->found) /* call specified callback function if provided */
-        (*pEntry->found)(pEntry->name, NULL);
-      return;
-    }
+static BROWSE browse;
+static BROWSE_INST browse_inst[RESOLV_BROWSE_INSTANCES];
+#endif
 
-    /* We only care about the question(s) and the answers. The authrr
-       and the extrarr are simply discarded. */
-    //nquestions = htons(hdr->numquestions);
-    nanswers = htons(hdr->numanswers);
+#if RESOLV_SIM
+/** @brief A query the fault injector holds back */
+typedef struct s_sim_held {
+  u8_t used;
+  int64_t due; /**< resolv_time_us() time to send it */
+  ip_addr_t to;
+  u16_t port;
+  u16_t len;
+  u8_t msg[RESOLV_SIM_MSG];
+} SIM_HELD;
 
-    /* Skip the name in the question. XXX: This should really be
-       checked agains the name in the question, to be sure that they
-       match. */
-    pHostname = (char *) parse_name((unsigned char *)p->payload + 12) + 4;
+/** @brief A timeout of the resolver on the virtual clock */
+typedef struct s_sim_timer {
+  sys_timeout_handler handler; /**< NULL for a free slot */
+  void *arg;
+  int64_t due; /**< resolv_time_us() time to run it */
+} SIM_TIMER;
 
-    while(nanswers > 0)
-    {
-      /* The first byte in the answer resource record determines if it
-         is a compressed record or a normal one. */
-      if(*pHostname & 0xc0)
-      { /* Compressed name. */
-        pHostname +=2;
-        /*	printf("Compressed anwser\n");*/
+/* Only used in the writer context */
+static RESOLV_SIM_HOOKS sim_hooks; /**< all NULL for the real clock and network */
+static RESOLV_SIM_FAULTS sim_faults; /**< all 0 for no faults */
+static u32_t sim_rand; /**< xorshift32 state, from the seed of the faults */
+static SIM_HELD sim_held[RESOLV_SIM_HOLD];
+static SIM_TIMER sim_timers[RESOLV_SIM_TIMERS];
+#endif
+
+#if RESOLV_RATE
+/* Token bucket of the outbound rate limiter, only used in the writer context */
+static u32_t rate_tokens; /**< thousandths of a query */
+static u32_t rate_stamp; /**< resolv_time_us() in ms of the last refill */
+#endif
+
+//sti Test Line follows
+struct ip_addr ipaddr1;
+
+/** resolv_call() runs fn in the writer context and returns its result. When
+  * called from the writer context itself, for example from a resolver callback,
+  * fn runs straight away. */
+static err_t
+resolv_call(tcpip_api_call_fn fn, RESOLV_CALL *msg)
+{
+  if(writer_task != NULL && xTaskGetCurrentTaskHandle() == writer_task)
+    return fn(&msg->call);
+  return tcpip_api_call(fn, &msg->call);
+}
+
+/* Readers on any task or core copy a dns table entry, or the search list,
+ * without taking a lock (seqlock). The writer makes seq odd before it changes
+ * the data and even again when done. A reader retries its copy if seq was odd
+ * or moved while it copied. Callbacks are never called between
+ * entry_write_begin() and entry_write_end(). */
+static void
+seq_write_begin(u32_t *seq)
+{
+  __atomic_store_n(seq, *seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void
+seq_write_end(u32_t *seq)
+{
+  __atomic_store_n(seq, *seq + 1, __ATOMIC_RELEASE);
+}
+
+/** seq_read() takes a consistent copy of data guarded by seq. If the writer
+  * is preempted in the middle of a change the reader sleeps a tick rather than
+  * spin against it. */
+static void
+seq_read(u32_t *seq, void *copy, const void *data, size_t len)
+{
+  u32_t seq1, seq2;
+  int tries = 0;
+
+  for(;;){
+    seq1 = __atomic_load_n(seq, __ATOMIC_ACQUIRE);
+    if(!(seq1 & 1)){
+      memcpy(copy, data, len);
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      seq2 = __atomic_load_n(seq, __ATOMIC_RELAXED);
+      if(seq1 == seq2)
+        return;
+    }
+    if(++tries > 100){
+      vTaskDelay(1);
+      tries = 0;
+    }
+  }
+}
+
+#define entry_write_begin(pEntry) seq_write_begin(&(pEntry)->seq)
+#define entry_write_end(pEntry) seq_write_end(&(pEntry)->seq)
+#define entry_read(pEntry, copy) seq_read(&(pEntry)->seq, (copy), (pEntry), sizeof(DNS_TABLE_ENTRY))
+
+/** clear_entry() resets an entry to unused. The sequence count is not
+  * touched, a reader must never see it even while the rest is cleared.
+  * Must be called between entry_write_begin() and entry_write_end(). */
+static void
+clear_entry(DNS_TABLE_ENTRY *pEntry)
+{
+  memset((u8_t *)pEntry + offsetof(DNS_TABLE_ENTRY, state), 0,
+         sizeof(DNS_TABLE_ENTRY) - offsetof(DNS_TABLE_ENTRY, state));
+  pEntry->prio = RESOLV_PRIO_NORMAL;
+}
+
+/** resolv_time_us() is the clock of the resolver, in microseconds since boot.
+  * A simulation may put a virtual clock in its place. */
+static int64_t
+resolv_time_us(void)
+{
+#if RESOLV_SIM
+  if(sim_hooks.now_us != NULL)
+    return sim_hooks.now_us(sim_hooks.arg);
+#endif
+  return esp_timer_get_time();
+}
+
+/** resolv_timeout() runs handler after ms milliseconds of the clock of the
+  * resolver. On the real clock it is an lwIP timeout, on a virtual clock it
+  * waits in sim_timers for resolv_sim_run() or check_entries(). There is a
+  * slot for each user, so running out of them is a bug of the resolver: it
+  * aborts the simulation rather than let the timeout fall back to the real
+  * clock. Runs in the writer context.
+  *
+  * @param ms the delay
+  * @param handler the function to run
+  * @param arg passed to it */
+static void
+resolv_timeout(u32_t ms, sys_timeout_handler handler, void *arg)
+{
+#if RESOLV_SIM
+  static const char *TAG = "resolv_sim  ";
+  u8_t k;
+
+  if(sim_hooks.now_us != NULL){
+    for(k = 0; k < RESOLV_SIM_TIMERS && sim_timers[k].handler != NULL; ++k);
+    if(k == RESOLV_SIM_TIMERS){
+      ESP_LOGE(TAG, "...no free timer on the virtual clock for %p", handler);
+      abort();
+    }
+    sim_timers[k].handler = handler;
+    sim_timers[k].arg = arg;
+    sim_timers[k].due = resolv_time_us() + (int64_t)ms * 1000;
+    return;
+  }
+#endif
+  sys_timeout(ms, handler, arg);
+}
+
+/** resolv_untimeout() cancels what resolv_timeout() set, on either clock */
+static void
+resolv_untimeout(sys_timeout_handler handler, void *arg)
+{
+#if RESOLV_SIM
+  u8_t k;
+
+  for(k = 0; k < RESOLV_SIM_TIMERS; ++k){
+    if(sim_timers[k].handler == handler && sim_timers[k].arg == arg)
+      sim_timers[k].handler = NULL;
+  }
+#endif
+  sys_untimeout(handler, arg);
+}
+
+#if RESOLV_SIM
+/** sim_timers_run() runs the timeouts due on the virtual clock, the earliest
+  * first, the ones they set included.
+  *
+  * @returns the resolv_time_us() time the next one is due, or -1 if none is
+  * waiting */
+static int64_t
+sim_timers_run(void)
+{
+  sys_timeout_handler handler;
+  void *arg;
+  u8_t k, first;
+
+  for(;;){
+    first = RESOLV_SIM_TIMERS;
+    for(k = 0; k < RESOLV_SIM_TIMERS; ++k){
+      if(sim_timers[k].handler != NULL &&
+         (first == RESOLV_SIM_TIMERS || sim_timers[k].due < sim_timers[first].due))
+        first = k;
+    }
+    if(first == RESOLV_SIM_TIMERS)
+      return -1;
+    if(sim_timers[first].due > resolv_time_us())
+      return sim_timers[first].due;
+    handler = sim_timers[first].handler;
+    arg = sim_timers[first].arg;
+    sim_timers[first].handler = NULL;
+    handler(arg);
+  }
+}
+#endif
+
+/** resolv_now() gives the time in seconds used to age cached addresses */
+static u32_t
+resolv_now(void)
+{
+  return (u32_t)(resolv_time_us() / 1000000);
+}
+
+/** mdns_name() checks if a name is in the link local .local domain, asked by
+  * multicast DNS rather than of the DNS servers (RFC 6762 section 3) */
+static int
+mdns_name(const char *name)
+{
+#if RESOLV_MDNS
+  size_t len = strlen(name);
+
+  if(len > 0 && name[len - 1] == '.')
+    --len;
+  return len > 6 && strncasecmp(name + len - 6, ".local", 6) == 0;
+#else
+  return 0;
+#endif
+}
+
+/** static_hash() is FNV-1a over the lower case name, started from a seed. It
+  * must match static_hash() in gen_static_hosts.py, and decode_name() with a
+  * seed of 0. */
+static u32_t
+static_hash(const char *name, size_t len, u32_t seed)
+{
+  u32_t h = 2166136261u ^ seed;
+
+  while(len-- > 0){
+    h ^= (u8_t)tolower((unsigned char)*name++);
+    h *= 16777619u;
+  }
+  return h;
+}
+
+#if RESOLV_STATIC_HOSTS
+
+/** static_find() looks a hostname up in the static host table: the first
+  * hash picks a bucket, the displacement of the bucket gives the one slot the
+  * name can be in. Case and a trailing dot do not matter.
+  *
+  * @returns the static host or NULL if the name is not in the table */
+static const STATIC_HOST *
+static_find(const char *name)
+{
+  const STATIC_HOST *h;
+  size_t len = strlen(name);
+  u32_t b;
+
+  if(STATIC_HOSTS_COUNT == 0 || len == 0)
+    return NULL;
+  if(name[len - 1] == '.')
+    --len;
+  b = static_hash(name, len, 0) % STATIC_HOSTS_BUCKETS;
+  h = &static_hosts[static_hash(name, len, static_hosts_disp[b]) % STATIC_HOSTS_COUNT];
+  if(strncasecmp(h->name, name, len) != 0 || h->name[len] != 0)
+    return NULL;
+  return h;
+}
+
+/** static_entry() makes a dns table entry for a static host, so the lookup
+  * functions serve it like any other name.
+  *
+  * @param name the hostname
+  * @param copy filled with the entry
+  * @returns 1 if the name is a static host, else 0 */
+static int
+static_entry(const char *name, DNS_TABLE_ENTRY *copy)
+{
+  const STATIC_HOST *h = static_find(name);
+  const u8_t *a;
+  DNS_FAMILY *pFam;
+  u8_t k;
+
+  if(h == NULL)
+    return 0;
+  memset(copy, 0, sizeof(DNS_TABLE_ENTRY));
+  copy->state = STATE_DONE;
+  a = &static_hosts_addrs[h->addr];
+  pFam = &copy->fam[FAM_V4];
+  for(k = 0; k < h->n4; ++k, a += 4){
+    if(k < RESOLV_MAX_ADDRS){
+      memcpy(&ip_2_ip4(&pFam->addrs[k])->addr, a, 4);
+      pFam->addrs[k].type = IPADDR_TYPE_V4;
+      pFam->count++;
+    }
+  }
+#if RESOLV_AAAA
+  pFam = &copy->fam[FAM_V6];
+  for(k = 0; k < h->n6; ++k, a += 16){
+    if(k < RESOLV_MAX_ADDRS){
+      memcpy(ip_2_ip6(&pFam->addrs[k])->addr, a, 16);
+      pFam->addrs[k].type = IPADDR_TYPE_V6;
+      pFam->count++;
+    }
+  }
+#endif
+  for(k = 0; k < FAM_COUNT; ++k){
+    if(copy->fam[k].count > 0){
+      copy->fam[k].state = STATE_DONE;
+      copy->fam[k].expires = resolv_now() + RESOLV_STATIC_TTL;
+    }
+  }
+  return 1;
+}
+
+#if RESOLV_RES_QUERY
+/** static_reply() makes up the reply to an A or AAAA query for a static host,
+  * as res_query_jps() hands it back. Addresses that do not fit in answer are
+  * left out and the reply is marked truncated.
+  *
+  * @returns the length of the reply, or 0 if the question is not for a static
+  * host */
+static int
+static_reply(const char *dname, int class, int type, unsigned char *answer, int anslen)
+{
+  const STATIC_HOST *h;
+  const u8_t *a;
+  DNS_HDR *hdr = (DNS_HDR *)answer;
+  unsigned char *ptr, *end = answer + anslen;
+  const char *label;
+  size_t n;
+  u8_t k, count, alen;
+
+  if(class != MESSAGE_C_IN || (type != MESSAGE_T_A && type != MESSAGE_T_AAAA))
+    return 0;
+  h = static_find(dname);
+  if(h == NULL || anslen < (int)sizeof(DNS_HDR) + (int)strlen(dname) + 6)
+    return 0;
+
+  memset(hdr, 0, sizeof(DNS_HDR));
+  hdr->id = htons(RES_QUERY_ID);
+  hdr->flags1 = DNS_FLAG1_RESPONSE | DNS_FLAG1_AUTHORATIVE | DNS_FLAG1_RD;
+  hdr->flags2 = DNS_FLAG2_RA;
+  hdr->numquestions = htons(1);
+
+  /* the question, with the name as asked for */
+  ptr = answer + sizeof(DNS_HDR);
+  for(label = dname; *label; label += n){
+    n = strcspn(label, ".");
+    *ptr++ = n;
+    memcpy(ptr, label, n);
+    ptr += n;
+    if(label[n] == '.')
+      ++n;
+  }
+  *ptr++ = 0;
+  *ptr++ = 0;
+  *ptr++ = type;
+  *ptr++ = 0;
+  *ptr++ = MESSAGE_C_IN;
+
+  /* the answers point back at the question name */
+  a = &static_hosts_addrs[h->addr];
+  count = h->n4;
+  alen = 4;
+  if(type == MESSAGE_T_AAAA){
+    a += 4 * h->n4;
+    count = h->n6;
+    alen = 16;
+  }
+  for(k = 0; k < count; ++k, a += alen){
+    if(ptr + 12 + alen > end){
+      hdr->flags1 |= DNS_FLAG1_TRUNC;
+      break;
+    }
+    *ptr++ = 0xc0;
+    *ptr++ = sizeof(DNS_HDR);
+    *ptr++ = 0;
+    *ptr++ = type;
+    *ptr++ = 0;
+    *ptr++ = MESSAGE_C_IN;
+    *ptr++ = RESOLV_STATIC_TTL >> 24;
+    *ptr++ = (RESOLV_STATIC_TTL >> 16) & 0xff;
+    *ptr++ = (RESOLV_STATIC_TTL >> 8) & 0xff;
+    *ptr++ = RESOLV_STATIC_TTL & 0xff;
+    *ptr++ = 0;
+    *ptr++ = alen;
+    memcpy(ptr, a, alen);
+    ptr += alen;
+  }
+  hdr->numanswers = htons(k);
+  return ptr - answer;
+}
+#endif
+#endif
+
+/** print_buf prints out a buffer. This makes it easier to troubleshoot
+  * buffers sent or ceived from the DNS server */
+void print_buf(unsigned char *buf, int length) {
+  unsigned char * buf_char_ptr;
+  static const char *TAG = "print_buf   ";
+  buf_char_ptr = buf;
+  for (int i=0; i < length; i++){
+    if ((*buf_char_ptr > 64 && *buf_char_ptr <91) ||
+      (*buf_char_ptr > 96 && *buf_char_ptr <123)){
+      ESP_LOGI(TAG, "....%d Letter in received buffer: %c", i+1, *buf_char_ptr);
+    }
+    else{
+      ESP_LOGI(TAG, "....%d Hex in received buffer   : %X", i+1, *buf_char_ptr);
+    }
+    buf_char_ptr++;
+  } // check printer buffer end *
+}
+
+/** encode_name() writes a dotted name as the labels of a question, each
+  * preceded by its length. The zero label that ends the name is left to the
+  * caller, with the type and class.
+  *
+  * @param name the name, shorter than MAX_NAME_LENGTH
+  * @param query where the labels go, MAX_NAME_LENGTH bytes
+  * @returns the length of the labels in bytes */
+static int
+encode_name(const char *name, char *query)
+{
+  char *nptr;
+  int len = 0;
+  u8_t n;
+
+  do
+  {
+    nptr = query++;
+    for(n = 0; *name != '.' && *name != 0; ++name, ++n)
+      *query++ = *name;
+    *nptr = n;
+    len += n + 1;
+  }
+  while(*name++ != 0);
+  return len;
+}
+
+/** decode_name() reads an encoded name of a received buffer in one pass: it
+  * steps over the name, writes it as text and hashes it. Compression pointers
+  * are followed, but only to a byte before any part of the name read so far,
+  * so a loop of pointers cannot be built. Every label is checked against the
+  * end of the buffer.
+  *
+  * @param msg a pointer to the start of the received buffer
+  * @param end a pointer to the first byte after the received buffer
+  * @param ptr a pointer to the start of the name
+  * @param out where the name goes, without a trailing dot, or NULL
+  * @param len size of out; a longer name is malformed, even if out is NULL
+  * @param hash gets static_hash() of the name with seed 0, or NULL
+  * @returns pointer to the byte after the name where it starts, or NULL if
+  * the name is malformed, runs past end or does not fit */
+static unsigned char *
+decode_name(unsigned char *msg, unsigned char *end, unsigned char *ptr,
+            char *out, size_t len, u32_t *hash)
+{
+  unsigned char *next = NULL, *low = ptr;
+  u32_t h = 2166136261u;
+  size_t o = 0;
+  u8_t n, k;
+
+  while(ptr < end){
+    n = *ptr;
+    if(n == 0){
+      if(out != NULL)
+        out[o] = 0;
+      if(hash != NULL)
+        *hash = h;
+      return (next != NULL) ? next : ptr + 1;
+    }
+    if((n & 0xc0) == 0xc0){
+      if(ptr + 2 > end)
+        return NULL;
+      if(next == NULL)
+        next = ptr + 2;
+      ptr = msg + (((n & 0x3f) << 8) | ptr[1]);
+      if(ptr >= low)
+        return NULL;
+      low = ptr;
+      continue;
+    }
+    if((n & 0xc0) != 0 || ptr + 1 + n > end || o + (o > 0) + n + 1 > len)
+      return NULL;
+    if(o > 0){
+      if(out != NULL)
+        out[o] = '.';
+      h = (h ^ '.') * 16777619u;
+      ++o;
+    }
+    for(k = 1; k <= n; ++k, ++o){
+      if(out != NULL)
+        out[o] = ptr[k];
+      h = (h ^ (u8_t)tolower(ptr[k])) * 16777619u;
+    }
+    ptr += n + 1;
+  }
+  return NULL;
+}
+
+/** get_ttl() reads the TTL of a resource record. RFC 2181 section 8: a TTL
+  * with the top bit set is treated as zero.
+  *
+  * @param rr a pointer to the type field of the record
+  * @returns the TTL in seconds, at most RESOLV_MAX_TTL */
+static u32_t
+get_ttl(unsigned char *rr)
+{
+  u32_t ttl = ((u32_t)GET16(rr + 4) << 16) | GET16(rr + 6);
+
+  if(ttl & 0x80000000)
+    ttl = 0;
+  if(ttl > RESOLV_MAX_TTL)
+    ttl = RESOLV_MAX_TTL;
+  return ttl;
+}
+
+/** parse_msg() walks every section of a reply once and keeps what the
+  * resolver needs from it:
+  * - the first question, as text and hashed;
+  * - the answers of class IN, whose class top bit is the mDNS cache flush bit,
+  *   with the hash of their owner, up to RESOLV_PARSE_RRS;
+  * - with RESOLV_BROWSE, the records of class IN of the additional section
+  *   after them, for the SRV, TXT and addresses a DNS-SD server sends along;
+  * - the full response code. With EDNS the 4 bit RCODE in the header is only
+  *   the low part, the upper 8 bits are in the TTL of the OPT record in the
+  *   additional section (RFC 6891 6.1.3);
+  * - how long a negative answer may be cached: the smaller of the TTL and the
+  *   MINIMUM field of the first SOA record of the authority section (RFC 2308
+  *   section 5), 0 without one.
+  * A malformed record ends the parse, the records before it are kept.
+  *
+  * @param msg the reply
+  * @param len length of the reply
+  * @param m gets the result
+  * @returns 1, or 0 if the header or the question section is malformed */
+static int
+parse_msg(unsigned char *msg, u16_t len, DNS_MSG *m)
+{
+  DNS_HDR *hdr = (DNS_HDR *)msg;
+  unsigned char *ptr = msg + sizeof(DNS_HDR), *rdata;
+  int nquestions, nanswers, nauth, nrecords, k;
+  u32_t hash, ttl, minimum;
+  DNS_RR *pRR;
+  u16_t owner;
+  u8_t soa = 0;
+
+  m->msg = msg;
+  m->end = msg + len;
+  m->nrrs = 0;
+  m->nadd = 0;
+  m->neg_ttl = 0;
+  m->qname[0] = 0;
+  m->qhash = static_hash("", 0, 0);
+  m->qtype = 0;
+  m->qclass = 0;
+  m->rcode = 0;
+  if(len < sizeof(DNS_HDR))
+    return 0;
+  m->rcode = hdr->flags2 & DNS_FLAG2_ERR_MASK;
+  nquestions = htons(hdr->numquestions);
+  nanswers = htons(hdr->numanswers);
+  nauth = htons(hdr->numauthrr);
+  nrecords = nanswers + nauth + htons(hdr->numextrarr);
+
+  /* each question is a name followed by QTYPE and QCLASS */
+  for(k = 0; k < nquestions; ++k){
+    ptr = (k == 0) ? decode_name(msg, m->end, ptr, m->qname, MAX_NAME_LENGTH, &m->qhash) :
+                     decode_name(msg, m->end, ptr, NULL, DNS_WIRE_NAME, NULL);
+    if(ptr == NULL || ptr + 4 > m->end)
+      return 0;
+    if(k == 0){
+      m->qtype = GET16(ptr);
+      m->qclass = GET16(ptr + 2);
+    }
+    ptr += 4;
+  }
+  /* each resource record is a name followed by TYPE, CLASS, TTL, RDLEN and RDATA */
+  for(k = 0; k < nrecords; ++k){
+    owner = ptr - msg;
+    ptr = decode_name(msg, m->end, ptr, NULL, DNS_WIRE_NAME, &hash);
+    if(ptr == NULL || ptr + 10 > m->end || ptr + 10 + GET16(ptr + 8) > m->end)
+      break;
+    rdata = ptr + 10;
+    if(k < nanswers){
+      if((GET16(ptr + 2) & 0x7fff) == MESSAGE_C_IN && m->nrrs < RESOLV_PARSE_RRS){
+        pRR = &m->rrs[m->nrrs];
+        pRR->owner = owner;
+        pRR->hash = hash;
+        pRR->ttl = get_ttl(ptr);
+        pRR->type = GET16(ptr);
+        pRR->rdata = rdata - msg;
+        pRR->rdlen = GET16(ptr + 8);
+        m->nrrs++;
+      }
+    }
+    else if(k < nanswers + nauth){
+      if(GET16(ptr) == MESSAGE_T_SOA && !soa){
+        soa = 1;
+        ttl = ((u32_t)GET16(ptr + 4) << 16) | GET16(ptr + 6);
+        /* MNAME and RNAME, then SERIAL, REFRESH, RETRY, EXPIRE and MINIMUM */
+        rdata = decode_name(msg, m->end, rdata, NULL, DNS_WIRE_NAME, NULL);
+        if(rdata != NULL)
+          rdata = decode_name(msg, m->end, rdata, NULL, DNS_WIRE_NAME, NULL);
+        if(rdata != NULL && rdata + 20 <= ptr + 10 + GET16(ptr + 8)){
+          minimum = ((u32_t)GET16(rdata + 16) << 16) | GET16(rdata + 18);
+          if(minimum < ttl)
+            ttl = minimum;
+          if(ttl & 0x80000000)
+            ttl = 0;
+          m->neg_ttl = (ttl > RESOLV_MAX_NEG_TTL) ? RESOLV_MAX_NEG_TTL : ttl;
+        }
+      }
+    }
+#if RESOLV_EDNS
+    else if(GET16(ptr) == MESSAGE_T_OPT){
+      m->rcode |= (u16_t)ptr[4] << 4; /* first byte of the TTL is EXTENDED-RCODE */
+    }
+#endif
+#if RESOLV_BROWSE
+    /* a DNS-SD server sends the SRV, TXT and address records of the
+       instances along, to save the queries for them */
+    else if((GET16(ptr + 2) & 0x7fff) == MESSAGE_C_IN && m->nrrs + m->nadd < RESOLV_PARSE_RRS){
+      pRR = &m->rrs[m->nrrs + m->nadd];
+      pRR->owner = owner;
+      pRR->hash = hash;
+      pRR->ttl = get_ttl(ptr);
+      pRR->type = GET16(ptr);
+      pRR->rdata = rdata - msg;
+      pRR->rdlen = GET16(ptr + 8);
+      m->nadd++;
+    }
+#endif
+    ptr += 10 + GET16(ptr + 8);
+  }
+  return 1;
+}
+
+/** add_edns_opt() writes an EDNS(0) OPT pseudo resource record at query if EDNS
+  * is enabled and the DNS server has not rejected it, and counts it in the header.
+  *
+  * @param hdr the header of the query being built
+  * @param query a pointer to the byte after the question section
+  * @param srv index in servers of the server the query goes to
+  * @returns the number of bytes written, 0 if no OPT record was added */
+static int
+add_edns_opt(DNS_HDR *hdr, char *query, u8_t srv)
+{
+#if RESOLV_EDNS
+  if(!servers[srv].edns_off){
+    static const unsigned char opt[MESSAGE_OPT_LEN] = {
+      0,                            /* root name */
+      0, MESSAGE_T_OPT,             /* TYPE OPT */
+      RESOLV_EDNS_UDP_SIZE >> 8,    /* CLASS carries the UDP payload size */
+      RESOLV_EDNS_UDP_SIZE & 0xff,
+      0, 0, 0, 0,                   /* extended RCODE, version 0, no flags */
+      0, 0                          /* no options */
+    };
+    memcpy(query, opt, MESSAGE_OPT_LEN);
+    hdr->numextrarr = htons(1);
+    return MESSAGE_OPT_LEN;
+  }
+#endif
+  return 0;
+}
+
+/** edns_rejected() checks if an error reply is the DNS server refusing the
+  * OPT record rather than the question. FORMERR and NOTIMP come from servers
+  * that predate RFC 6891, BADVERS from ones that do not speak version 0.
+  * If so EDNS is switched off for the server so the query can be sent again.
+  *
+  * @param srv index in servers of the server that replied
+  * @param sent_opt set to 1 if the query carried an OPT record
+  * @param rcode the full RCODE of the reply
+  * @returns 1 if the query should be repeated without the OPT record */
+static int
+edns_rejected(u8_t srv, u8_t sent_opt, u16_t rcode)
+{
+  static const char *TAG = "edns        ";
+  if(sent_opt && (rcode == DNS_FLAG2_ERR_FORMAT || rcode == DNS_FLAG2_ERR_NOTIMP ||
+                  rcode == DNS_RCODE_BADVERS)){
+    ESP_LOGI(TAG, "...DNS server rejected EDNS (rcode %d), retry without OPT", rcode);
+    servers[srv].edns_off = 1;
+    return 1;
+  }
+  return 0;
+}
+
+#if RESOLV_TCP
+static void resolv_recv(void *s, struct udp_pcb *pcb, struct pbuf *p,
+                        const ip_addr_t *addr, u16_t port);
+
+/** tcp_conn_close() closes the connection to a server, if any.
+  *
+  * @returns 1 if the pcb had to be aborted, else 0 */
+static int
+tcp_conn_close(u8_t srv)
+{
+  DNS_TCP *c = &tcp_conns[srv];
+  int aborted = 0;
+
+  if(c->pcb != NULL){
+    tcp_arg(c->pcb, NULL);
+    tcp_recv(c->pcb, NULL);
+    tcp_err(c->pcb, NULL);
+    tcp_poll(c->pcb, NULL, 0);
+    if(tcp_close(c->pcb) != ERR_OK){
+      tcp_abort(c->pcb);
+      aborted = 1;
+    }
+  }
+  if(c->rx != NULL)
+    pbuf_free(c->rx);
+  memset(c, 0, sizeof(DNS_TCP));
+  return aborted;
+}
+
+/** tcp_conn_close_all() closes every connection, when the servers change */
+static void
+tcp_conn_close_all(void)
+{
+  u8_t k;
+
+  for(k = 0; k < RESOLV_MAX_SERVERS; ++k)
+    tcp_conn_close(k);
+}
+
+/** tcp_conn_err() is called by lwIP when a connection fails; the pcb is
+  * already freed. A server that never accepted the connection is asked over
+  * UDP from then on. Queries lost with the connection are sent again by the
+  * retries of check_entries(). */
+static void
+tcp_conn_err(void *arg, err_t err)
+{
+  static const char *TAG = "resolv tcp  ";
+  u8_t srv = (u8_t)(mem_ptr_t)arg;
+  DNS_TCP *c = &tcp_conns[srv];
+
+  ESP_LOGI(TAG, "...connection to server %d lost: %d", srv, (int)err);
+  if(!c->open)
+    servers[srv].tcp_off = 1;
+  c->pcb = NULL;
+  tcp_conn_close(srv);
+}
+
+/** tcp_conn_connected() is called by lwIP once the connection is up. Queries
+  * written while it was being opened go out now. */
+static err_t
+tcp_conn_connected(void *arg, struct tcp_pcb *pcb, err_t err)
+{
+  DNS_TCP *c = &tcp_conns[(u8_t)(mem_ptr_t)arg];
+
+  c->open = 1;
+  c->last_used = resolv_now();
+  tcp_output(pcb);
+  return ERR_OK;
+}
+
+/** tcp_conn_recv() takes the bytes of the stream and hands every whole reply
+  * to resolv_recv(), as if it had come over UDP. */
+static err_t
+tcp_conn_recv(void *arg, struct tcp_pcb *pcb, struct pbuf *p, err_t err)
+{
+  u8_t srv = (u8_t)(mem_ptr_t)arg;
+  DNS_TCP *c = &tcp_conns[srv];
+  struct pbuf *q;
+  u16_t len, n;
+
+  if(p == NULL){
+    /* the server closed the connection, the next query opens a new one */
+    return tcp_conn_close(srv) ? ERR_ABRT : ERR_OK;
+  }
+  tcp_recved(pcb, p->tot_len);
+  c->last_used = resolv_now();
+
+  /* drop what is left of a reply too long to take */
+  n = (c->skip < p->tot_len) ? c->skip : p->tot_len;
+  c->skip -= n;
+  if(n == p->tot_len){
+    pbuf_free(p);
+    return ERR_OK;
+  }
+  p = pbuf_free_header(p, n);
+  if(c->rx == NULL)
+    c->rx = p;
+  else
+    pbuf_cat(c->rx, p);
+
+  while(c->rx != NULL && c->rx->tot_len >= 2){
+    len = ((u16_t)pbuf_get_at(c->rx, 0) << 8) | pbuf_get_at(c->rx, 1);
+    if(len > RESOLV_TCP_MAX_MSG){
+      n = (c->rx->tot_len < (u32_t)len + 2) ? c->rx->tot_len : len + 2;
+      c->skip = (u32_t)len + 2 - n;
+      c->rx = pbuf_free_header(c->rx, n);
+      continue;
+    }
+    if(c->rx->tot_len < len + 2)
+      break;
+    q = pbuf_alloc(PBUF_RAW, len, PBUF_RAM);
+    if(q != NULL)
+      pbuf_copy_partial(c->rx, q->payload, len, 2);
+    c->rx = pbuf_free_header(c->rx, len + 2);
+    if(q != NULL){
+      resolv_recv(NULL, NULL, q, &servers[srv].addr, DNS_SERVER_PORT);
+      /* a callback may have changed the servers and closed this connection */
+      if(c->pcb != pcb)
+        return ERR_ABRT;
+    }
+  }
+  return ERR_OK;
+}
+
+/** tcp_conn_poll() closes a connection that has been idle for
+  * RESOLV_TCP_IDLE_S seconds */
+static err_t
+tcp_conn_poll(void *arg, struct tcp_pcb *pcb)
+{
+  u8_t srv = (u8_t)(mem_ptr_t)arg;
+  DNS_TCP *c = &tcp_conns[srv];
+
+  if(c->open && (s32_t)(resolv_now() - c->last_used) >= RESOLV_TCP_IDLE_S)
+    return tcp_conn_close(srv) ? ERR_ABRT : ERR_OK;
+  return ERR_OK;
+}
+
+/** tcp_conn_send() writes a query on the connection to a server, opening the
+  * connection first if there is none. The length prefix and the query go
+  * out in one write, so a failed write cannot leave half a frame on the
+  * stream. Runs in the writer context.
+  *
+  * @returns 1 if the query was queued, 0 if the server is to be asked over
+  * UDP, also when the send buffer of the connection is full */
+static int
+tcp_conn_send(u8_t srv, unsigned char *msg, u16_t len)
+{
+  static const char *TAG = "resolv tcp  ";
+  DNS_TCP *c = &tcp_conns[srv];
+
+  if(servers[srv].tcp_off || len > RESOLV_TCP_MAX_QUERY)
+    return 0;
+  if(c->pcb == NULL){
+    c->pcb = tcp_new_ip_type(IP_GET_TYPE(&servers[srv].addr));
+    if(c->pcb == NULL)
+      return 0;
+    tcp_arg(c->pcb, (void *)(mem_ptr_t)srv);
+    tcp_err(c->pcb, tcp_conn_err);
+    tcp_recv(c->pcb, tcp_conn_recv);
+    tcp_poll(c->pcb, tcp_conn_poll, RESOLV_TCP_POLL);
+    tcp_nagle_disable(c->pcb); /* queries are small and each one waits for its reply */
+    if(tcp_connect(c->pcb, &servers[srv].addr, DNS_SERVER_PORT, tcp_conn_connected) != ERR_OK){
+      tcp_conn_close(srv);
+      return 0;
+    }
+  }
+
+  /* lwIP queues the data while the connection is being opened. A burst
+     that fills the send buffer goes on over UDP rather than wait for the
+     retry */
+  tcp_frame[0] = len >> 8;
+  tcp_frame[1] = len & 0xff;
+  memcpy(tcp_frame + 2, msg, len);
+  if(tcp_sndbuf(c->pcb) < len + 2 || tcp_sndqueuelen(c->pcb) + 1 > TCP_SND_QUEUELEN ||
+     tcp_write(c->pcb, tcp_frame, len + 2, TCP_WRITE_FLAG_COPY) != ERR_OK){
+    ESP_LOGD(TAG, "...send buffer to %s full, query sent over UDP", ipaddr_ntoa(&servers[srv].addr));
+    return 0;
+  }
+  c->last_used = resolv_now();
+  if(c->open)
+    tcp_output(c->pcb);
+  return 1;
+}
+#endif
+
+#if RESOLV_CAPTURE
+/** capture_copy() copies bytes in or out of the ring, wrapping around its end.
+  *
+  * @param pos offset in the ring
+  * @param data the bytes
+  * @param len number of bytes
+  * @param out set to 1 to copy out of the ring, 0 to copy in
+  * @returns the offset after the bytes */
+static size_t
+capture_copy(size_t pos, void *data, size_t len, u8_t out)
+{
+  size_t n = RESOLV_CAPTURE_SIZE - pos;
+
+  if(n > len)
+    n = len;
+  if(out){
+    memcpy(data, &capture_ring[pos], n);
+    memcpy((u8_t *)data + n, capture_ring, len - n);
+  }
+  else{
+    memcpy(&capture_ring[pos], data, n);
+    memcpy(capture_ring, (u8_t *)data + n, len - n);
+  }
+  return (pos + len) % RESOLV_CAPTURE_SIZE;
+}
+
+/** capture_msg() puts a DNS message in the capture ring. Runs in the writer
+  * context.
+  *
+  * @param dir CAPTURE_OUT or CAPTURE_IN
+  * @param peer the DNS server
+  * @param port port of the peer
+  * @param p the message, a pbuf chain for a reply
+  * @param msg the message, for a query when p is NULL
+  * @param len length of the message */
+static void
+capture_msg(u8_t dir, const ip_addr_t *peer, u16_t port, struct pbuf *p, const unsigned char *msg, u16_t len)
+{
+  CAPTURE_REC rec;
+  CAPTURE_REC old;
+  int64_t t = resolv_time_us();
+  size_t need = sizeof(CAPTURE_REC) + len;
+  struct pbuf *q;
+
+  if(!capture_on || need > RESOLV_CAPTURE_SIZE)
+    return;
+  /* drop the oldest messages until this one fits */
+  while(RESOLV_CAPTURE_SIZE - capture_used < need){
+    capture_copy(capture_tail, &old, sizeof(old), 1);
+    capture_tail = (capture_tail + sizeof(old) + old.len) % RESOLV_CAPTURE_SIZE;
+    capture_used -= sizeof(old) + old.len;
+  }
+  memset(&rec, 0, sizeof(rec));
+  rec.sec = (u32_t)(t / 1000000);
+  rec.usec = (u32_t)(t % 1000000);
+  rec.len = len;
+  rec.dir = dir;
+  rec.port = port;
+  rec.peer = *peer;
+  capture_head = capture_copy(capture_head, &rec, sizeof(rec), 0);
+  if(p == NULL){
+    capture_head = capture_copy(capture_head, (void *)msg, len, 0);
+  }
+  else{
+    for(q = p; q != NULL && len > 0; q = q->next){
+      capture_head = capture_copy(capture_head, q->payload, (q->len < len) ? q->len : len, 0);
+      len -= (q->len < len) ? q->len : len;
+    }
+  }
+  capture_used += need;
+}
+#endif
+
+/** udp_out() sends a message from the resolver's UDP pcb */
+static void
+udp_out(const ip_addr_t *to, u16_t port, const unsigned char *msg, u16_t len)
+{
+  struct pbuf *p;
+
+#if RESOLV_SIM
+  if(sim_hooks.send != NULL){
+    sim_hooks.send(to, port, msg, len, sim_hooks.arg);
+    return;
+  }
+#endif
+  p = pbuf_alloc(PBUF_TRANSPORT, len, PBUF_RAM);
+  if(p == NULL)
+    return;
+  pbuf_take(p, msg, len);
+  udp_sendto(resolv_pcb, p, to, port);
+  pbuf_free(p);
+}
+
+#if RESOLV_SIM
+/** sim_roll() draws the next random choice of the fault injector.
+  *
+  * @param pct chance in percent
+  * @returns 1 with a chance of pct percent */
+static int
+sim_roll(u8_t pct)
+{
+  if(pct == 0)
+    return 0;
+  sim_rand ^= sim_rand << 13;
+  sim_rand ^= sim_rand >> 17;
+  sim_rand ^= sim_rand << 5;
+  return (sim_rand % 100) < pct;
+}
+
+/** sim_release() sends the held queries whose delay is over */
+static void
+sim_release(void)
+{
+  int64_t now = resolv_time_us();
+  u8_t k;
+
+  for(k = 0; k < RESOLV_SIM_HOLD; ++k){
+    if(sim_held[k].used && sim_held[k].due <= now){
+      sim_held[k].used = 0;
+      udp_out(&sim_held[k].to, sim_held[k].port, sim_held[k].msg, sim_held[k].len);
+    }
+  }
+}
+#endif
+
+/** net_send() sends a query over UDP, through the fault injector if one is
+  * set. Runs in the writer context.
+  *
+  * @param to the server, or the mDNS group
+  * @param port its port
+  * @param msg the query
+  * @param len length of the query in bytes */
+static void
+net_send(const ip_addr_t *to, u16_t port, const unsigned char *msg, u16_t len)
+{
+#if RESOLV_SIM
+  u8_t k;
+
+  sim_release();
+  if(sim_roll(sim_faults.loss))
+    return;
+  if(sim_roll(sim_faults.delay) && len <= RESOLV_SIM_MSG){
+    for(k = 0; k < RESOLV_SIM_HOLD && sim_held[k].used; ++k);
+    if(k < RESOLV_SIM_HOLD){
+      sim_held[k].used = 1;
+      sim_held[k].due = resolv_time_us() + (int64_t)sim_faults.delay_ms * 1000;
+      sim_held[k].to = *to;
+      sim_held[k].port = port;
+      sim_held[k].len = len;
+      memcpy(sim_held[k].msg, msg, len);
+      return;
+    }
+  }
+  if(sim_roll(sim_faults.dup))
+    udp_out(to, port, msg, len);
+#endif
+  udp_out(to, port, msg, len);
+}
+
+/** send_msg() sends a query to a DNS server. Runs in the writer context.
+  *
+  * @param srv index in servers of the server to send to
+  * @param msg the query
+  * @param len length of the query in bytes */
+static void
+send_msg(u8_t srv, unsigned char *msg, u16_t len)
+{
+  if(srv >= nservers)
+    return;
+#if RESOLV_CAPTURE
+  capture_msg(CAPTURE_OUT, &servers[srv].addr, DNS_SERVER_PORT, NULL, msg, len);
+  if(replay_buf != NULL)
+    return; /* the replies come from the capture being replayed */
+#endif
+#if RESOLV_TCP
+#if RESOLV_SIM
+  if(sim_hooks.send == NULL) /* the in-memory network is UDP only */
+#endif
+  if(tcp_conn_send(srv, msg, len))
+    return;
+#endif
+  net_send(&servers[srv].addr, DNS_SERVER_PORT, msg, len);
+}
+
+#if RESOLV_MDNS
+/** send_mdns() sends a one-shot query to the mDNS group. Being sent from
+  * another port than MDNS_PORT, responders answer it by unicast to that
+  * port, with the ID of the query (RFC 6762 section 6.7).
+  *
+  * @param msg the query
+  * @param len length of the query in bytes */
+static void
+send_mdns(unsigned char *msg, u16_t len)
+{
+  ip_addr_t group;
+
+  memset(&group, 0, sizeof(group));
+  IP_ADDR4(&group, 224, 0, 0, 251);
+#if RESOLV_CAPTURE
+  capture_msg(CAPTURE_OUT, &group, MDNS_PORT, NULL, msg, len);
+  if(replay_buf != NULL)
+    return;
+#endif
+  net_send(&group, MDNS_PORT, msg, len);
+}
+
+/** mdns_reply() checks if a reply from MDNS_PORT answers a query in flight
+  * for a .local name. Any responder on the link may answer; the first answer
+  * is taken. */
+static int
+mdns_reply(DNS_HDR *hdr, u16_t port)
+{
+  u16_t i = QUERY_ID_ENTRY(htons(hdr->id));
+  u8_t fam = QUERY_ID_FAM(htons(hdr->id));
+
+  return port == MDNS_PORT && i < LWIP_RESOLV_ENTRIES && fam < FAM_COUNT &&
+         dns_table[i].mdns && dns_table[i].fam[fam].state == STATE_ASKING;
+}
+#endif
+
+/** find_server() gives the index in servers of the address a reply came from.
+  * Replies from anywhere else are dropped.
+  *
+  * @returns the index or -1 if the address is not a configured server */
+static int
+find_server(const ip_addr_t *addr)
+{
+  int k;
+
+  for(k = 0; k < nservers; ++k){
+    if(ip_addr_cmp(&servers[k].addr, addr))
+      return k;
+  }
+  return -1;
+}
+
+/** use_server() makes a server the first choice for new queries */
+static void
+use_server(u8_t srv)
+{
+  cur_server = srv;
+  __atomic_store_n(&serverIP.addr,
+                   IP_IS_V4(&servers[srv].addr) ? ip_2_ip4(&servers[srv].addr)->addr : 0,
+                   __ATOMIC_RELAXED);
+}
+
+/** rate_take() takes tokens of the outbound rate limiter. The bucket fills at
+  * RESOLV_RATE queries per second up to RESOLV_BURST.
+  *
+  * @param n number of queries to send
+  * @returns 1 if they may be sent now, 0 if they have to wait */
+static int
+rate_take(u8_t n)
+{
+#if RESOLV_RATE
+  u32_t now = (u32_t)(resolv_time_us() / 1000);
+  u32_t ms = now - rate_stamp;
+
+  rate_stamp = now;
+  if(ms > RESOLV_BURST * 1000)
+    ms = RESOLV_BURST * 1000; /* enough to fill the bucket */
+  rate_tokens += ms * RESOLV_RATE;
+  if(rate_tokens > RESOLV_BURST * 1000)
+    rate_tokens = RESOLV_BURST * 1000;
+  if(rate_tokens < n * 1000u)
+    return 0;
+  rate_tokens -= n * 1000u;
+#endif
+  return 1;
+}
+
+/** rate_wait() gives the time in ms until the rate limiter has a token */
+static u32_t
+rate_wait(void)
+{
+#if RESOLV_RATE
+  if(rate_tokens < 1000)
+    return (1000 - rate_tokens + RESOLV_RATE - 1) / RESOLV_RATE;
+#endif
+  return 0;
+}
+
+/** cname_find() returns the cached link of an alias if it is still valid
+  *
+  * @param name the alias
+  * @returns the link or NULL */
+static CNAME_LINK *
+cname_find(const char *name)
+{
+  u8_t k;
+
+  for(k = 0; k < RESOLV_CNAME_ENTRIES; ++k){
+    if(cname_table[k].owner[0] != 0 && (s32_t)(cname_table[k].expires - resolv_now()) > 0 &&
+       strcasecmp(cname_table[k].owner, name) == 0)
+      return &cname_table[k];
+  }
+  return NULL;
+}
+
+/** cname_follow() follows the cached links from a name, at most
+  * RESOLV_CNAME_DEPTH of them so a loop of links ends.
+  *
+  * @param name where to start
+  * @param stop if not NULL, stop when this name is reached
+  * @returns the last name reached, the name to ask the server for */
+static const char *
+cname_follow(const char *name, const char *stop)
+{
+  CNAME_LINK *link;
+  u8_t n;
+
+  for(n = 0; n < RESOLV_CNAME_DEPTH; ++n){
+    if(stop != NULL && strcasecmp(name, stop) == 0)
+      break;
+    link = cname_find(name);
+    if(link == NULL)
+      break;
+    name = link->target;
+  }
+  return name;
+}
+
+/** cname_learn() caches a link of a CNAME chain, in place of the link of the
+  * same alias, else of the link that expires first.
+  *
+  * @param owner the alias
+  * @param target the name it stands for
+  * @param ttl time to live of the record, a link of TTL 0 is not kept */
+static void
+cname_learn(const char *owner, const char *target, u32_t ttl)
+{
+  u8_t k, slot = 0;
+
+  if(ttl == 0)
+    return;
+  for(k = 0; k < RESOLV_CNAME_ENTRIES; ++k){
+    if(strcasecmp(cname_table[k].owner, owner) == 0)
+      break;
+  }
+  if(k == RESOLV_CNAME_ENTRIES){
+    /* an unused link has expires 0 and goes first */
+    for(k = 0; k < RESOLV_CNAME_ENTRIES; ++k){
+      if((s32_t)(cname_table[k].expires - cname_table[slot].expires) < 0)
+        slot = k;
+    }
+    k = slot;
+  }
+  strcpy(cname_table[k].owner, owner);
+  strcpy(cname_table[k].target, target);
+  cname_table[k].expires = resolv_now() + ttl;
+}
+
+/** send_query() builds the query for one family of a dns table entry and sends
+  * it to the DNS server. The ID of the query is made from the index of the entry
+  * in the table and the family. A name with cached CNAME links is asked as
+  * the end of the chain, one round trip per link saved.
+  *
+  * @param i index of the entry in dns_table
+  * @param fam FAM_V4 to ask for the A record, FAM_V6 for the AAAA record */
+static void
+send_query(u16_t i, u8_t fam)
+{
+  static const char *TAG = "chck_entries";
+  register DNS_HDR *hdr;
+  char *query;
+  register DNS_TABLE_ENTRY *pEntry;
+  u32_t buf[(sizeof(DNS_HDR)+MAX_NAME_LENGTH+5+MESSAGE_OPT_LEN+3) / 4]; /* u32_t keeps hdr aligned */
+
+  pEntry = &dns_table[i];
+  hdr = (DNS_HDR *)buf;
+  memset(hdr, 0, sizeof(DNS_HDR));
+
+  /* Fill in header information observing Big Endian / Little Endian considerations*/
+  hdr->id = htons(QUERY_ID(i, fam));
+  hdr->flags1 = DNS_FLAG1_RD; //This is 8bits so no need to worry about htons
+  hdr->numquestions = htons(1);
+  query = (char *)hdr + sizeof(DNS_HDR);
+  /* Convert hostname into suitable query format. */
+  int qname_len = encode_name(cname_follow(pEntry->name, NULL), query);
+  query += qname_len;
+
+  unsigned char endquery[] = {0,0,MESSAGE_T_A,0,1};
+  if (fam == FAM_V6){
+    endquery[2] = MESSAGE_T_AAAA;
+  }
+  // write a trailing 0 on qname and write q_type and q_class
+  // order is MSB, LSB (network)
+  memcpy(query, endquery, 5);
+
+#if RESOLV_MDNS
+  if(pEntry->mdns){
+    pEntry->fam[fam].edns = 0;
+    send_mdns((unsigned char *)buf, sizeof(DNS_HDR) + qname_len + 5);
+    ESP_LOGD(TAG, "...query sent to mDNS group" );
+    return;
+  }
+#endif
+  int opt_len = add_edns_opt(hdr, query + 5, pEntry->server);
+  pEntry->fam[fam].edns = (opt_len != 0);
+
+  send_msg(pEntry->server, (unsigned char *)buf, sizeof(DNS_HDR) + qname_len + 5 + opt_len);
+  ESP_LOGD(TAG, "...query sent to DNS server" );
+}
+
+/** family_pref() gives the family of a RESOLV_FAMILY reported first, FAM_V4
+  * in a build without AAAA */
+static u8_t
+family_pref(RESOLV_FAMILY family)
+{
+  return (RESOLV_AAAA && (family == RESOLV_FAMILY_IPV6 || family == RESOLV_FAMILY_DUAL_V6)) ? FAM_V6 : FAM_V4;
+}
+
+/** family_fresh() checks if a family of an entry holds an address whose time
+  * to live has not run out */
+static int
+family_fresh(DNS_FAMILY *pFam)
+{
+  return (pFam->state == STATE_DONE) && ((s32_t)(pFam->expires - resolv_now()) > 0);
+}
+
+/** family_negative() checks if a family holds a cached negative answer, the
+  * server saying the name or the record type does not exist */
+static int
+family_negative(DNS_FAMILY *pFam)
+{
+  return (pFam->state == STATE_ERROR) && (pFam->err != DNS_RCODE_TIMEOUT) &&
+         ((s32_t)(pFam->expires - resolv_now()) > 0);
+}
+
+/** family_ttl() returns the seconds a family may still be used, its
+  * addresses or its negative answer, 0 once expired */
+static u32_t
+family_ttl(DNS_FAMILY *pFam)
+{
+  return ((s32_t)(pFam->expires - resolv_now()) > 0) ? pFam->expires - resolv_now() : 0;
+}
+
+/** pick_families() returns the valid families of a copy of an entry in the
+  * order a lookup should use them.
+  *
+  * @param first set to the preferred family if it is valid, else NULL
+  * @param second set to the other family for dual stack lookups if valid, else NULL
+  * @returns 1 if a valid family was found, else 0 */
+static int
+pick_families(DNS_TABLE_ENTRY *copy, RESOLV_FAMILY family, DNS_FAMILY **first, DNS_FAMILY **second)
+{
+  u8_t pref = family_pref(family);
+  u8_t dual = RESOLV_AAAA && (family == RESOLV_FAMILY_DUAL_V4 || family == RESOLV_FAMILY_DUAL_V6);
+
+  /* return families if still valid */
+  *first = family_fresh(&copy->fam[pref]) ? &copy->fam[pref] : NULL;
+  *second = (dual && family_fresh(&copy->fam[!pref])) ? &copy->fam[!pref] : NULL;
+  if (*first == NULL){
+    *first = *second;
+    *second = NULL;
+  }
+  return *first != NULL;
+}
+
+static void he_timeout(void *arg);
+#if RESOLV_FORWARD
+static void forward_done(u16_t i);
+#endif
+
+/** wake_waiters() wakes every task blocked on a name. They look the name up
+  * again themselves. */
+static void
+wake_waiters(const char *name)
+{
+  RESOLV_WAITER **pw = &waiters, *w;
+
+  while((w = *pw) != NULL){
+    if(strcmp(w->name, name) == 0){
+      *pw = w->next;
+      xSemaphoreGive(w->sem);
+    }
+    else{
+      pw = &w->next;
+    }
+  }
+}
+
+static void search_found(char *name, ip_addr_t *addr, err_t status, u32_t ttl);
+#if RESOLV_BROWSE
+static void browse_found(char *name, ip_addr_t *addr, err_t status, u32_t ttl);
+#endif
+
+#if RESOLV_COMPLETION_QUEUE
+/** event_new() takes an event of the completion queue from the pool. A full
+  * pool loses the result: it is logged as an error here and counted, and
+  * dispatch() logs the count, so the loss is never silent. The callback is
+  * still never called in the tcpip thread.
+  *
+  * @param kind EVENT_QUERY, EVENT_REVERSE or EVENT_BROWSE
+  * @param name the name of the event, or NULL. A name too long for the table,
+  * which only comes with ERR_ARG, is cut to fit
+  * @returns the event with name copied, or NULL if the pool is empty */
+static RESOLV_EVENT *
+event_new(u8_t kind, const char *name)
+{
+  static const char *TAG = "resolv_query";
+  RESOLV_EVENT *ev;
+
+  xSemaphoreTake(completion_lock, portMAX_DELAY);
+  ev = completion_free;
+  if(ev != NULL)
+    completion_free = ev->next;
+  else
+    ++completion_lost;
+  xSemaphoreGive(completion_lock);
+  if(ev == NULL){
+    ESP_LOGE(TAG, "...completion queue full, result lost : %s", (name != NULL) ? name : "");
+    return NULL;
+  }
+  memset(ev, 0, sizeof(RESOLV_EVENT));
+  ev->kind = kind;
+  if(name != NULL){
+    strncpy(ev->name, name, MAX_NAME_LENGTH - 1);
+    ev->name[MAX_NAME_LENGTH - 1] = 0;
+  }
+  return ev;
+}
+
+/** event_post() appends an event to the completion queue and wakes the task
+  * that runs the callbacks */
+static void
+event_post(RESOLV_EVENT *ev)
+{
+  xSemaphoreTake(completion_lock, portMAX_DELAY);
+  if(completion_tail != NULL)
+    completion_tail->next = ev;
+  else
+    completion_head = ev;
+  completion_tail = ev;
+  xSemaphoreGive(completion_lock);
+  xSemaphoreGive(completion_wake);
+}
+#endif
+
+/** user_report() passes the result of a query to a callback. With the
+  * completion queue the result is queued for resolv_dispatch(), so the
+  * callback never runs in, or holds up, the tcpip thread.
+  *
+  * @param cb the callback, or NULL
+  * @param name the name as asked for
+  * @param addr the address or NULL if the name could not be resolved
+  * @param status ERR_OK with an address, else why there is none
+  * @param ttl seconds the address, or the negative answer, may be cached */
+static void
+user_report(user_cb_fn cb, char *name, ip_addr_t *addr, err_t status, u32_t ttl)
+{
+#if RESOLV_COMPLETION_QUEUE
+  RESOLV_EVENT *ev;
+
+  /* search_found() and browse_found() are part of the resolver and stay in
+     the tcpip thread */
+  if(cb != NULL && cb != search_found && completion_lock != NULL
+#if RESOLV_BROWSE
+     && cb != browse_found
+#endif
+    ){
+    ev = event_new(EVENT_QUERY, name);
+    if(ev == NULL)
+      return;
+    ev->cb = cb;
+    ev->status = status;
+    ev->ttl = ttl;
+    ev->has_addr = (addr != NULL);
+    if(addr != NULL)
+      ev->addr = *addr;
+    event_post(ev);
+    return;
+  }
+#endif
+  if(cb != NULL)
+    (*cb)(name, addr, status, ttl);
+}
+
+/** reverse_report() passes the result of resolv_reverse() to its callback,
+  * through the completion queue as user_report() does.
+  *
+  * @param cb the callback, or NULL
+  * @param addr the address asked for
+  * @param name the name found, or NULL if the address has none */
+static void
+reverse_report(reverse_cb_fn cb, const ip_addr_t *addr, const char *name)
+{
+#if RESOLV_COMPLETION_QUEUE
+  RESOLV_EVENT *ev;
+
+  if(cb != NULL && completion_lock != NULL){
+    ev = event_new(EVENT_REVERSE, name);
+    if(ev == NULL)
+      return;
+    ev->rev_cb = cb;
+    ev->has_name = (name != NULL);
+    ev->has_addr = 1;
+    ev->addr = *addr;
+    event_post(ev);
+    return;
+  }
+#endif
+  if(cb != NULL)
+    (*cb)(addr, name);
+}
+
+#if RESOLV_BROWSE
+/** browse_report() passes an instance of resolv_browse(), or the end of the
+  * browse, to its callback, through the completion queue as user_report()
+  * does. The strings and TXT record of the instance are copied to an
+  * instance of the pool, there is one for each instance a browse follows.
+  *
+  * @param cb the callback
+  * @param service the service browsed
+  * @param inst the instance, or NULL at the end of the browse */
+static void
+browse_report(browse_cb_fn cb, const char *service, const RESOLV_SERVICE *inst)
+{
+#if RESOLV_COMPLETION_QUEUE
+  static const char *TAG = "resolv_brwse";
+  RESOLV_EVENT *ev;
+  RESOLV_EVENT_INST *copy = NULL;
+
+  if(completion_lock != NULL){
+    if(inst != NULL){
+      xSemaphoreTake(completion_lock, portMAX_DELAY);
+      copy = completion_inst_free;
+      if(copy != NULL)
+        completion_inst_free = copy->next;
+      else
+        ++completion_lost;
+      xSemaphoreGive(completion_lock);
+      if(copy == NULL){
+        ESP_LOGE(TAG, "...completion queue full, instance lost : %s", inst->name);
+        return;
+      }
+      copy->inst = *inst;
+      strcpy(copy->name, inst->name);
+      strcpy(copy->target, inst->target);
+      memcpy(copy->txt, inst->txt, inst->txt_len);
+      copy->inst.name = copy->name;
+      copy->inst.target = copy->target;
+      copy->inst.txt = copy->txt;
+    }
+    ev = event_new(EVENT_BROWSE, service);
+    if(ev == NULL){
+      if(copy != NULL){
+        xSemaphoreTake(completion_lock, portMAX_DELAY);
+        copy->next = completion_inst_free;
+        completion_inst_free = copy;
+        xSemaphoreGive(completion_lock);
+      }
+      return;
+    }
+    ev->browse_cb = cb;
+    ev->inst = copy;
+    event_post(ev);
+    return;
+  }
+#endif
+  (*cb)(service, inst);
+}
+#endif
+
+/** entry_status() tells how the query of an entry ended when no family
+  * asked for has an address.
+  *
+  * @param ttl set to the seconds the negative answer may be cached
+  * @returns ERR_VAL if the server replied without an address, ERR_TIMEOUT
+  * if it never replied */
+static err_t
+entry_status(DNS_TABLE_ENTRY *pEntry, u32_t *ttl)
+{
+  err_t err = ERR_TIMEOUT;
+  u8_t fam;
+
+  *ttl = 0;
+  for(fam = 0; fam < FAM_COUNT; ++fam){
+    if(!(pEntry->asked & (1 << fam)) || pEntry->fam[fam].state != STATE_ERROR ||
+       pEntry->fam[fam].err == DNS_RCODE_TIMEOUT)
+      continue;
+    if(err == ERR_TIMEOUT || family_ttl(&pEntry->fam[fam]) < *ttl)
+      *ttl = family_ttl(&pEntry->fam[fam]);
+    err = ERR_VAL;
+  }
+  return err;
+}
+
+/** report_entry() calls the callback of an entry, once per query.
+  *
+  * @param pEntry the dns table entry
+  * @param pFam the family to report the first address of, or NULL if the
+  * name could not be resolved */
+static void
+report_entry(DNS_TABLE_ENTRY *pEntry, DNS_FAMILY *pFam)
+{
+  user_cb_fn found[RESOLV_CALLERS];
+  char name[MAX_NAME_LENGTH];
+  ip_addr_t addr;
+  err_t status = ERR_OK;
+  u32_t ttl;
+  u8_t k;
+
+  if(pEntry->he_wait){
+    resolv_untimeout(he_timeout, (void *)(mem_ptr_t)(pEntry - dns_table));
+    pEntry->he_wait = 0;
+  }
+  pEntry->reported = 1;
+  wake_waiters(pEntry->name);
+  if(pFam != NULL){
+    ttl = family_ttl(pFam);
+    addr = pFam->addrs[0];
+  }
+  else
+    status = entry_status(pEntry, &ttl);
+  /* a callback run in place may reuse the entry */
+  memcpy(found, pEntry->found, sizeof(found));
+  strcpy(name, pEntry->name);
+  for(k = 0; k < RESOLV_CALLERS && found[k] != NULL; ++k)
+    user_report(found[k], name, (pFam != NULL) ? &addr : NULL, status, ttl);
+}
+
+/** entry_add_caller() adds a callback to those an entry reports to, once.
+  *
+  * @param cb the callback, or NULL for none
+  * @returns 1 if the callback is in the list, 0 if the list is full */
+static int
+entry_add_caller(DNS_TABLE_ENTRY *pEntry, user_cb_fn cb)
+{
+  u8_t k;
+
+  if(cb == NULL)
+    return 1;
+  for(k = 0; k < RESOLV_CALLERS && pEntry->found[k] != NULL; ++k){
+    if(pEntry->found[k] == cb)
+      return 1;
+  }
+  if(k == RESOLV_CALLERS)
+    return 0;
+  pEntry->found[k] = cb;
+  return 1;
+}
+
+/** update_entry() is called whenever a family of an entry finishes. It moves
+  * the entry to done or error once no family is still asking, and decides when
+  * the callback fires: straight away for the preferred family, after
+  * RESOLV_HE_DELAY_MS if only the other family has an address, or with NULL
+  * once every family asked for has failed. The clients of the forwarder
+  * waiting on a finished family get their reply.
+  *
+  * @param i index of the entry in dns_table */
+static void
+update_entry(u16_t i)
+{
+  DNS_TABLE_ENTRY *pEntry = &dns_table[i];
+  DNS_FAMILY *pref = &pEntry->fam[pEntry->prefer];
+  DNS_FAMILY *other = &pEntry->fam[!pEntry->prefer];
+  u8_t asking;
+
+  if(!(pEntry->asked & (1 << !pEntry->prefer))){
+    other = NULL; /* single family query */
+  }
+  asking = (pref->state == STATE_ASKING) || (other != NULL && other->state == STATE_ASKING);
+
+#if RESOLV_FORWARD
+  /* clients of the forwarder only wait for their own family */
+  forward_done(i);
+#endif
+  if(!asking){
+    entry_write_begin(pEntry);
+    pEntry->state = (pref->state == STATE_DONE || (other != NULL && other->state == STATE_DONE)) ?
+      STATE_DONE : STATE_ERROR;
+    entry_write_end(pEntry);
+  }
+  if(pEntry->reported){
+    /* a waiter for the family still asking when the callback fired */
+    if(!asking)
+      wake_waiters(pEntry->name);
+    return;
+  }
+
+  if(pref->state == STATE_DONE){
+    report_entry(pEntry, pref);
+  }
+  else if(other != NULL && other->state == STATE_DONE){
+    if(pref->state != STATE_ASKING){
+      report_entry(pEntry, other);
+    }
+    else if(!pEntry->he_wait){
+      /* give the preferred family a moment before settling for the other one */
+      pEntry->he_wait = 1;
+      resolv_timeout(RESOLV_HE_DELAY_MS, he_timeout, (void *)(mem_ptr_t)i);
+    }
+  }
+  else if(!asking){
+    report_entry(pEntry, NULL);
+  }
+}
+
+/** he_timeout() runs when the preferred family has not answered within
+  * RESOLV_HE_DELAY_MS of the other family. The other family is reported. */
+static void
+he_timeout(void *arg)
+{
+  DNS_TABLE_ENTRY *pEntry = &dns_table[(mem_ptr_t)arg];
+  DNS_FAMILY *other = &pEntry->fam[!pEntry->prefer];
+
+  pEntry->he_wait = 0;
+  if(!pEntry->reported && other->state == STATE_DONE){
+    report_entry(pEntry, other);
+  }
+}
+
+/** serve_stale() makes the expired addresses of a family valid again for a
+  * short while if the DNS server did not answer and they expired no more than
+  * RESOLV_SERVE_STALE_S ago. Call between entry_write_begin() and
+  * entry_write_end().
+  *
+  * @returns 1 if the family is done with stale addresses, 0 if not */
+static int
+serve_stale(DNS_FAMILY *pFam)
+{
+  u32_t now = resolv_now();
+
+  if(RESOLV_SERVE_STALE_S == 0 || pFam->count == 0 || (s32_t)(pFam->stale_until - now) <= 0)
+    return 0;
+  pFam->expires = now + RESOLV_STALE_TTL;
+  if((s32_t)(pFam->expires - pFam->stale_until) > 0)
+    pFam->expires = pFam->stale_until;
+  pFam->state = STATE_DONE;
+  return 1;
+}
+
+static void rate_resume(void *arg);
+#if RESOLV_BROWSE
+static void check_browse(u8_t tick, u8_t *limited);
+static void browse_recv(u8_t fam, u16_t k, u8_t srv, DNS_MSG *m);
+#endif
+
+/** rate_defer() marks an entry deferred and makes sure rate_resume() runs
+  * when the rate limiter has a token again.
+  *
+  * @param deferred the deferred flag of the entry */
+static void
+rate_defer(u8_t *deferred)
+{
+  if(!*deferred){
+    *deferred = 1;
+    resolv_untimeout(rate_resume, NULL);
+    resolv_timeout(rate_wait(), rate_resume, NULL);
+  }
+}
+
+/** reverse_qname() encodes the reverse name of an address: the octets in
+  * reverse order under in-addr.arpa for IPv4, the nibbles in reverse order
+  * under ip6.arpa for IPv6.
+  *
+  * @param addr the address
+  * @param out REVERSE_QNAME_LEN bytes for the encoded name
+  * @returns the length of the encoded name */
+static int
+reverse_qname(const ip_addr_t *addr, u8_t *out)
+{
+  static const char hex[] = "0123456789abcdef";
+  u8_t b[16], *p = out;
+  int k, n;
+
+  if(IP_IS_V6(addr)){
+    memcpy(b, ip_2_ip6(addr)->addr, 16);
+    for(k = 15; k >= 0; --k){
+      *p++ = 1;
+      *p++ = hex[b[k] & 0x0f];
+      *p++ = 1;
+      *p++ = hex[b[k] >> 4];
+    }
+    memcpy(p, "\3ip6\4arpa", 10);
+    return (p - out) + 10;
+  }
+  memcpy(b, &ip_2_ip4(addr)->addr, 4);
+  for(k = 3; k >= 0; --k){
+    n = 0;
+    if(b[k] >= 100)
+      p[++n] = '0' + b[k] / 100;
+    if(b[k] >= 10)
+      p[++n] = '0' + (b[k] / 10) % 10;
+    p[++n] = '0' + b[k] % 10;
+    *p = n;
+    p += n + 1;
+  }
+  memcpy(p, "\7in-addr\4arpa", 14);
+  return (p - out) + 14;
+}
+
+/** send_reverse() sends the PTR query of a reverse index entry. The ID of
+  * the query is made from the index of the entry and FAM_PTR.
+  *
+  * @param k index of the entry in rev_table */
+static void
+send_reverse(u8_t k)
+{
+  REVERSE_ENTRY *pRev = &rev_table[k];
+  u32_t buf[(sizeof(DNS_HDR)+REVERSE_QNAME_LEN+4+MESSAGE_OPT_LEN+3) / 4]; /* u32_t keeps hdr aligned */
+  DNS_HDR *hdr = (DNS_HDR *)buf;
+  char *query = (char *)hdr + sizeof(DNS_HDR);
+  int len, opt_len;
+
+  memset(hdr, 0, sizeof(DNS_HDR));
+  hdr->id = htons(QUERY_ID(k, FAM_PTR));
+  hdr->flags1 = DNS_FLAG1_RD;
+  hdr->numquestions = htons(1);
+  len = reverse_qname(&pRev->addr, (u8_t *)query);
+  query[len++] = 0;
+  query[len++] = MESSAGE_T_PTR;
+  query[len++] = 0;
+  query[len++] = MESSAGE_C_IN;
+  opt_len = add_edns_opt(hdr, query + len, pRev->server);
+  pRev->edns = (opt_len != 0);
+  send_msg(pRev->server, (unsigned char *)buf, sizeof(DNS_HDR) + len + opt_len);
+}
+
+/** reverse_fresh() checks if an entry holds an answer, a name or the lack of
+  * one, whose time to live has not run out */
+static int
+reverse_fresh(const REVERSE_ENTRY *pRev)
+{
+  return (pRev->state == STATE_DONE || pRev->state == STATE_ERROR) &&
+         (s32_t)(pRev->expires - resolv_now()) > 0;
+}
+
+/** reverse_finish() ends the query of a reverse index entry and calls its
+  * callback.
+  *
+  * @param k index of the entry in rev_table
+  * @param name the name found, the name of the entry to serve it stale, or
+  * NULL if the address has none
+  * @param ttl seconds the answer may be cached, 0 to not cache a failure */
+static void
+reverse_finish(u8_t k, const char *name, u32_t ttl)
+{
+  REVERSE_ENTRY *pRev = &rev_table[k];
+  reverse_cb_fn cb = pRev->found;
+  ip_addr_t addr = pRev->addr;
+  char found[MAX_NAME_LENGTH];
+
+  entry_write_begin(pRev);
+  pRev->expires = resolv_now() + ttl;
+  if(name == pRev->name){
+    /* served stale, no longer than the window of the last answer */
+    if((s32_t)(pRev->expires - pRev->stale_until) > 0)
+      pRev->expires = pRev->stale_until;
+    pRev->state = STATE_DONE;
+  }
+  else if(name != NULL){
+    strcpy(pRev->name, name);
+    pRev->stale_until = pRev->expires + RESOLV_SERVE_STALE_S;
+    pRev->state = STATE_DONE;
+    pRev->from_ptr = 1;
+  }
+  else{
+    pRev->name[0] = 0;
+    pRev->state = STATE_ERROR;
+  }
+  entry_write_end(pRev);
+  pRev->found = NULL;
+  pRev->deferred = 0;
+  if(cb != NULL){
+    /* the callback may reuse the entry */
+    if(name != NULL)
+      strcpy(found, pRev->name);
+    reverse_report(cb, &addr, (name != NULL) ? found : NULL);
+  }
+}
+
+/** reverse_recv() takes the reply to a PTR query. The first PTR record of
+  * the answer section gives the name; an RFC 2317 CNAME before it is passed
+  * over.
+  *
+  * @param k index of the entry in rev_table, from the query ID
+  * @param srv index in servers of the server that replied
+  * @param m the reply, parsed */
+static void
+reverse_recv(u16_t k, u8_t srv, DNS_MSG *m)
+{
+  REVERSE_ENTRY *pRev = &rev_table[k];
+  char name[MAX_NAME_LENGTH];
+  u16_t rcode = m->rcode, n;
+  DNS_RR *pRR;
+
+  if(k >= RESOLV_REVERSE_ENTRIES || pRev->state != STATE_ASKING || pRev->deferred)
+    return;
+  if(edns_rejected(srv, pRev->edns, rcode)){
+    pRev->server = srv;
+    if(rate_take(1))
+      send_reverse(k);
+    else
+      rate_defer(&pRev->deferred);
+    return;
+  }
+  if(rcode != DNS_FLAG2_ERR_NONE && rcode != DNS_FLAG2_ERR_NAME){
+    reverse_finish(k, NULL, 0);
+    return;
+  }
+  use_server(srv);
+
+  for(n = 0, pRR = m->rrs; rcode == DNS_FLAG2_ERR_NONE && n < m->nrrs; ++n, ++pRR){
+    if(pRR->type == MESSAGE_T_PTR &&
+       decode_name(m->msg, m->end, m->msg + pRR->rdata, name, sizeof(name), NULL) != NULL &&
+       name[0] != 0){
+      reverse_finish(k, name, pRR->ttl);
+      return;
+    }
+  }
+  /* no name for the address, cached as the server allows */
+  reverse_finish(k, NULL, m->neg_ttl);
+}
+
+/** reverse_learn() enters the address of a forward answer in the reverse
+  * index, so a later resolv_reverse() of a peer this device looked up needs
+  * no query. A name from a PTR answer still valid is kept, and an entry in
+  * flight is left to its own answer.
+  *
+  * @param addr the address
+  * @param name the name it was found for
+  * @param expires resolv_now() time in seconds when the address expires */
+static void
+reverse_learn(const ip_addr_t *addr, const char *name, u32_t expires)
+{
+  REVERSE_ENTRY *pRev;
+  int k, use = -1;
+
+  for(k = 0; k < RESOLV_REVERSE_ENTRIES; ++k){
+    pRev = &rev_table[k];
+    if(pRev->state != STATE_UNUSED && ip_addr_cmp(&pRev->addr, addr)){
+      if(pRev->state == STATE_NEW || pRev->state == STATE_ASKING ||
+         (pRev->from_ptr && reverse_fresh(pRev)))
+        return;
+      use = k;
+      break;
+    }
+    if(pRev->state == STATE_NEW || pRev->state == STATE_ASKING)
+      continue;
+    if(use < 0 || (rev_table[use].state != STATE_UNUSED &&
+       (pRev->state == STATE_UNUSED || (s32_t)(pRev->expires - rev_table[use].expires) < 0)))
+      use = k;
+  }
+  if(use < 0)
+    return;
+  pRev = &rev_table[use];
+  entry_write_begin(pRev);
+  memset((u8_t *)pRev + sizeof(pRev->seq), 0, sizeof(REVERSE_ENTRY) - sizeof(pRev->seq));
+  pRev->state = STATE_DONE;
+  pRev->addr = *addr;
+  pRev->expires = expires;
+  pRev->stale_until = expires;
+  strcpy(pRev->name, name);
+  entry_write_end(pRev);
+}
+
+/** check_reverse() sends the PTR queries that are due, as check_table() does
+  * for the dns table.
+  *
+  * @param tick set to 1 to run the retry timers
+  * @param limited set to 1 once the rate limiter holds a query back */
+static void
+check_reverse(u8_t tick, u8_t *limited)
+{
+  REVERSE_ENTRY *pRev;
+  u8_t k;
+
+  for(k = 0; k < RESOLV_REVERSE_ENTRIES; ++k){
+    pRev = &rev_table[k];
+    if(pRev->state == STATE_ASKING && !pRev->deferred){
+      if(!tick)
+        continue;
+      if(pRev->tmr > 1){
+        --pRev->tmr;
+        continue;
+      }
+      if(pRev->retries + 1 == MAX_RETRIES){
+        if(RESOLV_SERVE_STALE_S != 0 && pRev->name[0] != 0 &&
+           (s32_t)(pRev->stale_until - resolv_now()) > 0)
+          reverse_finish(k, pRev->name, RESOLV_STALE_TTL);
+        else
+          reverse_finish(k, NULL, 0);
+        continue;
+      }
+    }
+    else if(pRev->state != STATE_NEW && pRev->state != STATE_ASKING){
+      continue;
+    }
+    if(*limited || !rate_take(1)){
+      *limited = 1;
+      pRev->deferred = 1;
+      continue;
+    }
+    pRev->deferred = 0;
+    if(pRev->state == STATE_ASKING){
+      ++pRev->retries;
+      pRev->tmr = pRev->retries;
+      pRev->server = (pRev->server + 1) % nservers;
+    }
+    else{
+      entry_write_begin(pRev);
+      pRev->state = STATE_ASKING;
+      entry_write_end(pRev);
+      pRev->tmr = 1;
+      pRev->retries = 0;
+      pRev->server = cur_server;
+    }
+    send_reverse(k);
+  }
+}
+
+/** check_table() sends the queries that are due, the most urgent class first
+  * and in index order within a class. A query the rate limiter holds back
+  * stays deferred, and the entries after it wait too, until rate_resume()
+  * runs when a token is due.
+  *
+  * @param tick set to 1 to run the retry timers, 0 to only send deferred and
+  * new queries */
+static void
+check_table(u8_t tick)
+{
+  static const char *TAG = "chck_entries";
+  u16_t i; //i is index to dns_table
+  u8_t fam, prio, n, limited = 0;
+  register DNS_TABLE_ENTRY *pEntry;
+
+  for(prio = 0; prio < RESOLV_PRIO_COUNT; ++prio)
+  {
+    for(i = 0; i < LWIP_RESOLV_ENTRIES; ++i)
+    {
+      pEntry = &dns_table[i];
+      if(pEntry->prio != prio)
+        continue;
+      if(pEntry->state == STATE_NEW || pEntry->state == STATE_ASKING)
+      {
+        if(pEntry->state == STATE_ASKING && !pEntry->deferred)
+        {
+          if(!tick)
+            continue;
+          if(pEntry->tmr > 1)
+          {
+            /*  printf("Timer %d\n", pEntry->tmr);*/
+            /* Its timer has not run out, so we move on to next
+            entry. */
+            --pEntry->tmr;
+            continue;
+          }
+          if(pEntry->retries + 1 == (pEntry->mdns ? MDNS_MAX_RETRIES : MAX_RETRIES))
+          {
+            entry_write_begin(pEntry);
+            for(fam = 0; fam < FAM_COUNT; ++fam){
+              if(pEntry->fam[fam].state == STATE_ASKING){
+                if(!serve_stale(&pEntry->fam[fam])){
+                  pEntry->fam[fam].state = STATE_ERROR;
+                  pEntry->fam[fam].err = DNS_RCODE_TIMEOUT;
+                }
+              }
+            }
+            entry_write_end(pEntry);
+            update_entry(i);
+            continue;
+          }
+        }
+        /* the entry is due; the queries of both its families go out together */
+        for(fam = 0, n = 0; fam < FAM_COUNT; ++fam){
+          if(pEntry->fam[fam].state == STATE_ASKING)
+            ++n;
+        }
+        if(limited || !rate_take(n))
+        {
+          limited = 1;
+          pEntry->deferred = 1;
+          continue;
+        }
+        if(pEntry->state == STATE_ASKING)
+        {
+          pEntry->deferred = 0;
+          ++pEntry->retries;
+          pEntry->tmr = pEntry->retries;
+          /* fail over: each retry goes to the next server */
+          pEntry->server = (pEntry->server + 1) % nservers;
+        }
+        else
+        {
+          pEntry->deferred = 0;
+          entry_write_begin(pEntry);
+          pEntry->state = STATE_ASKING;
+          entry_write_end(pEntry);
+          pEntry->tmr = 1;
+          pEntry->retries = 0;
+          pEntry->server = cur_server;
+        }
+        /* if here, we have either a new query or a retry on a previous query to process.
+           A dual stack entry sends its A and AAAA queries back to back. Every
+           entry is served on each call, so the candidates of a search go out
+           together */
+        for(fam = 0; fam < FAM_COUNT; ++fam){
+          if(pEntry->fam[fam].state == STATE_ASKING)
+            send_query(i, fam);
+        }
+      }
+    }
+    /* the PTR queries of resolv_reverse() and the queries of resolv_browse()
+       go with the normal class */
+    if(prio == RESOLV_PRIO_NORMAL){
+      check_reverse(tick, &limited);
+#if RESOLV_BROWSE
+      check_browse(tick, &limited);
+#endif
+    }
+  }
+  if(limited){
+    ESP_LOGD(TAG, "...rate limited, resume in %u ms", (unsigned)rate_wait());
+    resolv_untimeout(rate_resume, NULL);
+    resolv_timeout(rate_wait(), rate_resume, NULL);
+  }
+}
+
+/** rate_resume() sends the queries the rate limiter held back */
+static void
+rate_resume(void *arg)
+{
+  check_table(0);
+}
+
+/** send_or_defer() sends the query for one family of an entry in flight now
+  * if the rate limiter allows it, else defers the entry to rate_resume().
+  *
+  * @param i index of the entry in dns_table
+  * @param fam FAM_V4 or FAM_V6 */
+static void
+send_or_defer(u16_t i, u8_t fam)
+{
+  if(rate_take(1))
+    send_query(i, fam);
+  else
+    rate_defer(&dns_table[i].deferred);
+}
+
+/** do_check_entries() is check_entries() in the writer context */
+static err_t
+do_check_entries(struct tcpip_api_call_data *call)
+{
+  static const char *TAG = "chck_entries";
+  ESP_LOGD(TAG, "...begin check entries" );
+#if RESOLV_SIM
+  sim_release();
+  sim_timers_run();
+#endif
+  check_table(1);
+  return ERR_OK;
+}
+
+void
+check_entries(void)
+{
+  RESOLV_CALL msg;
+  resolv_call(do_check_entries, &msg);
+}
+
+/**Querry a DNS server and return a buffer with the answer(s)
+ * The res_query_jps() function provides an interface to the server query mechanism.
+ * It constructs a query, sends it to the DNS server, awaits a response, and
+ * makes preliminary checks on the reply. The query requests information of the
+ * specified type and class for the specified fully-qualified domain name dname.
+ * The reply message is left in the answer buffer
+ */
+
+#if RESOLV_RES_QUERY
+/** do_res_send() hands the answer buffer to the writer context and sends the
+  * res_query_jps() query */
+static err_t
+do_res_send(struct tcpip_api_call_data *call)
+{
+  RESOLV_CALL *msg = (RESOLV_CALL *)call;
+
+  // advertise a larger UDP payload size so big SRV and TXT answers are not truncated
+  res_query_opt = add_edns_opt((DNS_HDR *)msg->msg, (char *)msg->msg + msg->len, cur_server) != 0;
+  if(res_query_opt)
+    msg->len += MESSAGE_OPT_LEN;
+  user_buffer_ptr = msg->answer;
+  user_buffer_len = msg->anslen;
+  res_query_msg = msg->msg;
+  res_query_len = msg->len;
+  send_msg(cur_server, msg->msg, msg->len);
+  return ERR_OK;
+}
+
+/** do_res_cancel() stops resolv_recv() from writing into the answer buffer of
+  * a res_query_jps() call that gave up waiting */
+static err_t
+do_res_cancel(struct tcpip_api_call_data *call)
+{
+  user_buffer_ptr = NULL;
+  res_query_msg = NULL;
+  return ERR_OK;
+}
+
+/** res_query_once() builds and sends a res_query_jps() query and waits for the
+  * reply. The caller holds res_query_mutex. */
+static int
+res_query_once(const char *dname, int class, int type, unsigned char *answer, int anslen){
+  static const char *TAG = "res_query_jps";
+
+  DNS_HDR *hdr;
+  char *query;
+  u32_t buf[(sizeof(DNS_HDR)+MAX_NAME_LENGTH+5+MESSAGE_OPT_LEN+3) / 4]; /* u32_t keeps hdr aligned */
+  RESOLV_CALL msg;
+  int64_t start;
+
+  if (strlen(dname) >= MAX_NAME_LENGTH){
+    ESP_LOGI(TAG, "...name is too long");
+    return 0;
+  }
+
+  hdr = (DNS_HDR *)buf;
+  memset(hdr, 0, sizeof(DNS_HDR));
+
+  /* Fill in header information observing Big Endian / Little Endian considerations*/
+  hdr->id = htons(RES_QUERY_ID);
+  hdr->flags1 = DNS_FLAG1_RD; //This is 8bits so no need to worry about htons
+  hdr->numquestions = htons(1);
+  query = (char *)hdr + sizeof(DNS_HDR);
+
+  /* Convert hostname into suitable query format. */
+  int qname_len = encode_name(dname, query);
+  query += qname_len;
+
+  // complete the question by (1) terminating the QNAME with 0, (2) specifying
+  // QTYPE and (3) specifying QCLASS
+  unsigned char endquery[] = {0,0,1,0,1};
+  endquery[2] = (unsigned char) type;
+  endquery[4] = (unsigned char) class;
+
+  memcpy(query, endquery, 5);
+
+  // the reply is given to res_query_sem; drop one left over from a late reply
+  xSemaphoreTake(res_query_sem, 0);
+
+  msg.msg = (unsigned char *)buf;
+  msg.len = sizeof(DNS_HDR) + qname_len + 5;
+  msg.answer = answer;
+  msg.anslen = anslen;
+  resolv_call(do_res_send, &msg);
+  ESP_LOGD(TAG, "...query sent to DNS server" );
+
+  // wait on the clock of the resolver, which a simulation may drive
+  start = resolv_time_us();
+  while (xSemaphoreTake(res_query_sem, RESOLV_WAIT_POLL_MS / portTICK_PERIOD_MS) != pdTRUE){
+    if (resolv_time_us() - start < (int64_t)RES_QUERY_TIMEOUT_MS * 1000)
+      continue;
+    resolv_call(do_res_cancel, &msg);
+    /* the reply may have come in just before the cancel */
+    if (xSemaphoreTake(res_query_sem, 0) != pdTRUE){
+      return 0;
+    }
+    break;
+  }
+
+  if (resp_edns_retry){
+    return res_query_once(dname, class, type, answer, anslen);
+  }
+
+  ESP_LOGD(TAG, "...payload length from parse = %d", payload_len);
+
+  return payload_len;
+}
+
+#endif
+
+int
+res_query_jps(const char *dname, int class, int type, unsigned char *answer, int anslen){
+#if RESOLV_RES_QUERY
+  static const char *TAG = "res_query_jps";
+  ESP_LOGI(TAG, "");
+  ESP_LOGI(TAG, ".Begin res_query_jps function");
+  int len;
+
+#if RESOLV_STATIC_HOSTS
+  len = static_reply(dname, class, type, answer, anslen);
+  if (len > 0){
+    ESP_LOGI(TAG, "...answered from the static host table");
+    return len;
+  }
+#endif
+  if (res_query_mutex == NULL){
+    return 0; /* resolv_init() has not been called */
+  }
+  xSemaphoreTake(res_query_mutex, portMAX_DELAY);
+  len = res_query_once(dname, class, type, answer, anslen);
+  xSemaphoreGive(res_query_mutex);
+  return len;
+#else
+  return 0;
+#endif
+}
+
+/** @brief What walk_answers() found in the answer section */
+typedef struct s_answer_walk {
+  u8_t depth; /**< CNAME links followed, the chain is chain[0..depth] */
+  u8_t loop; /**< set to 1 if the chain loops */
+  u32_t min_ttl; /**< smallest TTL of the links and addresses taken */
+} ANSWER_WALK;
+
+/** owner_is() checks that the owner of a parsed record is a name, the hash
+  * first and the text only when the hashes match */
+static int
+owner_is(DNS_MSG *m, DNS_RR *pRR, const char *name, u32_t hash)
+{
+  char owner[MAX_NAME_LENGTH];
+
+  return pRR->hash == hash &&
+         decode_name(m->msg, m->end, m->msg + pRR->owner, owner, sizeof(owner), NULL) != NULL &&
+         strcasecmp(owner, name) == 0;
+}
+
+/** walk_answers() follows the CNAME chain from the question and takes the
+  * addresses of its end. The records may come in any order. The addresses
+  * are only as good as the shortest lived link.
+  *
+  * @param m the reply, parsed
+  * @param fam FAM_V4 or FAM_V6, the address type taken
+  * @param pFam gets the addresses, up to RESOLV_MAX_ADDRS
+  * @param learn set to 1 to cache each link with its own TTL
+  * @param walk gets the length of the chain and the smallest TTL
+  * @param chain gets the names of the chain, RESOLV_CNAME_DEPTH + 1 of
+  * them; chain[0] holds the question on entry */
+static void
+walk_answers(DNS_MSG *m, u8_t fam, DNS_FAMILY *pFam, u8_t learn, ANSWER_WALK *walk,
+             char (*chain)[MAX_NAME_LENGTH])
+{
+  u32_t hash[RESOLV_CNAME_DEPTH + 1];
+  ip_addr_t *pAddr;
+  DNS_RR *pRR;
+  u16_t n;
+  u8_t depth;
+
+  walk->loop = 0;
+  walk->min_ttl = 0xffffffff;
+  hash[0] = static_hash(chain[0], strlen(chain[0]), 0);
+  for(depth = 0; depth < RESOLV_CNAME_DEPTH; ++depth){
+    for(n = 0, pRR = m->rrs; n < m->nrrs; ++n, ++pRR){
+      if(pRR->type == MESSAGE_T_CNAME && owner_is(m, pRR, chain[depth], hash[depth]) &&
+         decode_name(m->msg, m->end, m->msg + pRR->rdata, chain[depth + 1], MAX_NAME_LENGTH,
+                     &hash[depth + 1]) != NULL)
+        break;
+    }
+    if(n == m->nrrs)
+      break;
+    /* an alias seen before makes a loop */
+    for(n = 0; n <= depth && (hash[n] != hash[depth + 1] ||
+                              strcasecmp(chain[n], chain[depth + 1]) != 0); ++n);
+    if(n <= depth){
+      walk->loop = 1;
+      break;
+    }
+    if(learn)
+      cname_learn(chain[depth], chain[depth + 1], pRR->ttl);
+    if(pRR->ttl < walk->min_ttl)
+      walk->min_ttl = pRR->ttl;
+  }
+  walk->depth = depth;
+  if(walk->loop)
+    return;
+
+  /* Every address of the RRset of the end of the chain is kept, up to
+     RESOLV_MAX_ADDRS, of the type asked for. Others are discarded. */
+  for(n = 0, pRR = m->rrs; n < m->nrrs && pFam->count < RESOLV_MAX_ADDRS; ++n, ++pRR){
+    pAddr = &pFam->addrs[pFam->count];
+    if((fam == FAM_V4) && (pRR->type == MESSAGE_T_A) && (pRR->rdlen == 4) &&
+       owner_is(m, pRR, chain[depth], hash[depth]))
+    {
+      memset(pAddr, 0, sizeof(ip_addr_t));
+      memcpy(&pAddr->u_addr.ip4.addr, m->msg + pRR->rdata, 4);
+      pAddr->type = IPADDR_TYPE_V4;
+    }
+    else if((fam == FAM_V6) && (pRR->type == MESSAGE_T_AAAA) && (pRR->rdlen == 16) &&
+            owner_is(m, pRR, chain[depth], hash[depth]))
+    {
+      memset(pAddr, 0, sizeof(ip_addr_t));
+      memcpy(&pAddr->u_addr.ip6.addr, m->msg + pRR->rdata, 16);
+      pAddr->type = IPADDR_TYPE_V6;
+    }
+    else
+      continue;
+    /* The records of an RRset should share a TTL, keep the smallest */
+    if(pRR->ttl < walk->min_ttl)
+      walk->min_ttl = pRR->ttl;
+    pFam->count++;
+  }
+}
+
+/*---------------------------------------------------------------------------*
+ *
+ * Callback for DNS responses
+ *
+ *---------------------------------------------------------------------------*/
+static void
+resolv_recv(void *s, struct udp_pcb *pcb, struct pbuf *p,
+                                  const ip_addr_t *addr, u16_t port)
+{
+  const char* TAG = "resolv_recv ";
+  ESP_LOGD(TAG, "...resolv_recv function called");
+
+  DNS_HDR *hdr;
+
+  u16_t i;
+  u8_t fam, k, depth;
+  int srv;
+  u32_t min_ttl;
+  register DNS_TABLE_ENTRY *pEntry;
+  DNS_FAMILY *pFam;
+  ANSWER_WALK walk;
+  unsigned char *msg = p->payload;
+  u16_t len = p->len;
+
+  ESP_LOGD(TAG, "....Buffer length from tot_len is %d", p->tot_len);
+#if RESOLV_CAPTURE
+  capture_msg(CAPTURE_IN, addr, port, p, NULL, p->tot_len);
+#endif
+
+  /* a large reply reassembled from IP fragments comes as a chain of pbufs,
+     the parser needs it in one piece */
+  if(p->len != p->tot_len){
+    if(p->tot_len > sizeof(rx_buf)){
+      ESP_LOGD(TAG, "...reply of %d bytes from %s is longer than %d, dropped",
+               p->tot_len, ipaddr_ntoa(addr), RESOLV_RX_MAX);
+      pbuf_free(p);
+      return;
+    }
+    msg = (unsigned char *)rx_buf;
+    len = pbuf_copy_partial(p, msg, p->tot_len, 0);
+  }
+  if(len < sizeof(DNS_HDR)){
+    ESP_LOGD(TAG, "...malformed reply from %s", ipaddr_ntoa(addr));
+    pbuf_free(p);
+    return;
+  }
+
+  hdr = (DNS_HDR *)msg;
+  ESP_LOGD(TAG, "...ID %d", htons(hdr->id));
+  ESP_LOGD(TAG, "...Query %d", hdr->flags1 & DNS_FLAG1_RESPONSE);
+  ESP_LOGD(TAG, "...Error %d", hdr->flags2 & DNS_FLAG2_ERR_MASK);
+  ESP_LOGD(TAG, "...Num questions %d, answers %d, authrr %d, extrarr %d",
+    htons(hdr->numquestions),
+    htons(hdr->numanswers),
+    htons(hdr->numauthrr),
+    htons(hdr->numextrarr));
+
+  // next section if only asking for id 99 - no need to do anything with tables
+
+  /* only the configured servers are listened to, and mDNS responders for
+     the .local names asked for */
+  srv = (port == DNS_SERVER_PORT) ? find_server(addr) : -1;
+#if RESOLV_MDNS
+  if(srv < 0 && mdns_reply(hdr, port))
+    ESP_LOGD(TAG, "...reply from mDNS responder %s", ipaddr_ntoa(addr));
+  else
+#endif
+  if(srv < 0){
+    ESP_LOGD(TAG, "...reply from %s is not from a DNS server in use", ipaddr_ntoa(addr));
+    pbuf_free(p);
+    return;
+  }
+
+#if RESOLV_RES_QUERY
+  if(srv >= 0 && htons(hdr->id) == RES_QUERY_ID){
+    /* hand back the whole message, authority and additional sections included,
+       so the header counts stay valid. Cut it to the size of the user buffer. */
+    if(user_buffer_ptr != NULL){
+      payload_len = p->tot_len;
+      if(payload_len > user_buffer_len){
+        payload_len = user_buffer_len;
+      }
+      parse_msg(msg, len, &rx_msg);
+      resp_edns_retry = edns_rejected(srv, res_query_opt, rx_msg.rcode);
+      pbuf_copy_partial(p, user_buffer_ptr, payload_len, 0);
+      user_buffer_ptr = NULL;
+      res_query_msg = NULL;
+      xSemaphoreGive(res_query_sem);
+    }
+    pbuf_free(p);
+    return;
+  }
+#endif
+
+  /* every section is parsed once, here */
+  if(!parse_msg(msg, len, &rx_msg)){
+    ESP_LOGD(TAG, "...malformed reply from %s", ipaddr_ntoa(addr));
+    pbuf_free(p);
+    return;
+  }
+
+  if(srv >= 0 && QUERY_ID_FAM(htons(hdr->id)) == FAM_PTR){
+    reverse_recv(QUERY_ID_ENTRY(htons(hdr->id)), srv, &rx_msg);
+    pbuf_free(p);
+    return;
+  }
+#if RESOLV_BROWSE
+  if(srv >= 0 && QUERY_ID_FAM(htons(hdr->id)) >= FAM_BROWSE_PTR &&
+     QUERY_ID_FAM(htons(hdr->id)) <= FAM_BROWSE_TXT){
+    browse_recv(QUERY_ID_FAM(htons(hdr->id)), QUERY_ID_ENTRY(htons(hdr->id)), srv, &rx_msg);
+    pbuf_free(p);
+    return;
+  }
+#endif
+
+  /* The ID in the DNS header should be our entry into the name table. */
+  i = QUERY_ID_ENTRY(htons(hdr->id));
+  fam = QUERY_ID_FAM(htons(hdr->id));
+  pEntry = &dns_table[i];
+  if( (i < LWIP_RESOLV_ENTRIES) && (fam < FAM_COUNT) && (pEntry->state == STATE_ASKING) &&
+      (pEntry->fam[fam].state == STATE_ASKING) )
+  {
+    pFam = &pEntry->fam[fam];
+
+    /* The question must be the name of the entry, or the end of its cached
+       CNAME chain that send_query() asked for. Only an mDNS responder may
+       leave it out. */
+    if(hdr->numquestions == 0 && srv < 0 && pEntry->mdns){
+      strcpy(cname_chain[0], cname_follow(pEntry->name, NULL));
+    }
+    else if(hdr->numquestions == 0 ||
+            strcasecmp(cname_follow(pEntry->name, rx_msg.qname), rx_msg.qname) != 0){
+      ESP_LOGD(TAG, "...reply is not for %s", pEntry->name);
+      pbuf_free(p);
+      return;
+    }
+    else{
+      strcpy(cname_chain[0], rx_msg.qname);
+    }
+
+    pFam->err = rx_msg.rcode;
+
+    /* A server without EDNS support may fail the query because of the OPT
+       record. Ask again straight away without it. */
+    if(srv >= 0 && edns_rejected(srv, pFam->edns, pFam->err))
+    {
+      pEntry->server = srv;
+      send_or_defer(i, fam);
+      pbuf_free(p);
+      return;
+    }
+
+    /* a server that answers becomes the first choice */
+    if(srv >= 0 && (pFam->err == DNS_FLAG2_ERR_NONE || pFam->err == DNS_FLAG2_ERR_NAME))
+      use_server(srv);
+
+    /* This family is now finished. It is an error unless an address is found */
+    entry_write_begin(pEntry);
+    pFam->state = STATE_ERROR;
+    pFam->count = 0;
+
+    /* We only care about the answers of a reply without error */
+    if(pFam->err != 0)
+      rx_msg.nrrs = 0;
+
+    walk_answers(&rx_msg, fam, pFam, 1, &walk, cname_chain);
+    min_ttl = walk.min_ttl;
+    depth = walk.depth;
+    for(k = 0; k < depth; ++k)
+      ESP_LOGD(TAG, "...CNAME %s -> %s", cname_chain[k], cname_chain[k + 1]);
+    if(walk.loop)
+      ESP_LOGD(TAG, "...CNAME loop after %s", cname_chain[depth]);
+    for(k = 0; k < pFam->count; ++k)
+      ESP_LOGD(TAG, "...Answer IP using memcpy             : %s", ipaddr_ntoa(&pFam->addrs[k]));
+
+    if(pFam->count > 0){
+      pFam->expires = resolv_now() + min_ttl;
+      pFam->stale_until = pFam->expires + RESOLV_SERVE_STALE_S;
+      pFam->state = STATE_DONE;
+    }
+    else if(pFam->err == DNS_FLAG2_ERR_NONE && depth > 0 && !walk.loop &&
+            strcasecmp(cname_follow(pEntry->name, NULL), cname_chain[depth]) == 0){
+      /* The chain ends without an address, the server left the rest to us.
+         Only its end is asked for, through the links just cached. A link
+         that could not be cached would ask the same question again. */
+      pFam->state = STATE_ASKING;
+      entry_write_end(pEntry);
+      ESP_LOGD(TAG, "...asking for the end of the chain, %s", cname_chain[depth]);
+      send_or_defer(i, fam);
+      pbuf_free(p);
+      return;
+    }
+    else if(pFam->err == DNS_FLAG2_ERR_NONE || pFam->err == DNS_FLAG2_ERR_NAME){
+      /* cache the negative answer, a zero TTL if the reply has no SOA */
+      pFam->expires = resolv_now() + rx_msg.neg_ttl;
+    }
+    entry_write_end(pEntry);
+    /* the reverse index learns the addresses too */
+    for(k = 0; pFam->state == STATE_DONE && k < pFam->count; ++k)
+      reverse_learn(&pFam->addrs[k], pEntry->name, pFam->expires);
+    update_entry(i);
+  }
+  pbuf_free(p);
+}
+/*---------------------------------------------------------------------------*
+ *
+ * Enter a request to get information for a hostname into the dns table
+ *
+ *---------------------------------------------------------------------------*/
+
+void resolv_query(char *name, user_cb_fn sti_cb_ptr){
+  resolv_query_family(name, sti_cb_ptr, RESOLV_FAMILY_DEFAULT);
+}
+
+/** find_entry() picks the dns table slot for a hostname: the entry already
+  * holding the name, whose query in flight is then joined, else an unused
+  * entry, else the finished entry of the least urgent class whose addresses
+  * expire first. An entry with a query in flight for another name is only
+  * taken from a less urgent class, when every entry is busy.
+  *
+  * A low priority query for a name not in the table is turned away when only
+  * RESOLV_PRIO_RESERVE entries are left for queries in flight, so a burst of
+  * background lookups cannot lock out an urgent one.
+  *
+  * @param name the hostname
+  * @param prio the class of the new request
+  * @returns index into dns_table or -1 if every entry is busy */
+static int
+find_entry(char *name, u8_t prio)
+{
+  int i, unused = -1, oldest = -1, victim = -1;
+  u32_t expires, oldest_expires = 0;
+  u8_t busy = 0;
+  DNS_TABLE_ENTRY *pEntry;
+
+  for(i = 0; i < LWIP_RESOLV_ENTRIES; ++i){
+    pEntry = &dns_table[i];
+    if(pEntry->state == STATE_UNUSED){
+      if(unused < 0)
+        unused = i;
+      continue;
+    }
+    if(pEntry->state == STATE_NEW || pEntry->state == STATE_ASKING){
+      if(strcmp(name, pEntry->name) == 0)
+        return i;
+      ++busy;
+      if(pEntry->prio > prio && (victim < 0 || pEntry->prio > dns_table[victim].prio))
+        victim = i;
+      continue;
+    }
+    if(strcmp(name, pEntry->name) == 0)
+      return i;
+    expires = pEntry->fam[FAM_V4].expires;
+#if RESOLV_AAAA
+    if((s32_t)(pEntry->fam[FAM_V6].expires - expires) > 0)
+      expires = pEntry->fam[FAM_V6].expires;
+#endif
+    if(oldest < 0 || pEntry->prio > dns_table[oldest].prio ||
+       (pEntry->prio == dns_table[oldest].prio && (s32_t)(expires - oldest_expires) < 0)){
+      oldest = i;
+      oldest_expires = expires;
+    }
+  }
+  if(prio == RESOLV_PRIO_LOW && busy + RESOLV_PRIO_RESERVE >= LWIP_RESOLV_ENTRIES)
+    return -1;
+  if(unused >= 0)
+    return unused;
+  return (oldest >= 0) ? oldest : victim;
+}
+
+/** preempt_entry() fails the query in flight of an entry, to free it for a
+  * more urgent one. Its callback and waiters get NULL, as for a timeout.
+  *
+  * @param i index of the entry in dns_table */
+static void
+preempt_entry(u16_t i)
+{
+  DNS_TABLE_ENTRY *pEntry = &dns_table[i];
+  u8_t fam;
+
+  entry_write_begin(pEntry);
+  for(fam = 0; fam < FAM_COUNT; ++fam){
+    if(pEntry->fam[fam].state == STATE_ASKING){
+      pEntry->fam[fam].state = STATE_ERROR;
+      pEntry->fam[fam].err = DNS_RCODE_TIMEOUT;
+    }
+  }
+  pEntry->deferred = 0;
+  entry_write_end(pEntry);
+  update_entry(i);
+}
+
+/** family_mask() gives the families of a RESOLV_FAMILY as a mask of
+  * (1 << FAM_V4) and (1 << FAM_V6) */
+static u8_t
+family_mask(RESOLV_FAMILY family)
+{
+#if RESOLV_AAAA
+  switch (family){
+    case RESOLV_FAMILY_IPV6:
+      return 1 << FAM_V6;
+    case RESOLV_FAMILY_DUAL_V4:
+    case RESOLV_FAMILY_DUAL_V6:
+      return (1 << FAM_V4) | (1 << FAM_V6);
+    default:
+      return 1 << FAM_V4;
+  }
+#else
+  return 1 << FAM_V4;
+#endif
+}
+
+/** do_query() is resolv_query_family() in the writer context */
+static err_t
+do_query(struct tcpip_api_call_data *call)
+{
+  RESOLV_CALL *msg = (RESOLV_CALL *)call;
+  char *name = msg->name;
+  user_cb_fn sti_cb_ptr = msg->cb;
+  RESOLV_FAMILY family = msg->family;
+
+  static const char *TAG = "resolv_query";
+  int i, tries;
+  u8_t fam, asked;
+  register DNS_TABLE_ENTRY *pEntry;
+
+  ESP_LOGD(TAG, "...entered resolv query. The name is %s", name );
+
+  if (strlen(name) >= MAX_NAME_LENGTH){
+    ESP_LOGI(TAG, "...name is too long for the dns table");
+    user_report(sti_cb_ptr, name, NULL, ERR_ARG, 0);
+    return ERR_ARG;
+  }
+
+  /* a less urgent query gives way. Its callback may change the table, so
+     look again, at most once per entry */
+  for (tries = 0; ; ++tries){
+    i = find_entry(name, msg->prio);
+    if (i < 0 || tries == LWIP_RESOLV_ENTRIES){
+      ESP_LOGI(TAG, "...dns table is full, query dropped");
+      user_report(sti_cb_ptr, name, NULL, ERR_MEM, 0);
+      return ERR_MEM;
+    }
+    pEntry = &dns_table[i];
+    if ((pEntry->state != STATE_NEW && pEntry->state != STATE_ASKING) || strcmp(name, pEntry->name) == 0)
+      break;
+    ESP_LOGD(TAG, "...preempted query for         : %s", pEntry->name );
+    preempt_entry(i);
+  }
+
+  asked = family_mask(family);
+
+  if (pEntry->state == STATE_NEW || pEntry->state == STATE_ASKING){
+    /* the same name is already being asked for, share the query */
+    ESP_LOGD(TAG, "...joined query at seq no      : %d", i );
+    if (!pEntry->reported && !entry_add_caller(pEntry, sti_cb_ptr)){
+      ESP_LOGI(TAG, "...too many callers for the query, dropped");
+      user_report(sti_cb_ptr, name, NULL, ERR_MEM, 0);
+      return ERR_MEM;
+    }
+    if (msg->prio < pEntry->prio)
+      pEntry->prio = msg->prio;
+    /* ask for a family the running query does not cover */
+    for (fam = 0; fam < FAM_COUNT; ++fam){
+      if (!(asked & (1 << fam)) || (pEntry->asked & (1 << fam)))
+        continue;
+      pEntry->asked |= 1 << fam;
+      if (family_fresh(&pEntry->fam[fam]) || family_negative(&pEntry->fam[fam]))
+        continue;
+      entry_write_begin(pEntry);
+      pEntry->fam[fam].state = STATE_ASKING;
+      entry_write_end(pEntry);
+      if (pEntry->state == STATE_ASKING)
+        send_or_defer(i, fam);
+    }
+    /* the running query has already reported, so tell the new callback now */
+    if (pEntry->reported && sti_cb_ptr){
+      fam = family_fresh(&pEntry->fam[pEntry->prefer]) ? pEntry->prefer : !pEntry->prefer;
+      if (family_fresh(&pEntry->fam[fam]))
+        user_report(sti_cb_ptr, pEntry->name, &pEntry->fam[fam].addrs[0], ERR_OK,
+                    family_ttl(&pEntry->fam[fam]));
+    }
+    return ERR_OK;
+  }
+
+  entry_write_begin(pEntry);
+  if (pEntry->state == STATE_UNUSED || strcmp(name, pEntry->name) != 0){
+    ESP_LOGD(TAG, "...build entry for             : %s", name );
+    clear_entry(pEntry);
+    strcpy(pEntry->name, name);
+  }
+  entry_write_end(pEntry);
+  memset(pEntry->found, 0, sizeof(pEntry->found));
+  pEntry->found[0] = sti_cb_ptr;
+  pEntry->seqno = i;
+  pEntry->prio = msg->prio;
+  pEntry->mdns = mdns_name(name);
+  pEntry->asked = asked;
+  pEntry->prefer = family_pref(family);
+  pEntry->reported = 0;
+
+  /* answer straight from the table if the preferred family is still valid */
+  if (family_fresh(&pEntry->fam[pEntry->prefer])){
+    ESP_LOGD(TAG, "...answered from dns table     : %s", ipaddr_ntoa(&pEntry->fam[pEntry->prefer].addrs[0]));
+    report_entry(pEntry, &pEntry->fam[pEntry->prefer]);
+    return ERR_OK;
+  }
+
+  /* ask again for every family that has no valid address or cached negative
+     answer. If there is none to ask for, update_entry() reports straight away */
+  entry_write_begin(pEntry);
+  for (fam = 0; fam < FAM_COUNT; ++fam){
+    if ((asked & (1 << fam)) && !family_fresh(&pEntry->fam[fam]) &&
+        !family_negative(&pEntry->fam[fam]))
+      pEntry->fam[fam].state = STATE_ASKING;
+  }
+  pEntry->state = STATE_NEW;
+  entry_write_end(pEntry);
+
+  /* a valid address of the other family starts the wait for the preferred one */
+  update_entry(i);
+
+  ESP_LOGD(TAG, "...Created record at seq no    : %d", i );
+  ESP_LOGD(TAG, "...Record name is              : %s", pEntry->name );
+  ESP_LOGD(TAG, "...Record state is             : %d", (int) pEntry->state );
+  //ESP_LOGI(TAG, "...Record callback pointer is:         %p", pEntry->found[0] );
+
+  seqno = i + 1;
+  return ERR_OK;
+}
+
+/** search_append() writes a candidate name: name, or name.domain if domain is
+  * not NULL.
+  *
+  * @returns 1 if the candidate fits the dns table, else 0 and out is not used */
+static int
+search_append(char *out, const char *name, const char *domain)
+{
+  size_t len = strlen(name);
+  size_t dlen = (domain != NULL) ? strlen(domain) : 0;
+
+  if (len + ((domain != NULL) ? dlen + 1 : 0) >= MAX_NAME_LENGTH)
+    return 0;
+  memcpy(out, name, len);
+  if (domain != NULL){
+    out[len++] = '.';
+    memcpy(out + len, domain, dlen);
+    len += dlen;
+  }
+  out[len] = 0;
+  return 1;
+}
+
+/** search_candidates() lists the names to ask for a hostname, in search
+  * order, the way resolv.conf does: a name with a trailing dot is asked for
+  * as it is, a name with at least ndots dots is tried as it is before the
+  * search domains, a shorter name after them. Candidates too long for the
+  * dns table are left out. Safe to call from any task.
+  *
+  * @param name the hostname as asked for
+  * @param cand filled with the candidates
+  * @returns the number of candidates, 0 if none fits */
+static int
+search_candidates(const char *name, char cand[][MAX_NAME_LENGTH])
+{
+  SEARCH_CONF conf;
+  size_t len = strlen(name);
+  int n = 0, k, dots = 0;
+  const char *p;
+
+  if (len == 0)
+    return 0;
+  if (name[len - 1] == '.'){
+    if (len == 1 || len - 1 >= MAX_NAME_LENGTH)
+      return 0;
+    memcpy(cand[0], name, len - 1);
+    cand[0][len - 1] = 0;
+    return 1;
+  }
+
+  /* a .local name is only ever asked by mDNS, never with a search domain */
+  if (mdns_name(name))
+    return search_append(cand[0], name, NULL);
+
+  seq_read(&search_conf.seq, &conf, &search_conf, sizeof(conf));
+  for (p = name; *p; ++p){
+    if (*p == '.')
+      ++dots;
+  }
+  if (dots >= conf.ndots)
+    n += search_append(cand[n], name, NULL);
+  for (k = 0; k < conf.count; ++k)
+    n += search_append(cand[n], name, conf.domains[k]);
+  if (dots < conf.ndots)
+    n += search_append(cand[n], name, NULL);
+  return n;
+}
+
+/** search_finish() ends a group and reports its answer under the name that
+  * was asked for.
+  *
+  * @param g the group
+  * @param k the candidate whose address to report, or -1 if no candidate
+  * has one */
+static void
+search_finish(SEARCH_GROUP *g, int k)
+{
+  user_cb_fn found = g->found;
+  char name[MAX_NAME_LENGTH];
+  ip_addr_t ip;
+  u32_t ttl = g->ttl[0];
+  err_t err = ERR_OK;
+
+  /* the callback may start another search that takes this group */
+  strcpy(name, g->name);
+  if (k >= 0){
+    ip = g->addr[k];
+    ttl = g->ttl[k];
+  }
+  else{
+    /* the negative answer holds as long as that of every candidate */
+    err = g->err;
+    for (k = 1; k < g->ncand; ++k)
+      if (g->ttl[k] < ttl)
+        ttl = g->ttl[k];
+  }
+  g->active = 0;
+  wake_waiters(name);
+  user_report(found, name, (err == ERR_OK) ? &ip : NULL, err, ttl);
+}
+
+/** search_settle() finishes a group once the answer is known: the first
+  * candidate in search order with an address, after every candidate before it
+  * has failed, or NULL once every candidate has failed. */
+static void
+search_settle(SEARCH_GROUP *g)
+{
+  u8_t k;
+
+  for (k = 0; k < g->ncand; ++k){
+    if (!(g->done & (1 << k)))
+      return; /* a candidate ahead of the rest is still out */
+    if (g->ok & (1 << k)){
+      search_finish(g, k);
+      return;
+    }
+  }
+  search_finish(g, -1);
+}
+
+/** search_found() is the callback of every candidate query. It marks the
+  * candidate in each group waiting for it. */
+static void
+search_found(char *name, ip_addr_t *addr, err_t status, u32_t ttl)
+{
+  SEARCH_GROUP *g;
+  u8_t j, k, hit;
+
+  for (j = 0; j < RESOLV_SEARCH_GROUPS; ++j){
+    g = &search_groups[j];
+    if (!g->active)
+      continue;
+    hit = 0;
+    for (k = 0; k < g->ncand; ++k){
+      if ((g->done & (1 << k)) || strcmp(g->cand[k], name) != 0)
+        continue;
+      g->done |= 1 << k;
+      g->ttl[k] = ttl;
+      if (addr != NULL){
+        g->ok |= 1 << k;
+        g->addr[k] = *addr;
+      }
+      else if (status == ERR_VAL){
+        g->err = ERR_VAL;
+      }
+      hit = 1;
+    }
+    if (hit)
+      search_settle(g);
+  }
+}
+
+/** do_query_search() is resolv_query_family() in the writer context. A name
+  * with a single candidate is a plain query. Otherwise the query joins the
+  * group already expanding the name, or takes a free group and asks for every
+  * candidate at once, so the answer costs one round trip whichever search
+  * domain it comes from. Negative answers are cached per candidate, so a
+  * repeated lookup only asks for the candidates that may have changed. */
+static err_t
+do_query_search(struct tcpip_api_call_data *call)
+{
+  RESOLV_CALL *msg = (RESOLV_CALL *)call;
+  static const char *TAG = "resolv_query";
+  char cand[RESOLV_MAX_CANDIDATES][MAX_NAME_LENGTH];
+  RESOLV_CALL sub;
+  SEARCH_GROUP *g = NULL;
+  u8_t j, k, gen;
+  int n;
+
+#if RESOLV_STATIC_HOSTS
+  DNS_TABLE_ENTRY copy;
+  DNS_FAMILY *first, *second;
+
+  if (static_entry(msg->name, &copy) && pick_families(&copy, msg->family, &first, &second)){
+    ESP_LOGD(TAG, "...answered from static hosts  : %s", msg->name);
+    user_report(msg->cb, msg->name, &first->addrs[0], ERR_OK, family_ttl(first));
+    return ERR_OK;
+  }
+#endif
+  n = search_candidates(msg->name, cand);
+  if (n == 0){
+    ESP_LOGI(TAG, "...name is too long for the dns table");
+    user_report(msg->cb, msg->name, NULL, ERR_ARG, 0);
+    return ERR_ARG;
+  }
+  if (n == 1){
+    sub = *msg;
+    sub.name = cand[0];
+    return do_query(&sub.call);
+  }
+
+  for (j = 0; j < RESOLV_SEARCH_GROUPS; ++j){
+    g = &search_groups[j];
+    if (g->active && strcmp(g->name, msg->name) == 0 && g->family == msg->family &&
+        (msg->cb == NULL || g->found == NULL || g->found == msg->cb)){
+      ESP_LOGD(TAG, "...joined search for           : %s", msg->name);
+      if (msg->cb)
+        g->found = msg->cb;
+      return ERR_OK;
+    }
+  }
+  for (j = 0; j < RESOLV_SEARCH_GROUPS && search_groups[j].active; ++j);
+  if (j == RESOLV_SEARCH_GROUPS){
+    ESP_LOGI(TAG, "...too many searches, query dropped");
+    user_report(msg->cb, msg->name, NULL, ERR_MEM, 0);
+    return ERR_MEM;
+  }
+
+  g = &search_groups[j];
+  gen = g->gen + 1;
+  memset(g, 0, sizeof(SEARCH_GROUP));
+  g->active = 1;
+  g->gen = gen;
+  g->ncand = n;
+  g->family = msg->family;
+  g->found = msg->cb;
+  g->err = ERR_TIMEOUT;
+  strcpy(g->name, msg->name);
+  memcpy(g->cand, cand, sizeof(cand));
+
+  /* a candidate answered from the dns table may finish the group at once */
+  sub.cb = search_found;
+  sub.family = msg->family;
+  sub.prio = msg->prio;
+  for (k = 0; k < n && g->active && g->gen == gen; ++k){
+    ESP_LOGD(TAG, "...search candidate            : %s", cand[k]);
+    sub.name = cand[k];
+    do_query(&sub.call);
+  }
+  return ERR_OK;
+}
+
+void resolv_query_family(char *name, user_cb_fn sti_cb_ptr, RESOLV_FAMILY family){
+  resolv_query_prio(name, sti_cb_ptr, family, RESOLV_PRIO_NORMAL);
+}
+
+void resolv_query_prio(char *name, user_cb_fn sti_cb_ptr, RESOLV_FAMILY family, RESOLV_PRIORITY prio){
+  RESOLV_CALL msg;
+
+  msg.name = name;
+  msg.cb = sti_cb_ptr;
+  msg.family = family;
+  msg.prio = (prio > RESOLV_PRIO_LOW) ? RESOLV_PRIO_LOW : prio;
+  resolv_call(do_query_search, &msg);
+}
+
+/*---------------------------------------------------------------------------*
+ * Look up a hostname in the array of known hostnames.
+ *
+ * \note This function only looks in the internal array of known
+ * hostnames, it does not send out a query for the hostname if none
+ * was found. The function resolv_query() can be used to send a query
+ * for a hostname.
+ *
+ * return A pointer to a 4-byte representation of the hostname's IP
+ * address, or NULL if the hostname was not found in the array of
+ * hostnames.
+ *---------------------------------------------------------------------------*/
+u32_t
+resolv_lookup(char *name)
+{
+  ip_addr_t addr;
+
+  if (resolv_lookup_addr(name, RESOLV_FAMILY_IPV4, &addr) != ERR_OK)
+    return 0;
+  return addr.u_addr.ip4.addr;
+}
+
+/** read_entry() finds a hostname in the dns table and takes a copy of its
+  * entry. Safe to call from any task.
+  *
+  * @returns the index of the entry or -1 if the name is not in the table */
+static int
+read_entry(char *name, DNS_TABLE_ENTRY *copy)
+{
+  int i;
+
+  /* Walk through name list */
+  for(i=0; i<LWIP_RESOLV_ENTRIES; ++i)
+  {
+    entry_read(&dns_table[i], copy);
+    if ( (copy->state!=STATE_UNUSED) && (strcmp(name, copy->name)==0) )
+      return i;
+  }
+  return -1;
+}
+
+/** wait_result() tells from a copy of an entry how a lookup that found no
+  * address ended.
+  *
+  * @returns ERR_INPROGRESS while a wanted family is not finished, ERR_TIMEOUT
+  * if the server never replied, ERR_VAL if it replied without an address */
+static err_t
+wait_result(DNS_TABLE_ENTRY *copy, RESOLV_FAMILY family)
+{
+  u8_t fam, mask = family_mask(family);
+  err_t err = ERR_TIMEOUT;
+
+  for (fam = 0; fam < FAM_COUNT; ++fam){
+    if (!(mask & (1 << fam)))
+      continue;
+    if (copy->fam[fam].state != STATE_ERROR)
+      return ERR_INPROGRESS;
+    if (copy->fam[fam].err != DNS_RCODE_TIMEOUT)
+      err = ERR_VAL;
+  }
+  return err;
+}
+
+/** search_result() is wait_result() over the search candidates of a name */
+static err_t
+search_result(char *name, RESOLV_FAMILY family)
+{
+  char cand[RESOLV_MAX_CANDIDATES][MAX_NAME_LENGTH];
+  DNS_TABLE_ENTRY copy;
+  err_t err = ERR_TIMEOUT, res;
+  int k, n;
+
+  n = search_candidates(name, cand);
+  for (k = 0; k < n; ++k){
+    if (read_entry(cand[k], &copy) < 0)
+      return ERR_INPROGRESS;
+    res = wait_result(&copy, family);
+    if (res == ERR_INPROGRESS)
+      return res;
+    if (res == ERR_VAL)
+      err = ERR_VAL;
+  }
+  return err;
+}
+
+/** lookup_families() finds a hostname in the dns table, takes a copy of its
+  * entry and returns the valid families of the copy in the order a lookup
+  * should use them. Safe to call from any task.
+  *
+  * The candidates of the search list are tried in order. One that has failed
+  * is passed over, one that has not been answered yet ends the lookup, as it
+  * could still win.
+  *
+  * @param name the hostname
+  * @param family the family or families wanted
+  * @param copy filled with a consistent copy of the entry
+  * @param first set to the preferred family if it is valid, else NULL
+  * @param second set to the other family for dual stack lookups if valid, else NULL
+  * @returns the index of the entry if a valid family was found, -1 if not,
+  * LWIP_RESOLV_ENTRIES for a name of the static host table */
+static int
+lookup_families(char *name, RESOLV_FAMILY family, DNS_TABLE_ENTRY *copy,
+                DNS_FAMILY **first, DNS_FAMILY **second)
+{
+  char cand[RESOLV_MAX_CANDIDATES][MAX_NAME_LENGTH];
+  int i, k, n;
+
+#if RESOLV_STATIC_HOSTS
+  /* the static host table comes before the search list and the dns table */
+  if (static_entry(name, copy) && pick_families(copy, family, first, second))
+    return LWIP_RESOLV_ENTRIES;
+#endif
+  n = search_candidates(name, cand);
+  for (k = 0; k < n; ++k){
+    i = read_entry(cand[k], copy);
+    if (i < 0)
+      return -1;
+    if (pick_families(copy, family, first, second))
+      return i;
+    if (wait_result(copy, family) == ERR_INPROGRESS)
+      return -1;
+  }
+  return -1;
+}
+
+#if RESOLV_HEALTH
+/** health_find() returns the health of an address in a copy of the health
+  * table, or NULL if the address was never reported */
+static ADDR_HEALTH *
+health_find(ADDR_HEALTH *addrs, const ip_addr_t *addr)
+{
+  int k;
+
+  for (k = 0; k < RESOLV_HEALTH_ENTRIES; ++k){
+    if (addrs[k].used && ip_addr_cmp(&addrs[k].addr, addr))
+      return &addrs[k];
+  }
+  return NULL;
+}
+
+/** health_penalty() returns the failure penalty of an address, halved once
+  * per RESOLV_HEALTH_HALF_LIFE_S since its last report */
+static u32_t
+health_penalty(const ADDR_HEALTH *h, u32_t now)
+{
+  u32_t halvings = (now - h->stamp) / RESOLV_HEALTH_HALF_LIFE_S;
+
+  return (halvings < 16) ? (u32_t)h->penalty >> halvings : 0;
+}
+
+/** health_cost() is what a connect to an address is expected to cost in ms,
+  * its smoothed RTT and failure penalty.
+  *
+  * @param h the health of the address, or NULL if it was never reported */
+static u32_t
+health_cost(const ADDR_HEALTH *h, u32_t now)
+{
+  if (h == NULL)
+    return RESOLV_HEALTH_UNKNOWN_MS;
+  return ((h->rtt != 0) ? h->rtt : RESOLV_HEALTH_UNKNOWN_MS) + health_penalty(h, now);
+}
+#endif
+
+/** collect_addrs() lists the addresses of the families a lookup found, the
+  * first family before the second. With address health enabled they are
+  * then sorted cheapest first; addresses of equal cost keep that order.
+  *
+  * @param second the other family of a dual stack lookup, or NULL
+  * @param failing if not NULL, set for each address written to whether it
+  * has at least RESOLV_HEALTH_SKIP_MS of failure penalty
+  * @returns the number of addresses written to addrs, at most max */
+static int
+collect_addrs(DNS_FAMILY *first, DNS_FAMILY *second, ip_addr_t *addrs, int max,
+              u8_t *failing)
+{
+  ip_addr_t all[2 * RESOLV_MAX_ADDRS];
+  int n = 0, k;
+
+  for (k = 0; k < first->count; ++k)
+    all[n++] = first->addrs[k];
+  for (k = 0; second != NULL && k < second->count; ++k)
+    all[n++] = second->addrs[k];
+
+#if RESOLV_HEALTH
+  HEALTH_TABLE health;
+  u32_t cost[2 * RESOLV_MAX_ADDRS], c, now = resolv_now();
+  ip_addr_t a;
+  int j;
+
+  seq_read(&health_table.seq, &health, &health_table, sizeof(HEALTH_TABLE));
+  for (k = 0; k < n; ++k)
+    cost[k] = health_cost(health_find(health.addrs, &all[k]), now);
+  /* insertion sort, stable and at most 2 * RESOLV_MAX_ADDRS long */
+  for (k = 1; k < n; ++k){
+    a = all[k];
+    c = cost[k];
+    for (j = k; j > 0 && cost[j - 1] > c; --j){
+      all[j] = all[j - 1];
+      cost[j] = cost[j - 1];
+    }
+    all[j] = a;
+    cost[j] = c;
+  }
+#endif
+  if (n > max)
+    n = max;
+  memcpy(addrs, all, n * sizeof(ip_addr_t));
+  for (k = 0; failing != NULL && k < n; ++k){
+#if RESOLV_HEALTH
+    ADDR_HEALTH *h = health_find(health.addrs, &all[k]);
+
+    failing[k] = (h != NULL && health_penalty(h, now) >= RESOLV_HEALTH_SKIP_MS);
+#else
+    failing[k] = 0;
+#endif
+  }
+  return n;
+}
+
+err_t
+resolv_lookup_addr(char *name, RESOLV_FAMILY family, ip_addr_t *addr)
+{
+  DNS_TABLE_ENTRY copy;
+  DNS_FAMILY *first, *second;
+
+  if (lookup_families(name, family, &copy, &first, &second) < 0)
+    return ERR_VAL;
+  collect_addrs(first, second, addr, 1, NULL);
+  return ERR_OK;
+}
+
+int
+resolv_lookup_all(char *name, RESOLV_FAMILY family, ip_addr_t *addrs, int max)
+{
+  DNS_TABLE_ENTRY copy;
+  DNS_FAMILY *first, *second;
+
+  if (max <= 0 || lookup_families(name, family, &copy, &first, &second) < 0)
+    return 0;
+  return collect_addrs(first, second, addrs, max, NULL);
+}
+
+err_t
+resolv_lookup_next(char *name, RESOLV_FAMILY family, ip_addr_t *addr)
+{
+  DNS_TABLE_ENTRY copy;
+  DNS_FAMILY *first, *second;
+  ip_addr_t addrs[RESOLV_MAX_ADDRS];
+  u8_t failing[RESOLV_MAX_ADDRS];
+  u32_t n;
+  int i, k, count, healthy;
+
+  i = lookup_families(name, family, &copy, &first, &second);
+  if (i < 0)
+    return ERR_VAL;
+  if (i == LWIP_RESOLV_ENTRIES){
+    /* static hosts do not rotate, they use no RAM */
+    collect_addrs(first, NULL, addr, 1, NULL);
+    return ERR_OK;
+  }
+  /* round robin within the preferred family, cheapest first and passing over
+     the addresses that failed lately unless all of them did */
+  count = collect_addrs(first, NULL, addrs, RESOLV_MAX_ADDRS, failing);
+  for (k = healthy = 0; k < count; ++k){
+    if (!failing[k])
+      addrs[healthy++] = addrs[k];
+  }
+  if (healthy == 0)
+    healthy = count;
+  /* Every task shares the counter; if the entry has since changed name a
+     bump only moves the rotation of the new name on */
+  n = __atomic_fetch_add(&lookup_rotate[i][first - copy.fam], 1, __ATOMIC_RELAXED);
+  *addr = addrs[n % healthy];
+  return ERR_OK;
+}
+
+#if RESOLV_HEALTH
+/** do_report_connect() is resolv_report_connect() in the writer context. An
+  * address not in the health table takes a free slot, or that of the address
+  * reported least recently. */
+static err_t
+do_report_connect(struct tcpip_api_call_data *call)
+{
+  RESOLV_CALL *msg = (RESOLV_CALL *)call;
+  ADDR_HEALTH *h = health_find(health_table.addrs, msg->addr);
+  u32_t now = resolv_now(), penalty = 0, rtt;
+  int k;
+
+  if (h != NULL){
+    penalty = health_penalty(h, now);
+  }
+  else{
+    h = &health_table.addrs[0];
+    for (k = 0; k < RESOLV_HEALTH_ENTRIES; ++k){
+      if (!health_table.addrs[k].used){
+        h = &health_table.addrs[k];
+        break;
+      }
+      if ((s32_t)(health_table.addrs[k].stamp - h->stamp) < 0)
+        h = &health_table.addrs[k];
+    }
+  }
+
+  entry_write_begin(&health_table);
+  if (!h->used || !ip_addr_cmp(&h->addr, msg->addr)){
+    memset(h, 0, sizeof(ADDR_HEALTH));
+    h->used = 1;
+    h->addr = *msg->addr;
+  }
+  if (msg->ok){
+    if (msg->rtt_ms != 0){
+      /* smoothed as TCP smooths its RTT, RFC 6298 */
+      rtt = (msg->rtt_ms < 0xffff) ? msg->rtt_ms : 0xffff;
+      h->rtt = (h->rtt != 0) ? (7 * h->rtt + rtt) / 8 : rtt;
+      if (h->rtt == 0)
+        h->rtt = 1;
+    }
+    penalty /= 2;
+  }
+  else{
+    penalty += RESOLV_HEALTH_FAIL_MS;
+    if (penalty > RESOLV_HEALTH_MAX_MS)
+      penalty = RESOLV_HEALTH_MAX_MS;
+  }
+  h->penalty = penalty;
+  h->stamp = now;
+  entry_write_end(&health_table);
+  return ERR_OK;
+}
+#endif
+
+esp_err_t
+resolv_report_connect(const ip_addr_t *addr, u8_t ok, u32_t rtt_ms)
+{
+#if RESOLV_HEALTH
+  RESOLV_CALL msg;
+
+  if (addr == NULL)
+    return ESP_ERR_INVALID_ARG;
+  if (!__atomic_load_n(&initFlag, __ATOMIC_ACQUIRE))
+    return ESP_ERR_INVALID_STATE;
+  msg.addr = addr;
+  msg.ok = ok;
+  msg.rtt_ms = rtt_ms;
+  resolv_call(do_report_connect, &msg);
+  return ESP_OK;
+#else
+  return ESP_ERR_NOT_SUPPORTED;
+#endif
+}
+
+/** do_unwait() takes a waiter that gave up off the list, in the writer context */
+static err_t
+do_unwait(struct tcpip_api_call_data *call)
+{
+  RESOLV_CALL *msg = (RESOLV_CALL *)call;
+  RESOLV_WAITER **pw;
+
+  for (pw = &waiters; *pw != NULL; pw = &(*pw)->next){
+    if (*pw == msg->waiter){
+      *pw = msg->waiter->next;
+      break;
+    }
+  }
+  return ERR_OK;
+}
+
+/** do_wait() puts a waiter on the list and enters its query, in the writer
+  * context. The waiter goes first so an answer from the table wakes it. */
+static err_t
+do_wait(struct tcpip_api_call_data *call)
+{
+  RESOLV_CALL *msg = (RESOLV_CALL *)call;
+  char cand[RESOLV_MAX_CANDIDATES][MAX_NAME_LENGTH];
+  err_t err;
+  int n;
+
+  /* a search group reports under the name asked for, a single query under
+     the name it sends */
+  n = search_candidates(msg->name, cand);
+  if (n == 0)
+    return ERR_ARG;
+  strcpy(msg->waiter->name, (n > 1) ? msg->name : cand[0]);
+
+  msg->waiter->next = waiters;
+  waiters = msg->waiter;
+  msg->cb = NULL;
+  err = do_query_search(call);
+  if (err != ERR_OK)
+    do_unwait(call);
+  return err;
+}
+/** resolv_wait() gets the addresses of a hostname from the dns table, or
+  * asks the DNS server and blocks until the answer is in. A query already
+  * running for the name is joined rather than sent again.
+  *
+  * @param name the hostname
+  * @param family the family or families wanted
+  * @param addrs array filled with the addresses
+  * @param max number of entries in addrs
+  * @returns the number of addresses, or ERR_VAL if the name has no address,
+  * ERR_TIMEOUT if the server did not answer in RESOLV_WAIT_MS, ERR_ARG if the
+  * name is too long, ERR_MEM if the dns table is full, ERR_CONN before
+  * resolv_init() and ERR_WOULDBLOCK in the tcpip thread */
+static int
+resolv_wait(char *name, RESOLV_FAMILY family, ip_addr_t *addrs, int max)
+{
+  RESOLV_WAITER waiter;
+  RESOLV_CALL msg;
+  int64_t start, wait = (int64_t)RESOLV_WAIT_MS * 1000;
+  err_t err = ERR_TIMEOUT;
+  int n;
+
+  n = resolv_lookup_all(name, family, addrs, max);
+  if (n > 0)
+    return n;
+  if (writer_task == NULL)
+    return ERR_CONN;
+  if (xTaskGetCurrentTaskHandle() == writer_task)
+    return ERR_WOULDBLOCK; /* the answer could never come in */
+
+  waiter.sem = xSemaphoreCreateBinary();
+  if (waiter.sem == NULL)
+    return ERR_MEM;
+  msg.name = name;
+  msg.family = family;
+  msg.prio = RESOLV_PRIO_NORMAL;
+  msg.waiter = &waiter;
+
+  start = resolv_time_us();
+  while (resolv_time_us() - start < wait){
+    err = resolv_call(do_wait, &msg);
+    if (err != ERR_OK)
+      break;
+    /* send and retry the query while waiting for it */
+    check_entries();
+    while (xSemaphoreTake(waiter.sem, RESOLV_WAIT_POLL_MS / portTICK_PERIOD_MS) != pdTRUE){
+      if (resolv_time_us() - start >= wait)
+        break;
+      check_entries();
+    }
+    resolv_call(do_unwait, &msg);
+
+    n = resolv_lookup_all(name, family, addrs, max);
+    if (n > 0)
+      break;
+    /* woken early, for example by the other family of a dual stack query */
+    err = search_result(name, family);
+    if (err != ERR_INPROGRESS)
+      break;
+  }
+  vSemaphoreDelete(waiter.sem);
+
+  if (n > 0)
+    return n;
+  return (err == ERR_INPROGRESS || err == ERR_OK) ? ERR_TIMEOUT : err;
+}
+
+RESOLV_RESULT
+resolv_gethostbyname(char *name, ip_addr_t *addr, user_cb_fn sti_cb_ptr, RESOLV_FAMILY family)
+{
+  RESOLV_CALL msg;
+
+  if (name == NULL || *name == 0 || strlen(name) >= MAX_NAME_LENGTH)
+    return RESOLV_QUERY_INVALID;
+  if (ipaddr_aton(name, addr) || resolv_lookup_addr(name, family, addr) == ERR_OK)
+    return RESOLV_COMPLETE;
+
+  msg.name = name;
+  msg.cb = sti_cb_ptr;
+  msg.family = family;
+  msg.prio = RESOLV_PRIO_NORMAL;
+  if (resolv_call(do_query_search, &msg) != ERR_OK)
+    return RESOLV_QUERY_INVALID;
+  return RESOLV_QUERY_QUEUED;
+}
+
+/** @brief Buffer layout of sti_gethostbyname_r() */
+typedef struct s_hostent_buf {
+  ip4_addr_t addrs[RESOLV_MAX_ADDRS];
+  ip4_addr_t *addr_list[RESOLV_MAX_ADDRS + 1];
+  char *aliases;
+  char name[1]; /**< the hostname is copied here, NUL terminated */
+} HOSTENT_BUF;
+
+int
+sti_gethostbyname_r(const char *name, struct hostent *ret, char *buf,
+                    size_t buflen, struct hostent **result, int *h_errnop)
+{
+  HOSTENT_BUF *h;
+  ip_addr_t addrs[RESOLV_MAX_ADDRS];
+  size_t namelen;
+  int n, k;
+  int dummy;
+
+  if (h_errnop == NULL)
+    h_errnop = &dummy; /* h_errnop is optional */
+  if (result == NULL){
+    *h_errnop = EINVAL;
+    return -1;
+  }
+  *result = NULL;
+  if (name == NULL || ret == NULL || buf == NULL){
+    *h_errnop = EINVAL;
+    return -1;
+  }
+
+  namelen = strlen(name);
+  h = (HOSTENT_BUF *)LWIP_MEM_ALIGN(buf);
+  if (buflen < (size_t)((char *)h - buf) + sizeof(HOSTENT_BUF) + namelen){
+    *h_errnop = ERANGE;
+    return -1;
+  }
+
+  if (ipaddr_aton(name, &addrs[0]))
+    n = 1;
+  else
+    n = resolv_wait((char *)name, RESOLV_FAMILY_IPV4, addrs, RESOLV_MAX_ADDRS);
+  if (n <= 0){
+    *h_errnop = (n == ERR_TIMEOUT) ? TRY_AGAIN :
+                (n == ERR_VAL || n == ERR_ARG) ? HOST_NOT_FOUND : NO_RECOVERY;
+    return -1;
+  }
+
+  for (k = 0; k < n && IP_IS_V4(&addrs[k]); ++k){
+    ip4_addr_copy(h->addrs[k], *ip_2_ip4(&addrs[k]));
+    h->addr_list[k] = &h->addrs[k];
+  }
+  if (k == 0){
+    *h_errnop = HOST_NOT_FOUND; /* an IPv6 literal */
+    return -1;
+  }
+  h->addr_list[k] = NULL;
+  h->aliases = NULL;
+  memcpy(h->name, name, namelen + 1);
+
+  ret->h_name = h->name;
+  ret->h_aliases = &h->aliases;
+  ret->h_addrtype = AF_INET;
+  ret->h_length = sizeof(ip4_addr_t);
+  ret->h_addr_list = (char **)h->addr_list;
+  *result = ret;
+  return 0;
+}
+
+int
+sti_getaddrinfo(const char *nodename, const char *servname,
+                const struct addrinfo *hints, struct addrinfo **res)
+{
+  ip_addr_t addrs[2 * RESOLV_MAX_ADDRS];
+  RESOLV_FAMILY family = RESOLV_FAMILY_DEFAULT;
+  struct addrinfo *ai;
+  struct sockaddr_storage *sa;
+  size_t namelen = 0, total;
+  int ai_family = AF_UNSPEC;
+  int port_nr = 0;
+  int n, k;
+
+  if (res == NULL)
+    return EAI_FAIL;
+  *res = NULL;
+  if (nodename == NULL && servname == NULL)
+    return EAI_NONAME;
+
+  if (hints != NULL){
+    ai_family = hints->ai_family;
+    if (ai_family == AF_INET)
+      family = RESOLV_FAMILY_IPV4;
+    else if (ai_family == AF_INET6)
+      family = RESOLV_FAMILY_IPV6;
+    else if (ai_family != AF_UNSPEC)
+      return EAI_FAMILY;
+  }
+
+  if (servname != NULL){
+    /* only numeric ports, there is no services database */
+    port_nr = atoi(servname);
+    if (port_nr <= 0 || port_nr > 0xffff)
+      return EAI_SERVICE;
+  }
+
+  if (nodename != NULL){
+    if (ipaddr_aton(nodename, &addrs[0])){
+      n = 1;
+      if ((ai_family == AF_INET && !IP_IS_V4(&addrs[0])) ||
+          (ai_family == AF_INET6 && !IP_IS_V6(&addrs[0])))
+        return EAI_NONAME;
+    }
+    else if (hints != NULL && (hints->ai_flags & AI_NUMERICHOST)){
+      return EAI_NONAME;
+    }
+    else{
+      n = resolv_wait((char *)nodename, family, addrs, 2 * RESOLV_MAX_ADDRS);
+      if (n <= 0)
+        return (n == ERR_VAL || n == ERR_ARG) ? EAI_NONAME : EAI_FAIL;
+    }
+    if (hints != NULL && (hints->ai_flags & AI_CANONNAME))
+      namelen = strlen(nodename) + 1;
+  }
+  else{
+    /* no name: the any address to bind to, else loopback */
+    n = 1;
+    if (ai_family == AF_INET6){
+      if (hints->ai_flags & AI_PASSIVE)
+        ip_addr_set_any(1, &addrs[0]);
+      else
+        ip_addr_set_loopback(1, &addrs[0]);
+    }
+    else{
+      if (hints != NULL && (hints->ai_flags & AI_PASSIVE))
+        ip_addr_set_any(0, &addrs[0]);
+      else
+        ip_addr_set_loopback(0, &addrs[0]);
+    }
+  }
+
+  /* one addrinfo per address, built back to front to keep the order */
+  for (k = n - 1; k >= 0; --k){
+    total = sizeof(struct addrinfo) + sizeof(struct sockaddr_storage) + (k == 0 ? namelen : 0);
+    ai = (struct addrinfo *)mem_malloc((mem_size_t)total);
+    if (ai == NULL){
+      sti_freeaddrinfo(*res);
+      *res = NULL;
+      return EAI_MEMORY;
+    }
+    memset(ai, 0, total);
+    sa = (struct sockaddr_storage *)(void *)((u8_t *)ai + sizeof(struct addrinfo));
+    if (IP_IS_V6(&addrs[k])){
+      struct sockaddr_in6 *sa6 = (struct sockaddr_in6 *)sa;
+      sa6->sin6_len = sizeof(struct sockaddr_in6);
+      sa6->sin6_family = AF_INET6;
+      sa6->sin6_port = lwip_htons((u16_t)port_nr);
+      inet6_addr_from_ip6addr(&sa6->sin6_addr, ip_2_ip6(&addrs[k]));
+      ai->ai_family = AF_INET6;
+      ai->ai_addrlen = sizeof(struct sockaddr_in6);
+    }
+    else{
+      struct sockaddr_in *sa4 = (struct sockaddr_in *)sa;
+      sa4->sin_len = sizeof(struct sockaddr_in);
+      sa4->sin_family = AF_INET;
+      sa4->sin_port = lwip_htons((u16_t)port_nr);
+      inet_addr_from_ip4addr(&sa4->sin_addr, ip_2_ip4(&addrs[k]));
+      ai->ai_family = AF_INET;
+      ai->ai_addrlen = sizeof(struct sockaddr_in);
+    }
+    if (hints != NULL){
+      ai->ai_socktype = hints->ai_socktype;
+      ai->ai_protocol = hints->ai_protocol;
+    }
+    ai->ai_addr = (struct sockaddr *)sa;
+    if (k == 0 && namelen > 0){
+      ai->ai_canonname = (char *)ai + sizeof(struct addrinfo) + sizeof(struct sockaddr_storage);
+      memcpy(ai->ai_canonname, nodename, namelen);
+    }
+    ai->ai_next = *res;
+    *res = ai;
+  }
+  return 0;
+}
+
+void
+sti_freeaddrinfo(struct addrinfo *ai)
+{
+  struct addrinfo *next;
+
+  while (ai != NULL){
+    next = ai->ai_next;
+    mem_free(ai);
+    ai = next;
+  }
+}
+
+/*---------------------------------------------------------------------------*
+ * Obtain the currently configured DNS server.
+ * return unsigned long encoding of the IP address of
+ * the currently configured DNS server or NULL if no DNS server has
+ * been configured.
+ *---------------------------------------------------------------------------*/
+/** reverse_find() picks the reverse index slot for an address: the entry
+  * already holding it, else an unused entry, else the finished entry that
+  * expires first. A query in flight for another callback is not joined, an
+  * entry keeps one callback.
+  *
+  * @returns index into rev_table or -1 if every entry is busy */
+static int
+reverse_find(const ip_addr_t *addr, reverse_cb_fn cb)
+{
+  REVERSE_ENTRY *pRev;
+  int k, use = -1;
+
+  for(k = 0; k < RESOLV_REVERSE_ENTRIES; ++k){
+    pRev = &rev_table[k];
+    if(pRev->state == STATE_NEW || pRev->state == STATE_ASKING){
+      if(ip_addr_cmp(&pRev->addr, addr) && (cb == NULL || pRev->found == NULL || pRev->found == cb))
+        return k;
+      continue;
+    }
+    if(pRev->state != STATE_UNUSED && ip_addr_cmp(&pRev->addr, addr))
+      return k;
+    if(use < 0 || (rev_table[use].state != STATE_UNUSED &&
+       (pRev->state == STATE_UNUSED || (s32_t)(pRev->expires - rev_table[use].expires) < 0)))
+      use = k;
+  }
+  return use;
+}
+
+/** do_reverse() is resolv_reverse() in the writer context */
+static err_t
+do_reverse(struct tcpip_api_call_data *call)
+{
+  RESOLV_CALL *msg = (RESOLV_CALL *)call;
+  static const char *TAG = "resolv_rev  ";
+  REVERSE_ENTRY *pRev;
+  char name[MAX_NAME_LENGTH];
+  int k;
+
+  k = reverse_find(msg->addr, msg->rev_cb);
+  if(k < 0){
+    ESP_LOGI(TAG, "...reverse index is full, query dropped");
+    reverse_report(msg->rev_cb, msg->addr, NULL);
+    return ERR_MEM;
+  }
+  pRev = &rev_table[k];
+  if(pRev->state == STATE_NEW || pRev->state == STATE_ASKING){
+    if(msg->rev_cb)
+      pRev->found = msg->rev_cb;
+    return ERR_OK;
+  }
+  if(ip_addr_cmp(&pRev->addr, msg->addr) && reverse_fresh(pRev)){
+    ESP_LOGD(TAG, "...answered from reverse index : %s", pRev->name);
+    if(msg->rev_cb){
+      strcpy(name, pRev->name);
+      reverse_report(msg->rev_cb, msg->addr, (pRev->state == STATE_DONE) ? name : NULL);
+    }
+    return ERR_OK;
+  }
+
+  /* ask; an expired name of the address is kept to be served stale */
+  entry_write_begin(pRev);
+  if(pRev->state == STATE_UNUSED || !ip_addr_cmp(&pRev->addr, msg->addr)){
+    memset((u8_t *)pRev + sizeof(pRev->seq), 0, sizeof(REVERSE_ENTRY) - sizeof(pRev->seq));
+    pRev->addr = *msg->addr;
+  }
+  pRev->state = STATE_NEW;
+  entry_write_end(pRev);
+  pRev->found = msg->rev_cb;
+  ESP_LOGD(TAG, "...reverse query for           : %s", ipaddr_ntoa(msg->addr));
+  return ERR_OK;
+}
+
+err_t
+resolv_reverse(const ip_addr_t *addr, reverse_cb_fn cb)
+{
+  RESOLV_CALL msg;
+
+  if(addr == NULL || (!IP_IS_V4(addr) && !IP_IS_V6(addr)))
+    return ERR_ARG;
+  if(!__atomic_load_n(&initFlag, __ATOMIC_ACQUIRE))
+    return ERR_CONN;
+  msg.addr = addr;
+  msg.rev_cb = cb;
+  return resolv_call(do_reverse, &msg);
+}
+
+err_t
+resolv_reverse_lookup(const ip_addr_t *addr, char *name, size_t len)
+{
+  REVERSE_ENTRY copy;
+  int k;
+
+  if(addr == NULL || name == NULL)
+    return ERR_ARG;
+  for(k = 0; k < RESOLV_REVERSE_ENTRIES; ++k){
+    seq_read(&rev_table[k].seq, &copy, &rev_table[k], sizeof(REVERSE_ENTRY));
+    if(copy.state != STATE_UNUSED && ip_addr_cmp(&copy.addr, addr) && reverse_fresh(&copy)){
+      if(copy.state != STATE_DONE)
+        return ERR_VAL;
+      if(strlen(copy.name) >= len)
+        return ERR_BUF;
+      strcpy(name, copy.name);
+      return ERR_OK;
+    }
+  }
+  return ERR_VAL;
+}
+
+#if RESOLV_BROWSE
+static void browse_step(void);
+
+/** decode_wire() reads an encoded name of a received buffer as decode_name()
+  * does, but keeps it in wire format: each label led by its length, then a
+  * 0. A label may then hold any byte, a dot included (RFC 6763 section 4.3).
+  *
+  * @param msg a pointer to the start of the received buffer
+  * @param end a pointer to the first byte after the received buffer
+  * @param ptr a pointer to the start of the name
+  * @param out where the name goes
+  * @param len size of out
+  * @returns the bytes written to out, or 0 if the name is malformed, runs
+  * past end or does not fit */
+static size_t
+decode_wire(unsigned char *msg, unsigned char *end, unsigned char *ptr, u8_t *out, size_t len)
+{
+  unsigned char *low = ptr;
+  size_t o = 0;
+  u8_t n;
+
+  while(ptr < end){
+    n = *ptr;
+    if(n == 0){
+      if(o + 1 > len)
+        return 0;
+      out[o++] = 0;
+      return o;
+    }
+    if((n & 0xc0) == 0xc0){
+      if(ptr + 2 > end)
+        return 0;
+      ptr = msg + (((n & 0x3f) << 8) | ptr[1]);
+      if(ptr >= low)
+        return 0;
+      low = ptr;
+      continue;
+    }
+    if((n & 0xc0) != 0 || ptr + 1 + n > end || o + n + 2 > len)
+      return 0;
+    memcpy(out + o, ptr, n + 1);
+    o += n + 1;
+    ptr += n + 1;
+  }
+  return 0;
+}
+
+/** wire_is() checks if the name at ptr in a reply is an instance, label by
+  * label and regardless of case.
+  *
+  * @param m the reply, parsed
+  * @param ptr the name in the reply
+  * @param b the instance */
+static int
+wire_is(DNS_MSG *m, unsigned char *ptr, const BROWSE_INST *b)
+{
+  u8_t wire[MAX_NAME_LENGTH + 1];
+  size_t n, k;
+
+  n = decode_wire(m->msg, m->end, ptr, wire, sizeof(wire));
+  if(n != b->wire_len)
+    return 0;
+  /* the length bytes are below 64 and tolower() leaves them as they are */
+  for(k = 0; k < n; ++k){
+    if(tolower(wire[k]) != tolower(b->wire[k]))
+      return 0;
+  }
+  return 1;
+}
+
+/** browse_query() gives the query of the browse a reply ID stands for.
+  *
+  * @param fam FAM_BROWSE_PTR, FAM_BROWSE_SRV or FAM_BROWSE_TXT
+  * @param k index of the instance in browse_inst, 0 for the PTR query
+  * @returns the query, or NULL if there is none */
+static BROWSE_QUERY *
+browse_query(u8_t fam, u16_t k)
+{
+  if(!browse.active)
+    return NULL;
+  if(fam == FAM_BROWSE_PTR)
+    return (k == 0) ? &browse.ptr : NULL;
+  if(k >= RESOLV_BROWSE_INSTANCES || !browse_inst[k].used)
+    return NULL;
+  return &browse_inst[k].q[fam - FAM_BROWSE_SRV];
+}
+
+/** send_browse() sends a query of the browse. The ID of the query is made
+  * from the index of the instance and its FAM_BROWSE_ family.
+  *
+  * @param fam FAM_BROWSE_PTR, FAM_BROWSE_SRV or FAM_BROWSE_TXT
+  * @param k index of the instance in browse_inst, 0 for the PTR query */
+static void
+send_browse(u8_t fam, u8_t k)
+{
+  static const u8_t types[] = { MESSAGE_T_PTR, MESSAGE_T_SRV, MESSAGE_T_TXT };
+  BROWSE_QUERY *q = browse_query(fam, k);
+  u32_t buf[(sizeof(DNS_HDR)+MAX_NAME_LENGTH+1+4+MESSAGE_OPT_LEN+3) / 4]; /* u32_t keeps hdr aligned */
+  DNS_HDR *hdr = (DNS_HDR *)buf;
+  char *query = (char *)hdr + sizeof(DNS_HDR);
+  int len, opt_len;
+
+  memset(hdr, 0, sizeof(DNS_HDR));
+  hdr->id = htons(QUERY_ID(k, fam));
+  hdr->flags1 = DNS_FLAG1_RD;
+  hdr->numquestions = htons(1);
+  if(fam == FAM_BROWSE_PTR){
+    len = encode_name(browse.service, query);
+    query[len++] = 0;
+  }
+  else{
+    /* the instance label may hold a dot, so it is sent as it came */
+    len = browse_inst[k].wire_len;
+    memcpy(query, browse_inst[k].wire, len);
+  }
+  query[len++] = 0;
+  query[len++] = types[fam - FAM_BROWSE_PTR];
+  query[len++] = 0;
+  query[len++] = MESSAGE_C_IN;
+  opt_len = add_edns_opt(hdr, query + len, q->server);
+  q->edns = (opt_len != 0);
+  send_msg(q->server, (unsigned char *)buf, sizeof(DNS_HDR) + len + opt_len);
+}
+
+/** check_browse() sends the queries of the browse that are due, as
+  * check_reverse() does for the reverse index. A query out of retries
+  * ends in STATE_ERROR.
+  *
+  * @param tick set to 1 to run the retry timers
+  * @param limited set to 1 once the rate limiter holds a query back */
+static void
+check_browse(u8_t tick, u8_t *limited)
+{
+  BROWSE_QUERY *q;
+  u8_t fam, k;
+
+  for(fam = FAM_BROWSE_PTR; fam <= FAM_BROWSE_TXT; ++fam){
+    for(k = 0; k < RESOLV_BROWSE_INSTANCES; ++k){
+      q = browse_query(fam, k);
+      if(q == NULL)
+        continue;
+      if(q->state == STATE_ASKING && !q->deferred){
+        if(!tick)
+          continue;
+        if(q->tmr > 1){
+          --q->tmr;
+          continue;
+        }
+        if(q->retries + 1 == MAX_RETRIES){
+          q->state = STATE_ERROR;
+          browse_step();
+          continue;
+        }
+      }
+      else if(q->state != STATE_NEW && q->state != STATE_ASKING){
+        continue;
+      }
+      if(*limited || !rate_take(1)){
+        *limited = 1;
+        q->deferred = 1;
+        continue;
+      }
+      q->deferred = 0;
+      if(q->state == STATE_ASKING){
+        ++q->retries;
+        q->tmr = q->retries;
+        q->server = (q->server + 1) % nservers;
+      }
+      else{
+        q->state = STATE_ASKING;
+        q->tmr = 1;
+        q->retries = 0;
+        q->server = cur_server;
+      }
+      send_browse(fam, k);
+    }
+  }
+}
+
+/** browse_ttl() keeps the lowest TTL of the records of an instance */
+static void
+browse_ttl(BROWSE_INST *b, u32_t ttl)
+{
+  if(ttl < b->ttl)
+    b->ttl = ttl;
+}
+
+/** browse_add() takes an instance the PTR answer lists, once.
+  *
+  * @param m the reply, parsed
+  * @param pRR the PTR record
+  * @param name the instance as text */
+static void
+browse_add(DNS_MSG *m, DNS_RR *pRR, const char *name)
+{
+  static const char *TAG = "resolv_brwse";
+  BROWSE_INST *b;
+  u8_t k;
+
+  for(k = 0; k < RESOLV_BROWSE_INSTANCES; ++k){
+    if(browse_inst[k].used && wire_is(m, m->msg + pRR->rdata, &browse_inst[k]))
+      return;
+  }
+  for(k = 0; k < RESOLV_BROWSE_INSTANCES; ++k){
+    b = &browse_inst[k];
+    if(b->used)
+      continue;
+    memset(b, 0, sizeof(BROWSE_INST));
+    b->wire_len = decode_wire(m->msg, m->end, m->msg + pRR->rdata, b->wire, sizeof(b->wire));
+    if(b->wire_len == 0)
+      return;
+    b->used = 1;
+    b->ttl = pRR->ttl;
+    strcpy(b->name, name);
+    b->q[BROWSE_SRV].state = STATE_NEW;
+    b->q[BROWSE_TXT].state = STATE_NEW;
+    ESP_LOGD(TAG, "...instance found              : %s", name);
+    return;
+  }
+  ESP_LOGI(TAG, "...too many instances, left out: %s", name);
+}
+
+/** browse_harvest() takes the SRV, TXT and address records of the
+  * instances from the answer and additional sections of a reply, whatever
+  * query it answers. The TXT strings that do not fit are left out, an
+  * address of the preferred family of RESOLV_FAMILY_DEFAULT wins.
+  *
+  * @param m the reply, parsed */
+static void
+browse_harvest(DNS_MSG *m)
+{
+  u8_t mask = family_mask(RESOLV_FAMILY_DEFAULT), pref = family_pref(RESOLV_FAMILY_DEFAULT);
+  BROWSE_INST *b;
+  DNS_RR *pRR;
+  unsigned char *rd;
+  u32_t hash;
+  u16_t n, k, s;
+  u8_t fam, got;
+
+  for(k = 0; k < RESOLV_BROWSE_INSTANCES; ++k){
+    b = &browse_inst[k];
+    if(!b->used || b->settled)
+      continue;
+    hash = static_hash(b->name, strlen(b->name), 0);
+    for(n = 0, pRR = m->rrs; n < m->nrrs + m->nadd; ++n, ++pRR){
+      rd = m->msg + pRR->rdata;
+      if(pRR->type == MESSAGE_T_SRV && b->q[BROWSE_SRV].state != STATE_DONE &&
+         pRR->rdlen > 6 && pRR->hash == hash && wire_is(m, m->msg + pRR->owner, b) &&
+         decode_name(m->msg, m->end, rd + 6, b->target, sizeof(b->target), NULL) != NULL){
+        b->priority = GET16(rd);
+        b->weight = GET16(rd + 2);
+        b->port = GET16(rd + 4);
+        b->q[BROWSE_SRV].state = STATE_DONE;
+        browse_ttl(b, pRR->ttl);
+      }
+      else if(pRR->type == MESSAGE_T_TXT && b->q[BROWSE_TXT].state != STATE_DONE &&
+              pRR->hash == hash && wire_is(m, m->msg + pRR->owner, b)){
+        /* each string is a length byte and that many bytes */
+        b->txt_len = 0;
+        for(s = 0; s < pRR->rdlen && s + 1 + rd[s] <= pRR->rdlen &&
+                   b->txt_len + 1 + rd[s] <= RESOLV_BROWSE_TXT; s += 1 + rd[s]){
+          memcpy(b->txt + b->txt_len, rd + s, 1 + rd[s]);
+          b->txt_len += 1 + rd[s];
+        }
+        b->q[BROWSE_TXT].state = STATE_DONE;
+        browse_ttl(b, pRR->ttl);
+      }
+    }
+
+    /* the addresses of the target, once the SRV record has named it */
+    if(b->q[BROWSE_SRV].state != STATE_DONE || b->addr_state == STATE_DONE || b->target[0] == 0)
+      continue;
+    hash = static_hash(b->target, strlen(b->target), 0);
+    got = FAM_COUNT;
+    for(n = 0, pRR = m->rrs; n < m->nrrs + m->nadd; ++n, ++pRR){
+      if(pRR->type == MESSAGE_T_A && pRR->rdlen == 4)
+        fam = FAM_V4;
+      else if(pRR->type == MESSAGE_T_AAAA && pRR->rdlen == 16)
+        fam = FAM_V6;
+      else
+        continue;
+      if(!(mask & (1 << fam)) || (got != FAM_COUNT && (got == pref || fam != pref)) ||
+         !owner_is(m, pRR, b->target, hash))
+        continue;
+      memset(&b->addr, 0, sizeof(b->addr));
+      if(fam == FAM_V4){
+        memcpy(&ip_2_ip4(&b->addr)->addr, m->msg + pRR->rdata, 4);
+        b->addr.type = IPADDR_TYPE_V4;
+      }
+      else{
+        memcpy(ip_2_ip6(&b->addr)->addr, m->msg + pRR->rdata, 16);
+        b->addr.type = IPADDR_TYPE_V6;
+      }
+      browse_ttl(b, pRR->ttl);
+      got = fam;
+    }
+    if(got != FAM_COUNT)
+      b->addr_state = STATE_DONE;
+  }
+}
+
+/** browse_found() is the callback of the address queries of the browse */
+static void
+browse_found(char *name, ip_addr_t *addr, err_t status, u32_t ttl)
+{
+  BROWSE_INST *b;
+  u8_t k;
+
+  for(k = 0; k < RESOLV_BROWSE_INSTANCES; ++k){
+    b = &browse_inst[k];
+    if(!b->used || b->settled || b->addr_state != STATE_ASKING || strcmp(b->target, name) != 0)
+      continue;
+    if(addr != NULL){
+      b->addr = *addr;
+      b->addr_state = STATE_DONE;
+      browse_ttl(b, ttl);
+    }
+    else{
+      b->addr_state = STATE_ERROR;
+    }
+  }
+  browse_step();
+}
+
+/** browse_step() moves every instance on: it asks for the address of the
+  * target once the SRV record is in, reports the instance once its SRV,
+  * TXT and address are, and ends the browse when the PTR query and every
+  * instance are done. An instance without an SRV record or address is left
+  * out. An address query may answer at once and call browse_step() again;
+  * that call only asks for another pass. */
+static void
+browse_step(void)
+{
+  RESOLV_CALL sub;
+  RESOLV_SERVICE inst;
+  BROWSE_INST *b;
+  browse_cb_fn cb;
+  char service[MAX_NAME_LENGTH];
+  u8_t k, busy;
+
+  if(browse.stepping){
+    browse.again = 1;
+    return;
+  }
+  browse.stepping = 1;
+  do{
+    browse.again = 0;
+    busy = (browse.ptr.state == STATE_NEW || browse.ptr.state == STATE_ASKING);
+    for(k = 0; k < RESOLV_BROWSE_INSTANCES && browse.active; ++k){
+      b = &browse_inst[k];
+      if(!b->used || b->settled)
+        continue;
+      /* "." as the target says there is no such service (RFC 2782) */
+      if(b->q[BROWSE_SRV].state == STATE_ERROR || b->addr_state == STATE_ERROR ||
+         (b->q[BROWSE_SRV].state == STATE_DONE && b->target[0] == 0)){
+        b->settled = 1;
+        continue;
+      }
+      if(b->q[BROWSE_SRV].state == STATE_DONE && b->addr_state == STATE_UNUSED){
+        b->addr_state = STATE_ASKING;
+        memset(&sub, 0, sizeof(sub));
+        sub.name = b->target;
+        sub.cb = browse_found;
+        sub.family = RESOLV_FAMILY_DEFAULT;
+        sub.prio = RESOLV_PRIO_NORMAL;
+        do_query(&sub.call);
+      }
+      if(b->q[BROWSE_SRV].state == STATE_DONE && b->addr_state == STATE_DONE &&
+         (b->q[BROWSE_TXT].state == STATE_DONE || b->q[BROWSE_TXT].state == STATE_ERROR)){
+        b->settled = 1;
+        inst.name = b->name;
+        inst.target = b->target;
+        inst.port = b->port;
+        inst.priority = b->priority;
+        inst.weight = b->weight;
+        inst.txt = b->txt;
+        inst.txt_len = b->txt_len;
+        inst.addr = b->addr;
+        inst.ttl = b->ttl;
+        browse_report(browse.cb, browse.service, &inst);
+        continue;
+      }
+      busy = 1;
+    }
+  } while(browse.again && browse.active);
+  browse.stepping = 0;
+
+  if(!busy && browse.active){
+    browse.active = 0;
+    cb = browse.cb;
+    strcpy(service, browse.service);
+    browse_report(cb, service, NULL);
+  }
+}
+
+/** browse_recv() takes the reply to a query of the browse.
+  *
+  * @param fam FAM_BROWSE_PTR, FAM_BROWSE_SRV or FAM_BROWSE_TXT
+  * @param k index of the instance in browse_inst, 0 for the PTR query
+  * @param srv index of the server the reply came from
+  * @param m the reply, parsed */
+static void
+browse_recv(u8_t fam, u16_t k, u8_t srv, DNS_MSG *m)
+{
+  BROWSE_QUERY *q = browse_query(fam, k);
+  char name[MAX_NAME_LENGTH];
+  u16_t rcode = m->rcode, n;
+  DNS_RR *pRR;
+  u32_t hash;
+
+  if(q == NULL || q->state != STATE_ASKING || q->deferred)
+    return;
+  if((fam == FAM_BROWSE_PTR) ? strcasecmp(m->qname, browse.service) != 0 :
+     (m->qtype != ((fam == FAM_BROWSE_SRV) ? MESSAGE_T_SRV : MESSAGE_T_TXT) ||
+      !wire_is(m, m->msg + sizeof(DNS_HDR), &browse_inst[k])))
+    return;
+  if(edns_rejected(srv, q->edns, rcode)){
+    q->server = srv;
+    if(rate_take(1))
+      send_browse(fam, k);
+    else
+      rate_defer(&q->deferred);
+    return;
+  }
+  if(rcode != DNS_FLAG2_ERR_NONE && rcode != DNS_FLAG2_ERR_NAME){
+    q->state = STATE_ERROR;
+    browse_step();
+    return;
+  }
+  use_server(srv);
+
+  if(fam == FAM_BROWSE_PTR){
+    hash = static_hash(browse.service, strlen(browse.service), 0);
+    for(n = 0, pRR = m->rrs; rcode == DNS_FLAG2_ERR_NONE && n < m->nrrs; ++n, ++pRR){
+      if(pRR->type == MESSAGE_T_PTR && owner_is(m, pRR, browse.service, hash) &&
+         decode_name(m->msg, m->end, m->msg + pRR->rdata, name, sizeof(name), NULL) != NULL &&
+         name[0] != 0)
+        browse_add(m, pRR, name);
+    }
+  }
+  browse_harvest(m);
+  /* the PTR query is done with any answer, the others need their record */
+  if(q->state == STATE_ASKING)
+    q->state = (fam == FAM_BROWSE_PTR && rcode == DNS_FLAG2_ERR_NONE) ? STATE_DONE : STATE_ERROR;
+  browse_step();
+  /* send the SRV and TXT queries of new instances now */
+  check_table(0);
+}
+
+/** do_browse() is resolv_browse() in the writer context */
+static err_t
+do_browse(struct tcpip_api_call_data *call)
+{
+  RESOLV_CALL *msg = (RESOLV_CALL *)call;
+  static const char *TAG = "resolv_brwse";
+
+  if(browse.active)
+    return ERR_INPROGRESS;
+  memset(&browse, 0, sizeof(browse));
+  memset(browse_inst, 0, sizeof(browse_inst));
+  strcpy(browse.service, msg->name);
+  browse.cb = msg->browse_cb;
+  browse.ptr.state = STATE_NEW;
+  browse.active = 1;
+  ESP_LOGI(TAG, "...browse for                  : %s", browse.service);
+  check_table(0);
+  return ERR_OK;
+}
+#endif
+
+esp_err_t
+resolv_browse(const char *service, browse_cb_fn cb)
+{
+#if RESOLV_BROWSE
+  RESOLV_CALL msg;
+
+  if(service == NULL || service[0] == 0 || strlen(service) >= MAX_NAME_LENGTH || cb == NULL)
+    return ESP_ERR_INVALID_ARG;
+  if(!__atomic_load_n(&initFlag, __ATOMIC_ACQUIRE))
+    return ESP_ERR_INVALID_STATE;
+  msg.name = (char *)service;
+  msg.browse_cb = cb;
+  return (resolv_call(do_browse, &msg) == ERR_OK) ? ESP_OK : ESP_ERR_INVALID_STATE;
+#else
+  return ESP_ERR_NOT_SUPPORTED;
+#endif
+}
+
+u32_t
+resolv_getserver(void)
+{
+  if(!__atomic_load_n(&initFlag, __ATOMIC_ACQUIRE))
+    return 0;
+  return __atomic_load_n(&serverIP.addr, __ATOMIC_RELAXED);
+}
+
+#if RESOLV_PERSIST
+static void
+snap_put32(u8_t *p, u32_t v)
+{
+  p[0] = v >> 24;
+  p[1] = v >> 16;
+  p[2] = v >> 8;
+  p[3] = v;
+}
+
+static u32_t
+snap_get32(const u8_t *p)
+{
+  return ((u32_t)p[0] << 24) | ((u32_t)p[1] << 16) | ((u32_t)p[2] << 8) | p[3];
+}
+
+/** snapshot_build() writes the valid and stale addresses of the dns table
+  * into buf in the snapshot format. Runs in the caller's task.
+  *
+  * @param buf RESOLV_SNAP_MAX bytes
+  * @returns the length of the snapshot */
+static size_t
+snapshot_build(u8_t *buf)
+{
+  DNS_TABLE_ENTRY copy;
+  DNS_FAMILY *pFam;
+  u8_t *p = buf + RESOLV_SNAP_HDR_LEN, *start;
+  u32_t now = resolv_now();
+  u8_t entries = 0, fam, k, keep, len;
+  int i;
+
+  for(i = 0; i < LWIP_RESOLV_ENTRIES; ++i){
+    entry_read(&dns_table[i], &copy);
+    if(copy.state == STATE_UNUSED)
+      continue;
+    start = p;
+    len = strlen(copy.name);
+    *p++ = len;
+    memcpy(p, copy.name, len);
+    p += len;
+    keep = 0;
+    for(fam = 0; fam < SNAP_FAMILIES; ++fam){
+      pFam = &copy.fam[(fam < FAM_COUNT) ? fam : FAM_V4];
+      /* an ASKING family still holds the addresses of its last answer */
+      if(fam >= FAM_COUNT || pFam->count == 0 || pFam->state == STATE_ERROR ||
+         (s32_t)(pFam->stale_until - now) <= 0){
+        *p++ = 0;
+        snap_put32(p, 0);
+        p += 4;
+        continue;
       }
-      else
-      { /* Not compressed name. */
-        pHostname = (char *) parse_name((unsigned char *)pHostname);
+      *p++ = pFam->count;
+      snap_put32(p, pFam->expires - now);
+      p += 4;
+      for(k = 0; k < pFam->count; ++k){
+        if(fam == FAM_V6){
+          memcpy(p, ip_2_ip6(&pFam->addrs[k])->addr, 16);
+          p += 16;
+        }
+        else{
+          memcpy(p, &ip_2_ip4(&pFam->addrs[k])->addr, 4);
+          p += 4;
+        }
+      }
+      keep = 1;
+    }
+    if(keep)
+      ++entries;
+    else
+      p = start;
+  }
+
+  snap_put32(buf, RESOLV_SNAP_MAGIC);
+  buf[4] = RESOLV_SNAP_VERSION;
+  buf[5] = entries;
+  snap_put32(buf + 6, (u32_t)time(NULL));
+  return p - buf;
+}
+
+/** snapshot_load() fills the cleared dns table from a snapshot, in the
+  * writer context. Addresses whose TTL ran out while the device was down are
+  * kept only for serving stale. A snapshot that does not parse is dropped.
+  *
+  * @param buf the snapshot
+  * @param len length of the snapshot
+  * @param age seconds since the snapshot was saved, -1 if not known */
+static void
+snapshot_load(const u8_t *buf, size_t len, s32_t age)
+{
+  static const char *TAG = "resolv init ";
+  const u8_t *p = buf + RESOLV_SNAP_HDR_LEN, *end = buf + len;
+  DNS_TABLE_ENTRY *pEntry;
+  DNS_FAMILY *pFam;
+  u32_t now = resolv_now();
+  s32_t left;
+  u8_t entries, fam, k, count, namelen, alen;
+  int i = 0;
+
+  if(len < RESOLV_SNAP_HDR_LEN || snap_get32(buf) != RESOLV_SNAP_MAGIC ||
+     buf[4] != RESOLV_SNAP_VERSION){
+    ESP_LOGI(TAG, "...no usable dns table snapshot");
+    return;
+  }
+  if(age < 0){
+    /* a power-on reset before SNTP: the TTLs left cannot be trusted */
+    if(RESOLV_SERVE_STALE_S == 0){
+      ESP_LOGI(TAG, "...snapshot skipped, wall clock not set and serve stale off");
+      return;
+    }
+    ESP_LOGI(TAG, "...snapshot age unknown, wall clock not set: names only served stale");
+  }
+  entries = buf[5];
+
+  while(entries-- > 0 && i < LWIP_RESOLV_ENTRIES){
+    if(p >= end || p + 1 + *p > end)
+      break;
+    namelen = *p++;
+    pEntry = &dns_table[i];
+    entry_write_begin(pEntry);
+    clear_entry(pEntry);
+    if(namelen < MAX_NAME_LENGTH){
+      memcpy(pEntry->name, p, namelen);
+      pEntry->name[namelen] = 0;
+    }
+    p += namelen;
+    for(fam = 0; fam < SNAP_FAMILIES; ++fam){
+      alen = (fam == FAM_V6) ? 16 : 4;
+      if(p + 5 > end || p + 5 + p[0] * alen > end){
+        clear_entry(pEntry);
+        entry_write_end(pEntry);
+        return; /* cut short, keep what was loaded */
+      }
+      count = *p++;
+      left = (s32_t)snap_get32(p);
+      p += 4;
+      /* with no trustworthy clock the addresses count as expired just now */
+      left = (age < 0) ? ((left < 0) ? left : 0) : left - age;
+      if(fam >= FAM_COUNT){
+        p += count * alen; /* a family this build does not keep */
+        continue;
+      }
+      pFam = &pEntry->fam[fam];
+      for(k = 0; k < count; ++k, p += alen){
+        if(k >= RESOLV_MAX_ADDRS)
+          continue;
+        if(fam == FAM_V6){
+          memcpy(ip_2_ip6(&pFam->addrs[k])->addr, p, 16);
+          pFam->addrs[k].type = IPADDR_TYPE_V6;
+        }
+        else{
+          memcpy(&ip_2_ip4(&pFam->addrs[k])->addr, p, 4);
+          pFam->addrs[k].type = IPADDR_TYPE_V4;
+        }
+      }
+      if(count == 0 || left < 0 - (s32_t)RESOLV_SERVE_STALE_S || (left <= 0 && RESOLV_SERVE_STALE_S == 0))
+        continue;
+      pFam->count = (count > RESOLV_MAX_ADDRS) ? RESOLV_MAX_ADDRS : count;
+      pFam->expires = now + ((left > 0) ? left : 0);
+      pFam->stale_until = now + left + RESOLV_SERVE_STALE_S;
+      pFam->state = STATE_DONE;
+      pEntry->asked |= 1 << fam;
+    }
+    if(pEntry->name[0] != 0 && pEntry->asked != 0){
+      pEntry->state = STATE_DONE;
+      ++i;
+    }
+    else{
+      clear_entry(pEntry);
+    }
+    entry_write_end(pEntry);
+  }
+  ESP_LOGI(TAG, "...loaded from snapshot        : %d names", i);
+}
+
+/** snapshot_age() gives the seconds since a snapshot was saved. The wall
+  * clock is trusted once it has been set, by SNTP for example, or if the
+  * reset kept the RTC running (deep sleep, software reset).
+  *
+  * @returns the age in seconds or -1 if it is not known */
+static s32_t
+snapshot_age(const u8_t *buf)
+{
+  u32_t saved = snap_get32(buf + 6);
+  u32_t now = (u32_t)time(NULL);
+
+  if(now < saved)
+    return -1;
+  if(now < RESOLV_SANE_TIME && esp_reset_reason() == ESP_RST_POWERON)
+    return -1;
+  return (s32_t)(now - saved);
+}
+#endif /* RESOLV_PERSIST */
+
+esp_err_t
+resolv_save(void)
+{
+#if RESOLV_PERSIST
+  static const char *TAG = "resolv save ";
+  nvs_handle_t handle;
+  esp_err_t err;
+  size_t len;
+  u8_t *buf;
+
+  buf = malloc(RESOLV_SNAP_MAX);
+  if(buf == NULL)
+    return ESP_ERR_NO_MEM;
+  len = snapshot_build(buf);
+
+  err = nvs_open(RESOLV_NVS_NAMESPACE, NVS_READWRITE, &handle);
+  if(err == ESP_OK){
+    err = nvs_set_blob(handle, RESOLV_NVS_KEY, buf, len);
+    if(err == ESP_OK)
+      err = nvs_commit(handle);
+    nvs_close(handle);
+  }
+  ESP_LOGI(TAG, "...saved %d names, %d bytes   : %s", buf[5], (int)len, esp_err_to_name(err));
+  free(buf);
+  return err;
+#else
+  return ESP_ERR_NOT_SUPPORTED;
+#endif
+}
+
+#if RESOLV_CAPTURE
+/** pcap_put32() writes a pcap field, in the byte order of this CPU as pcap does */
+static void
+pcap_put32(u8_t *p, u32_t v)
+{
+  memcpy(p, &v, 4);
+}
+
+/** capture_headers() makes up the IP and UDP headers of a captured message,
+  * between this device and the DNS server.
+  *
+  * @param out where the headers go
+  * @param rec the message
+  * @returns the length of the headers */
+static size_t
+capture_headers(u8_t *out, const CAPTURE_REC *rec)
+{
+  u8_t local[16], peer[16];
+  u8_t *src = (rec->dir == CAPTURE_OUT) ? local : peer;
+  u8_t *dst = (rec->dir == CAPTURE_OUT) ? peer : local;
+  u16_t port = (resolv_pcb != NULL) ? resolv_pcb->local_port : 0;
+  u16_t ulen = 8 + rec->len;
+  u32_t sum = 0;
+  u8_t *udp, k;
+
+  memset(local, 0, sizeof(local));
+  if(IP_IS_V6(&rec->peer)){
+    memcpy(peer, ip_2_ip6(&rec->peer)->addr, 16);
+    memset(out, 0, 40);
+    out[0] = 0x60;
+    out[4] = ulen >> 8;
+    out[5] = ulen & 0xff;
+    out[6] = 17; /* UDP */
+    out[7] = 64;
+    memcpy(out + 8, src, 16);
+    memcpy(out + 24, dst, 16);
+    udp = out + 40;
+  }
+  else{
+    memcpy(peer, &ip_2_ip4(&rec->peer)->addr, 4);
+    if(netif_default != NULL)
+      memcpy(local, &ip_2_ip4(&netif_default->ip_addr)->addr, 4);
+    memset(out, 0, 20);
+    out[0] = 0x45;
+    out[2] = (20 + ulen) >> 8;
+    out[3] = (20 + ulen) & 0xff;
+    out[8] = 64;
+    out[9] = 17; /* UDP */
+    memcpy(out + 12, src, 4);
+    memcpy(out + 16, dst, 4);
+    for(k = 0; k < 20; k += 2)
+      sum += GET16(out + k);
+    while(sum >> 16)
+      sum = (sum & 0xffff) + (sum >> 16);
+    out[10] = ~sum >> 8;
+    out[11] = ~sum & 0xff;
+    udp = out + 20;
+  }
+  /* the UDP checksum is left out, a capture of a TCP query looks like UDP */
+  udp[0] = (rec->dir == CAPTURE_OUT) ? port >> 8 : rec->port >> 8;
+  udp[1] = (rec->dir == CAPTURE_OUT) ? port & 0xff : rec->port & 0xff;
+  udp[2] = (rec->dir == CAPTURE_OUT) ? rec->port >> 8 : port >> 8;
+  udp[3] = (rec->dir == CAPTURE_OUT) ? rec->port & 0xff : port & 0xff;
+  udp[4] = ulen >> 8;
+  udp[5] = ulen & 0xff;
+  udp[6] = 0;
+  udp[7] = 0;
+  return (udp + 8) - out;
+}
+
+/** do_capture() is resolv_capture() in the writer context */
+static err_t
+do_capture(struct tcpip_api_call_data *call)
+{
+  RESOLV_CALL *msg = (RESOLV_CALL *)call;
+
+  if(msg->flush){
+    capture_head = capture_tail = capture_used = 0;
+  }
+  capture_on = msg->flush;
+  return ERR_OK;
+}
+
+/** do_capture_export() is resolv_capture_export() in the writer context. The
+  * size of the pcap data is left in msg->anslen. */
+static err_t
+do_capture_export(struct tcpip_api_call_data *call)
+{
+  RESOLV_CALL *msg = (RESOLV_CALL *)call;
+  u8_t *out = msg->answer;
+  size_t room = (size_t)msg->anslen;
+  size_t pos = capture_tail, left = capture_used, total = PCAP_HDR_LEN, reclen, hlen;
+  u16_t version[2] = {2, 4};
+  u8_t hdr[48];
+  CAPTURE_REC rec;
+
+  if(out != NULL){
+    if(room < PCAP_HDR_LEN){
+      msg->anslen = 0;
+      return ERR_OK;
+    }
+    pcap_put32(out, PCAP_MAGIC);
+    memcpy(out + 4, version, sizeof(version));
+    pcap_put32(out + 8, 0);
+    pcap_put32(out + 12, 0);
+    pcap_put32(out + 16, 0xffff);
+    pcap_put32(out + 20, PCAP_LINKTYPE_RAW);
+  }
+  /* oldest first, as many whole messages as fit */
+  while(left > 0){
+    capture_copy(pos, &rec, sizeof(rec), 1);
+    hlen = capture_headers(hdr, &rec);
+    reclen = PCAP_REC_LEN + hlen + rec.len;
+    if(out != NULL){
+      if(total + reclen > room)
+        break;
+      pcap_put32(out + total, rec.sec);
+      pcap_put32(out + total + 4, rec.usec);
+      pcap_put32(out + total + 8, hlen + rec.len);
+      pcap_put32(out + total + 12, hlen + rec.len);
+      memcpy(out + total + PCAP_REC_LEN, hdr, hlen);
+      capture_copy((pos + sizeof(rec)) % RESOLV_CAPTURE_SIZE, out + total + PCAP_REC_LEN + hlen, rec.len, 1);
+    }
+    total += reclen;
+    pos = (pos + sizeof(rec) + rec.len) % RESOLV_CAPTURE_SIZE;
+    left -= sizeof(rec) + rec.len;
+  }
+  msg->anslen = (int)total;
+  return ERR_OK;
+}
+
+/** replay_get32() reads a pcap field of the capture being replayed */
+static u32_t
+replay_get32(const u8_t *p)
+{
+  u32_t v;
+
+  memcpy(&v, p, 4);
+  if(replay_swap)
+    v = (v >> 24) | ((v >> 8) & 0xff00) | ((v << 8) & 0xff0000) | (v << 24);
+  return v;
+}
+
+/** replay_packet() hands a reply of the capture to resolv_recv(), as if it had
+  * just come in. Queries in the capture are passed over: the resolver sends
+  * its own, which go nowhere while the replay runs.
+  *
+  * @param pkt the packet, from its IP header on
+  * @param len length of the packet */
+static void
+replay_packet(const u8_t *pkt, u32_t len)
+{
+  ip_addr_t addr;
+  struct pbuf *p;
+  u32_t hlen;
+  u16_t port;
+
+  memset(&addr, 0, sizeof(addr));
+  if(len >= 20 && (pkt[0] >> 4) == 4 && pkt[9] == 17){
+    hlen = (pkt[0] & 0x0f) * 4;
+    memcpy(&ip_2_ip4(&addr)->addr, pkt + 12, 4);
+    addr.type = IPADDR_TYPE_V4;
+  }
+  else if(len >= 40 && (pkt[0] >> 4) == 6 && pkt[6] == 17){
+    hlen = 40;
+    memcpy(ip_2_ip6(&addr)->addr, pkt + 8, 16);
+    addr.type = IPADDR_TYPE_V6;
+  }
+  else{
+    return;
+  }
+  if(len < hlen + 8 + sizeof(DNS_HDR))
+    return;
+  port = GET16(pkt + hlen);
+  if(port != DNS_SERVER_PORT && port != MDNS_PORT)
+    return; /* not a reply from a DNS server or mDNS responder */
+  /* a capture taken on another network replays against the servers of this one */
+  if(port == DNS_SERVER_PORT && find_server(&addr) < 0)
+    addr = servers[cur_server].addr;
+  len -= hlen + 8;
+  p = pbuf_alloc(PBUF_TRANSPORT, len, PBUF_RAM);
+  if(p == NULL)
+    return;
+  pbuf_take(p, pkt + hlen + 8, len);
+  resolv_recv(NULL, NULL, p, &addr, port);
+}
+
+/** replay_next() delivers the replies of the capture whose time has come,
+  * then waits for the next one with the timing of the capture. */
+static void
+replay_next(void *arg)
+{
+  static const char *TAG = "resolv replay";
+  u32_t sec, usec, incl, due, elapsed;
+  u8_t gen = replay_gen;
+
+  while(replay_buf != NULL && gen == replay_gen){
+    if(replay_off + PCAP_REC_LEN > replay_len ||
+       replay_off + PCAP_REC_LEN + replay_get32(replay_buf + replay_off + 8) > replay_len){
+      ESP_LOGI(TAG, "...replay done");
+      replay_buf = NULL;
+      return;
+    }
+    sec = replay_get32(replay_buf + replay_off);
+    usec = replay_get32(replay_buf + replay_off + 4);
+    incl = replay_get32(replay_buf + replay_off + 8);
+    due = sec * 1000 + usec / 1000 - replay_t0;
+    elapsed = (u32_t)((resolv_time_us() - replay_start) / 1000);
+    if((s32_t)(due - elapsed) > 0){
+      resolv_timeout(due - elapsed, replay_next, NULL);
+      return;
+    }
+    replay_off += PCAP_REC_LEN + incl;
+    replay_packet(replay_buf + replay_off - incl, incl);
+  }
+}
+
+/** do_replay() is resolv_replay() in the writer context */
+static err_t
+do_replay(struct tcpip_api_call_data *call)
+{
+  RESOLV_CALL *msg = (RESOLV_CALL *)call;
+  const u8_t *buf = msg->snap;
+
+  resolv_untimeout(replay_next, NULL);
+  replay_buf = NULL;
+  replay_gen++;
+  if(buf == NULL)
+    return ERR_OK; /* stop */
+
+  if(msg->snap_len < PCAP_HDR_LEN + PCAP_REC_LEN)
+    return ERR_ARG;
+  /* the capture may come from a CPU of the other byte order */
+  replay_swap = 0;
+  if(replay_get32(buf) != PCAP_MAGIC)
+    replay_swap = 1;
+  if(replay_get32(buf) != PCAP_MAGIC || replay_get32(buf + 20) != PCAP_LINKTYPE_RAW)
+    return ERR_ARG;
+  replay_buf = buf;
+  replay_len = msg->snap_len;
+  replay_off = PCAP_HDR_LEN;
+  replay_t0 = replay_get32(buf + replay_off) * 1000 + replay_get32(buf + replay_off + 4) / 1000;
+  replay_start = resolv_time_us();
+  replay_next(NULL);
+  return ERR_OK;
+}
+#endif
+
+esp_err_t
+resolv_capture(u8_t on)
+{
+#if RESOLV_CAPTURE
+  RESOLV_CALL msg;
+
+  msg.flush = (on != 0);
+  resolv_call(do_capture, &msg);
+  return ESP_OK;
+#else
+  return ESP_ERR_NOT_SUPPORTED;
+#endif
+}
+
+int
+resolv_capture_export(u8_t *buf, size_t len)
+{
+#if RESOLV_CAPTURE
+  RESOLV_CALL msg;
+
+  msg.answer = buf;
+  msg.anslen = (len > INT32_MAX) ? INT32_MAX : (int)len;
+  resolv_call(do_capture_export, &msg);
+  return msg.anslen;
+#else
+  return 0;
+#endif
+}
+
+esp_err_t
+resolv_replay(const u8_t *pcap, size_t len)
+{
+#if RESOLV_CAPTURE
+  RESOLV_CALL msg;
+
+  if(!__atomic_load_n(&initFlag, __ATOMIC_ACQUIRE))
+    return ESP_ERR_INVALID_STATE;
+  msg.snap = (u8_t *)pcap;
+  msg.snap_len = len;
+  return (resolv_call(do_replay, &msg) == ERR_OK) ? ESP_OK : ESP_ERR_INVALID_ARG;
+#else
+  return ESP_ERR_NOT_SUPPORTED;
+#endif
+}
+
+#if RESOLV_SIM
+/** do_sim_hooks() is resolv_sim_hooks() in the writer context */
+static err_t
+do_sim_hooks(struct tcpip_api_call_data *call)
+{
+  RESOLV_CALL *msg = (RESOLV_CALL *)call;
+  SIM_TIMER pending[RESOLV_SIM_TIMERS];
+  int64_t now = resolv_time_us();
+  u8_t k;
+
+  /* the timeouts keep what is left of their delay on the new clock */
+  memcpy(pending, sim_timers, sizeof(pending));
+  memset(sim_timers, 0, sizeof(sim_timers));
+  if(msg->sim_hooks != NULL)
+    sim_hooks = *msg->sim_hooks;
+  else
+    memset(&sim_hooks, 0, sizeof(sim_hooks));
+  for(k = 0; k < RESOLV_SIM_TIMERS; ++k){
+    if(pending[k].handler != NULL)
+      resolv_timeout(pending[k].due > now ? (u32_t)((pending[k].due - now + 999) / 1000) : 0,
+                     pending[k].handler, pending[k].arg);
+  }
+  /* held queries are due on the old clock */
+  memset(sim_held, 0, sizeof(sim_held));
+  return ERR_OK;
+}
+
+/** do_sim_faults() is resolv_sim_faults() in the writer context */
+static err_t
+do_sim_faults(struct tcpip_api_call_data *call)
+{
+  RESOLV_CALL *msg = (RESOLV_CALL *)call;
+
+  if(msg->sim_faults != NULL)
+    sim_faults = *msg->sim_faults;
+  else
+    memset(&sim_faults, 0, sizeof(sim_faults));
+  sim_rand = sim_faults.seed ? sim_faults.seed : 1; /* xorshift is stuck on 0 */
+  if(sim_faults.delay == 0)
+    sim_release();
+  return ERR_OK;
+}
+
+/** do_sim_deliver() is resolv_sim_deliver() in the writer context */
+static err_t
+do_sim_deliver(struct tcpip_api_call_data *call)
+{
+  RESOLV_CALL *msg = (RESOLV_CALL *)call;
+
+  sim_release();
+  sim_timers_run();
+  resolv_recv(NULL, resolv_pcb, msg->p, msg->server, msg->port);
+  return ERR_OK;
+}
+
+/** do_sim_run() is resolv_sim_run() in the writer context */
+static err_t
+do_sim_run(struct tcpip_api_call_data *call)
+{
+  RESOLV_CALL *msg = (RESOLV_CALL *)call;
+  int64_t next;
+  u8_t k;
+
+  sim_release();
+  next = sim_timers_run();
+  for(k = 0; k < RESOLV_SIM_HOLD; ++k){
+    if(sim_held[k].used && (next < 0 || sim_held[k].due < next))
+      next = sim_held[k].due;
+  }
+  msg->sim_next = next;
+  return ERR_OK;
+}
+#endif
+
+esp_err_t
+resolv_sim_hooks(const RESOLV_SIM_HOOKS *hooks)
+{
+#if RESOLV_SIM
+  RESOLV_CALL msg;
+
+  msg.sim_hooks = hooks;
+  resolv_call(do_sim_hooks, &msg);
+  return ESP_OK;
+#else
+  return ESP_ERR_NOT_SUPPORTED;
+#endif
+}
+
+esp_err_t
+resolv_sim_faults(const RESOLV_SIM_FAULTS *faults)
+{
+#if RESOLV_SIM
+  RESOLV_CALL msg;
+
+  if(faults != NULL && (faults->loss > 100 || faults->dup > 100 || faults->delay > 100))
+    return ESP_ERR_INVALID_ARG;
+  msg.sim_faults = faults;
+  resolv_call(do_sim_faults, &msg);
+  return ESP_OK;
+#else
+  return ESP_ERR_NOT_SUPPORTED;
+#endif
+}
+
+esp_err_t
+resolv_sim_run(int64_t *next_us)
+{
+#if RESOLV_SIM
+  RESOLV_CALL msg;
+
+  if(!__atomic_load_n(&initFlag, __ATOMIC_ACQUIRE))
+    return ESP_ERR_INVALID_STATE;
+  resolv_call(do_sim_run, &msg);
+  if(next_us != NULL)
+    *next_us = msg.sim_next;
+  return ESP_OK;
+#else
+  return ESP_ERR_NOT_SUPPORTED;
+#endif
+}
+
+esp_err_t
+resolv_sim_deliver(const ip_addr_t *from, u16_t port, const u8_t *data, u16_t len)
+{
+#if RESOLV_SIM
+  RESOLV_CALL msg;
+  struct pbuf *p;
+
+  if(from == NULL || data == NULL || len == 0)
+    return ESP_ERR_INVALID_ARG;
+  if(!__atomic_load_n(&initFlag, __ATOMIC_ACQUIRE))
+    return ESP_ERR_INVALID_STATE;
+  p = pbuf_alloc(PBUF_TRANSPORT, len, PBUF_RAM);
+  if(p == NULL)
+    return ESP_ERR_NO_MEM;
+  pbuf_take(p, data, len);
+  msg.p = p;
+  msg.server = (ip_addr_t *)from;
+  msg.port = port;
+  resolv_call(do_sim_deliver, &msg);
+  return ESP_OK;
+#else
+  return ESP_ERR_NOT_SUPPORTED;
+#endif
+}
+
+#if RESOLV_BENCH
+/** @brief A reply of the resolv_bench() corpus */
+typedef struct s_bench_msg {
+  u16_t len;
+  u16_t nanswers;
+  u16_t answers; /**< offset of the answer section */
+  u8_t buf[BENCH_MSG_LEN];
+} BENCH_MSG;
+
+/* Only used by resolv_bench(), in the task that calls it. The kernels work on
+   their own reply and CNAME chain, never on those of resolv_recv() */
+static BENCH_MSG bench_msgs[BENCH_MSGS];
+static char bench_names[3][MAX_NAME_LENGTH]; /**< names for encode_name() */
+static char bench_out[MAX_NAME_LENGTH + 1];
+static DNS_MSG bench_rx;
+static char bench_chain[RESOLV_CNAME_DEPTH + 1][MAX_NAME_LENGTH];
+static volatile u32_t bench_sink; /**< keeps results the compiler would drop */
+
+/** bench_label_name() makes the longest name that fits in the dns table out
+  * of labels of one length */
+static void
+bench_label_name(char *out, u8_t label)
+{
+  size_t o = 0;
+  u8_t n;
+
+  while(o + label + (o > 0) < MAX_NAME_LENGTH){
+    if(o > 0)
+      out[o++] = '.';
+    for(n = 0; n < label; ++n, ++o)
+      out[o] = 'a' + o % 26;
+  }
+  out[o] = 0;
+}
+
+/** bench_put_rr() appends a record of class IN and TTL 300 whose owner is a
+  * compression pointer to off, or the encoded name if name is not NULL */
+static void
+bench_put_rr(BENCH_MSG *m, u16_t off, const char *name, u16_t type, u16_t rdlen)
+{
+  u8_t *p = m->buf + m->len;
+
+  if(name != NULL){
+    p += encode_name(name, (char *)p);
+    *p++ = 0;
+  }
+  else{
+    *p++ = 0xc0 | (off >> 8);
+    *p++ = off & 0xff;
+  }
+  *p++ = type >> 8; *p++ = type & 0xff;
+  *p++ = 0; *p++ = MESSAGE_C_IN;
+  *p++ = 0; *p++ = 0; *p++ = 300 >> 8; *p++ = 300 & 0xff;
+  *p++ = rdlen >> 8; *p++ = rdlen & 0xff;
+  m->len = p - m->buf;
+  m->buf[7] = ++m->nanswers;
+}
+
+/** bench_start() writes the header and question of a reply */
+static void
+bench_start(BENCH_MSG *m, const char *qname)
+{
+  memset(m, 0, sizeof(BENCH_MSG));
+  m->buf[2] = 0x81;
+  m->buf[3] = 0x80;
+  m->buf[5] = 1;
+  m->len = sizeof(DNS_HDR);
+  m->len += encode_name(qname, (char *)m->buf + m->len);
+  m->buf[m->len++] = 0;
+  m->buf[m->len++] = 0; m->buf[m->len++] = MESSAGE_T_A;
+  m->buf[m->len++] = 0; m->buf[m->len++] = MESSAGE_C_IN;
+  m->answers = m->len;
+}
+
+/** bench_corpus() builds the replies and names the kernels run over: one A
+  * record, a full 512 byte reply of A records, a CNAME chain whose names are
+  * each one label and a pointer to the one before, and long uncompressed
+  * owner names */
+static void
+bench_corpus(void)
+{
+  static const u8_t addr[4] = {192, 0, 2, 1};
+  BENCH_MSG *m;
+  u16_t prev, here;
+  size_t namelen;
+  u8_t k;
+
+  strcpy(bench_names[0], "www.example.com");
+  bench_label_name(bench_names[1], 1);
+  bench_label_name(bench_names[2], MAX_NAME_LENGTH > 64 ? 63 : MAX_NAME_LENGTH / 2 - 1);
+
+  m = &bench_msgs[0];
+  bench_start(m, bench_names[0]);
+  bench_put_rr(m, sizeof(DNS_HDR), NULL, MESSAGE_T_A, 4);
+  memcpy(m->buf + m->len, addr, 4);
+  m->len += 4;
+
+  m = &bench_msgs[1];
+  bench_start(m, bench_names[0]);
+  while(m->len + 16 <= BENCH_MSG_LEN){
+    bench_put_rr(m, sizeof(DNS_HDR), NULL, MESSAGE_T_A, 4);
+    memcpy(m->buf + m->len, addr, 4);
+    m->buf[m->len + 3] = m->nanswers;
+    m->len += 4;
+  }
+
+  m = &bench_msgs[2];
+  bench_start(m, bench_names[0]);
+  prev = sizeof(DNS_HDR);
+  namelen = strlen(bench_names[0]);
+  for(k = 0; k < RESOLV_CNAME_DEPTH && namelen + 3 < MAX_NAME_LENGTH; ++k, namelen += 3){
+    bench_put_rr(m, prev, NULL, MESSAGE_T_CNAME, 5);
+    here = m->len;
+    m->buf[m->len++] = 2;
+    m->buf[m->len++] = 'c';
+    m->buf[m->len++] = '0' + k % 10;
+    m->buf[m->len++] = 0xc0 | (prev >> 8);
+    m->buf[m->len++] = prev & 0xff;
+    prev = here;
+  }
+  bench_put_rr(m, prev, NULL, MESSAGE_T_A, 4);
+  memcpy(m->buf + m->len, addr, 4);
+  m->len += 4;
+
+  m = &bench_msgs[3];
+  bench_start(m, bench_names[2]);
+  while(m->len + strlen(bench_names[2]) + 2 + 14 <= BENCH_MSG_LEN && m->nanswers < 8){
+    bench_put_rr(m, 0, bench_names[2], MESSAGE_T_A, 4);
+    memcpy(m->buf + m->len, addr, 4);
+    m->len += 4;
+  }
+}
+
+/** bench_encode() runs encode_name() over the names */
+static void
+bench_encode(u32_t *bytes, u32_t *records)
+{
+  u8_t k;
+
+  for(k = 0; k < 3; ++k){
+    bench_sink += encode_name(bench_names[k], bench_out);
+    *bytes += strlen(bench_names[k]);
+    ++*records;
+  }
+}
+
+/** bench_decode() decodes and hashes the owner of every record with
+  * decode_name(), following the compression pointers */
+static void
+bench_decode(u32_t *bytes, u32_t *records)
+{
+  BENCH_MSG *m;
+  unsigned char *ptr, *end;
+  u32_t hash;
+  u16_t n;
+  u8_t k;
+
+  for(k = 0; k < BENCH_MSGS; ++k){
+    m = &bench_msgs[k];
+    end = m->buf + m->len;
+    for(n = 0, ptr = m->buf + m->answers; n < m->nanswers && ptr != NULL; ++n){
+      ptr = decode_name(m->buf, end, ptr, bench_out, sizeof(bench_out), &hash);
+      if(ptr != NULL){
+        bench_sink += hash;
+        *bytes += strlen(bench_out);
+        ptr += 10 + GET16(ptr + 8);
       }
+      ++*records;
+    }
+  }
+}
 
-      ans = (DNS_ANSWER *)pHostname;
-      /* printf("Answer: type %x, class %x, ttl %x, length %x\n",
-         htons(ans->type), htons(ans->class), (htons(ans->ttl[0])
-           << 16) | htons(ans->ttl[1]), htons(ans->len)); */
+/** bench_parse() parses the replies with parse_msg() */
+static void
+bench_parse(u32_t *bytes, u32_t *records)
+{
+  BENCH_MSG *m;
+  u8_t k;
 
-      /* Check for IP address type and Internet class. Others are
-       discarded.*/
+  for(k = 0; k < BENCH_MSGS; ++k){
+    m = &bench_msgs[k];
+    bench_sink += parse_msg(m->buf, m->len, &bench_rx) + bench_rx.nrrs;
+    *bytes += m->len;
+    *records += 1 + m->nanswers;
+  }
+}
 
-      if((htons(ans->type) == 1) && (htons(ans->class) == 1) && (htons(ans->len) == 4) )
-      { /* TODO: we should really check that this IP address is the one we want. */
-        memcpy(&pEntry->ipaddr.addr, &ans->ipchars[0], 4);
-        ESP_LOGI(TAG, "...Answer IP using memcpy             : "IPSTR"\n", IP2STR(&pEntry->ipaddr));
+/** bench_walk() parses the replies and runs the answer walk of
+  * resolv_recv() over them, without caching the CNAME links */
+static void
+bench_walk(u32_t *bytes, u32_t *records)
+{
+  DNS_FAMILY fam;
+  ANSWER_WALK walk;
+  BENCH_MSG *m;
+  u8_t k;
 
-        // call specified callback function if provided
-        if (pEntry->found)
-          (*pEntry->found)(pEntry->name, &pEntry->ipaddr);
-        return;
-      }
+  for(k = 0; k < BENCH_MSGS; ++k){
+    m = &bench_msgs[k];
+    fam.count = 0;
+    parse_msg(m->buf, m->len, &bench_rx);
+    strcpy(bench_chain[0], bench_rx.qname);
+    walk_answers(&bench_rx, FAM_V4, &fam, 0, &walk, bench_chain);
+    bench_sink += fam.count + walk.depth;
+    *bytes += m->len;
+    *records += 1 + m->nanswers;
+  }
+}
+#endif
+
+esp_err_t
+resolv_bench(void)
+{
+#if RESOLV_BENCH
+  static const char *TAG = "resolv_bench";
+  static const struct {
+    const char *name;
+    void (*fn)(u32_t *bytes, u32_t *records);
+  } kernels[] = {
+    {"encode_name", bench_encode},
+    {"decode_name", bench_decode},
+    {"parse_msg", bench_parse},
+    {"parse+walk", bench_walk},
+  };
+  u32_t best, t, bytes = 0, records = 0;
+  u8_t k, run;
+
+  bench_corpus();
+  for(k = 0; k < LWIP_ARRAYSIZE(kernels); ++k){
+    best = 0xffffffff;
+    for(run = 0; run < RESOLV_BENCH_RUNS; ++run){
+      bytes = records = 0;
+      t = xthal_get_ccount();
+      kernels[k].fn(&bytes, &records);
+      t = xthal_get_ccount() - t;
+      if(t < best)
+        best = t;
+    }
+    ESP_LOGI(TAG, "...%-14s %5u bytes %3u records %4u.%02u cycles/byte %6u cycles/record",
+      kernels[k].name, (unsigned)bytes, (unsigned)records,
+      (unsigned)(best / bytes), (unsigned)(best * 100 / bytes % 100), (unsigned)(best / records));
+  }
+  return ESP_OK;
+#else
+  return ESP_ERR_NOT_SUPPORTED;
+#endif
+}
+
+#if RESOLV_STRESS
+/* resolv_stress() changes stress_entry in the writer context only, as the
+   dns table is changed, and its reader tasks copy it with entry_read() */
+static DNS_TABLE_ENTRY stress_entry;
+static u8_t stress_value; /**< only used in the writer context */
+static u8_t stress_stop; /**< set to 1 to end the reader tasks */
+static u32_t stress_reads[RESOLV_STRESS_READERS];
+static u32_t stress_torn[RESOLV_STRESS_READERS]; /**< copies mixing two changes */
+static SemaphoreHandle_t stress_done; /**< given by each reader task as it ends */
+
+/** do_stress_write() changes stress_entry RESOLV_STRESS_WRITES times in the
+  * writer context, each time setting every byte after seq to one new value,
+  * so that a copy mixing two changes shows */
+static err_t
+do_stress_write(struct tcpip_api_call_data *call)
+{
+  u8_t k;
+
+  for(k = 0; k < RESOLV_STRESS_WRITES; ++k){
+    entry_write_begin(&stress_entry);
+    memset((u8_t *)&stress_entry + offsetof(DNS_TABLE_ENTRY, state), ++stress_value,
+           sizeof(DNS_TABLE_ENTRY) - offsetof(DNS_TABLE_ENTRY, state));
+    entry_write_end(&stress_entry);
+  }
+  return ERR_OK;
+}
+
+/** stress_reader() copies stress_entry until stress_stop is set and counts
+  * the copies whose bytes after seq are not all the same.
+  *
+  * @param arg the index of the reader */
+static void
+stress_reader(void *arg)
+{
+  u8_t r = (u8_t)(mem_ptr_t)arg;
+  DNS_TABLE_ENTRY copy;
+  const u8_t *b = (const u8_t *)&copy + offsetof(DNS_TABLE_ENTRY, state);
+  size_t i, n = sizeof(DNS_TABLE_ENTRY) - offsetof(DNS_TABLE_ENTRY, state);
+
+  while(!__atomic_load_n(&stress_stop, __ATOMIC_RELAXED)){
+    entry_read(&stress_entry, &copy);
+    for(i = 1; i < n && b[i] == b[0]; ++i);
+    if(i < n)
+      ++stress_torn[r];
+    /* let the idle task of the core run now and then */
+    if((++stress_reads[r] & 0xfff) == 0)
+      vTaskDelay(1);
+  }
+  xSemaphoreGive(stress_done);
+  vTaskDelete(NULL);
+}
+#endif
+
+esp_err_t
+resolv_stress(u32_t ms)
+{
+#if RESOLV_STRESS
+  static const char *TAG = "resolv_strss";
+  RESOLV_CALL msg;
+  TickType_t start;
+  u32_t writes = 0, reads = 0, torn = 0;
+  u8_t k, started;
+
+  if(writer_task == NULL || xTaskGetCurrentTaskHandle() == writer_task)
+    return ESP_ERR_INVALID_STATE;
+  stress_done = xSemaphoreCreateCounting(RESOLV_STRESS_READERS, 0);
+  if(stress_done == NULL)
+    return ESP_ERR_NO_MEM;
+  memset(stress_reads, 0, sizeof(stress_reads));
+  memset(stress_torn, 0, sizeof(stress_torn));
+  __atomic_store_n(&stress_stop, 0, __ATOMIC_RELAXED);
+
+  for(started = 0; started < RESOLV_STRESS_READERS; ++started){
+    if(xTaskCreatePinnedToCore(stress_reader, "resolv_strss", RESOLV_STRESS_STACK,
+                               (void *)(mem_ptr_t)started, uxTaskPriorityGet(NULL), NULL,
+                               started % portNUM_PROCESSORS) != pdPASS)
+      break;
+  }
+  start = xTaskGetTickCount();
+  while(started == RESOLV_STRESS_READERS && xTaskGetTickCount() - start < pdMS_TO_TICKS(ms)){
+    resolv_call(do_stress_write, &msg);
+    writes += RESOLV_STRESS_WRITES;
+  }
+  __atomic_store_n(&stress_stop, 1, __ATOMIC_RELAXED);
+  for(k = 0; k < started; ++k)
+    xSemaphoreTake(stress_done, portMAX_DELAY);
+  vSemaphoreDelete(stress_done);
+  stress_done = NULL;
+  if(started < RESOLV_STRESS_READERS){
+    ESP_LOGI(TAG, "...could not start the reader tasks");
+    return ESP_ERR_NO_MEM;
+  }
+
+  for(k = 0; k < RESOLV_STRESS_READERS; ++k){
+    reads += stress_reads[k];
+    torn += stress_torn[k];
+  }
+  ESP_LOGI(TAG, "...%u writes, %u reads by %d tasks on %d cores, %u torn copies",
+    (unsigned)writes, (unsigned)reads, RESOLV_STRESS_READERS, portNUM_PROCESSORS, (unsigned)torn);
+  return (torn == 0) ? ESP_OK : ESP_FAIL;
+#else
+  return ESP_ERR_NOT_SUPPORTED;
+#endif
+}
+
+#if RESOLV_FORWARD
+/** forward_send() sends the reply to a query of a client of the forwarder.
+  * The question is the one the client asked, in its case. The answers are the
+  * addresses of a family, with the time they have left to live; a family
+  * that is not done adds none.
+  *
+  * @param c the query of the client
+  * @param pFam the family to answer with, or NULL for none
+  * @param rcode the response code */
+static void
+forward_send(const FWD_CLIENT *c, const DNS_FAMILY *pFam, u8_t rcode)
+{
+  u32_t buf[(sizeof(DNS_HDR)+MAX_NAME_LENGTH+5+RESOLV_MAX_ADDRS*(12+16)+3) / 4]; /* u32_t keeps hdr aligned */
+  DNS_HDR *hdr = (DNS_HDR *)buf;
+  u8_t *ptr;
+  u16_t type, rdlen, n = 0;
+  u32_t ttl;
+  struct pbuf *p;
+  u8_t k;
+
+  memset(hdr, 0, sizeof(DNS_HDR));
+  hdr->id = htons(c->id);
+  hdr->flags1 = DNS_FLAG1_RESPONSE | c->rd;
+  hdr->flags2 = DNS_FLAG2_RA | rcode;
+  hdr->numquestions = htons(1);
+  ptr = (u8_t *)hdr + sizeof(DNS_HDR);
+  ptr += encode_name(c->qname, (char *)ptr);
+  *ptr++ = 0;
+  *ptr++ = c->qtype >> 8; *ptr++ = c->qtype & 0xff;
+  *ptr++ = 0; *ptr++ = MESSAGE_C_IN;
+
+  if(pFam != NULL && pFam->state == STATE_DONE && rcode == DNS_FLAG2_ERR_NONE){
+    type = (c->fam == FAM_V6) ? MESSAGE_T_AAAA : MESSAGE_T_A;
+    rdlen = (c->fam == FAM_V6) ? 16 : 4;
+    ttl = family_ttl(pFam);
+    for(k = 0; k < pFam->count; ++k, ++n){
+      /* the owner is the question, right after the header */
+      *ptr++ = 0xc0; *ptr++ = sizeof(DNS_HDR);
+      *ptr++ = type >> 8; *ptr++ = type & 0xff;
+      *ptr++ = 0; *ptr++ = MESSAGE_C_IN;
+      *ptr++ = ttl >> 24; *ptr++ = (ttl >> 16) & 0xff; *ptr++ = (ttl >> 8) & 0xff; *ptr++ = ttl & 0xff;
+      *ptr++ = 0; *ptr++ = rdlen;
+      if(c->fam == FAM_V6)
+        memcpy(ptr, &pFam->addrs[k].u_addr.ip6.addr, 16);
       else
-      {
-        pHostname = pHostname + 10 + htons(ans->len);
-      }
-      --nanswers;
+        memcpy(ptr, &pFam->addrs[k].u_addr.ip4.addr, 4);
+      ptr += rdlen;
+    }
+  }
+  hdr->numanswers = htons(n);
+
+  p = pbuf_alloc(PBUF_TRANSPORT, ptr - (u8_t *)hdr, PBUF_RAM);
+  if(p == NULL)
+    return;
+  pbuf_take(p, hdr, ptr - (u8_t *)hdr);
+  udp_sendto(fwd_pcb, p, &c->addr, c->port);
+  pbuf_free(p);
+}
+
+/** forward_rcode() gives the response code a client gets for a finished
+  * family: no error with or without addresses, the name does not exist, or
+  * the server failed for a timeout or any other error */
+static u8_t
+forward_rcode(const DNS_FAMILY *pFam)
+{
+  if(pFam->state == STATE_DONE || pFam->err == DNS_FLAG2_ERR_NONE)
+    return DNS_FLAG2_ERR_NONE;
+  return (pFam->err == DNS_FLAG2_ERR_NAME) ? DNS_FLAG2_ERR_NAME : DNS_FLAG2_ERR_SERVER;
+}
+
+/** forward_done() replies to the clients waiting on an entry whose family
+  * is no longer asking. Called by update_entry().
+  *
+  * @param i index of the entry in dns_table */
+static void
+forward_done(u16_t i)
+{
+  DNS_TABLE_ENTRY *pEntry = &dns_table[i];
+  DNS_FAMILY *pFam;
+  FWD_CLIENT *c;
+  u8_t k;
+
+  for(k = 0, c = fwd_clients; k < RESOLV_FORWARD_CLIENTS; ++k, ++c){
+    if(!c->used || c->entry != i)
+      continue;
+    pFam = &pEntry->fam[c->fam];
+    if(strcasecmp(c->qname, pEntry->name) != 0){
+      /* the entry went to another name */
+      c->used = 0;
+      forward_send(c, NULL, DNS_FLAG2_ERR_SERVER);
+    }
+    else if(pFam->state != STATE_ASKING){
+      c->used = 0;
+      forward_send(c, pFam, forward_rcode(pFam));
     }
   }
 }
-/*---------------------------------------------------------------------------*
- *
- * Enter a request to get information for a hostname into the dns table
- *
- *---------------------------------------------------------------------------*/
 
-void resolv_query(char *name, user_cb_fn sti_cb_ptr){
+/** forward_recv() takes a query from a client of the forwarder. An A or AAAA
+  * query is answered from the static hosts or the dns table when they hold a
+  * valid answer, positive or negative. Otherwise the name is looked up
+  * without a callback, which joins a lookup of the name already in flight,
+  * and forward_done() replies when its family finishes. Other queries are
+  * refused. */
+static void
+forward_recv(void *arg, struct udp_pcb *pcb, struct pbuf *p, const ip_addr_t *addr, u16_t port)
+{
+  static const char *TAG = "resolv_fwd  ";
+  static u8_t buf[FWD_QUERY_LEN]; /* only used in the writer context */
+  DNS_HDR *hdr = (DNS_HDR *)buf;
+  char name[MAX_NAME_LENGTH];
+  DNS_TABLE_ENTRY *pEntry;
+  DNS_FAMILY *pFam;
+  RESOLV_CALL msg;
+  FWD_CLIENT q;
+  u16_t len, k;
+  int i;
 
-static const char *TAG = "resolv_query";
-static u8_t i;
-static u8_t lseqi;
-register DNS_TABLE_ENTRY *pEntry;
+  len = pbuf_copy_partial(p, buf, sizeof(buf), 0);
+  pbuf_free(p);
+  /* not worth a reply: too short, a response, or no question to echo */
+  if(len < sizeof(DNS_HDR) || (hdr->flags1 & DNS_FLAG1_RESPONSE) ||
+     htons(hdr->numquestions) != 1 || !parse_msg(buf, len, &rx_msg))
+    return;
 
-ESP_LOGI(TAG, "...entered resolv query. The name is %s", name );
+  memset(&q, 0, sizeof(q));
+  q.addr = *addr;
+  q.port = port;
+  q.id = htons(hdr->id);
+  q.rd = hdr->flags1 & DNS_FLAG1_RD;
+  q.qtype = rx_msg.qtype;
+  q.fam = (rx_msg.qtype == MESSAGE_T_AAAA) ? FAM_V6 : FAM_V4;
+  strcpy(q.qname, rx_msg.qname);
+  ESP_LOGD(TAG, "...query %u for %s from %s", (unsigned)q.qtype, q.qname, ipaddr_ntoa(addr));
 
-lseqi = 0;
+  if((hdr->flags1 & DNS_FLAG1_OPCODE_MASK) != DNS_FLAG1_OPCODE_STANDARD){
+    forward_send(&q, NULL, DNS_FLAG2_ERR_NOTIMP);
+    return;
+  }
+  if(q.qname[0] == 0 || (rx_msg.qclass & 0x7fff) != MESSAGE_C_IN ||
+     !(q.qtype == MESSAGE_T_A || (RESOLV_AAAA && q.qtype == MESSAGE_T_AAAA))){
+    forward_send(&q, NULL, DNS_FLAG2_ERR_REFUSED);
+    return;
+  }
 
-ESP_LOGI(TAG, "...build entry for             : %s", name );
+  /* the dns table holds names in lower case, whatever case clients use */
+  for(k = 0; q.qname[k] != 0; ++k)
+    name[k] = tolower((unsigned char)q.qname[k]);
+  name[k] = 0;
 
-//sti Code to enter info into the table
-for (i = 0; i < LWIP_RESOLV_ENTRIES; ++i){
-  pEntry = &dns_table[i];
-  lseqi = i;
-  if (pEntry->state == STATE_UNUSED){
-    strcpy(pEntry->name, name);
-    pEntry->found = sti_cb_ptr;
-    pEntry->state = STATE_NEW;
-    pEntry->seqno = lseqi;
+#if RESOLV_STATIC_HOSTS
+  {
+    DNS_TABLE_ENTRY copy;
+
+    if(static_entry(name, &copy)){
+      forward_send(&q, &copy.fam[q.fam], DNS_FLAG2_ERR_NONE);
+      return;
+    }
+  }
+#endif
+
+  for(i = 0; i < LWIP_RESOLV_ENTRIES; ++i){
+    pEntry = &dns_table[i];
+    if(pEntry->state == STATE_UNUSED || strcmp(name, pEntry->name) != 0)
+      continue;
+    pFam = &pEntry->fam[q.fam];
+    if(family_fresh(pFam) || family_negative(pFam)){
+      ESP_LOGD(TAG, "...answered from dns table");
+      forward_send(&q, pFam, forward_rcode(pFam));
+      return;
+    }
     break;
   }
+
+  for(k = 0; k < RESOLV_FORWARD_CLIENTS && fwd_clients[k].used; ++k);
+  if(k == RESOLV_FORWARD_CLIENTS){
+    ESP_LOGI(TAG, "...too many clients waiting");
+    forward_send(&q, NULL, DNS_FLAG2_ERR_SERVER);
+    return;
+  }
+  msg.name = name;
+  msg.cb = NULL;
+  msg.family = (q.fam == FAM_V6) ? RESOLV_FAMILY_IPV6 : RESOLV_FAMILY_IPV4;
+  msg.prio = RESOLV_PRIO_NORMAL;
+  do_query(&msg.call);
+  for(i = 0; i < LWIP_RESOLV_ENTRIES; ++i){
+    pEntry = &dns_table[i];
+    if((pEntry->state == STATE_NEW || pEntry->state == STATE_ASKING) &&
+       pEntry->fam[q.fam].state == STATE_ASKING && strcmp(name, pEntry->name) == 0)
+      break;
+  }
+  if(i == LWIP_RESOLV_ENTRIES){
+    /* the dns table is full */
+    forward_send(&q, NULL, DNS_FLAG2_ERR_SERVER);
+    return;
+  }
+  q.entry = i;
+  q.used = 1;
+  fwd_clients[k] = q;
+  /* send the new query now rather than on the next check_entries() */
+  check_table(0);
 }
-pEntry = &dns_table[lseqi];
 
-ESP_LOGI(TAG, "...Created record at seq no    : %d", lseqi );
-ESP_LOGI(TAG, "...Record name is              : %s", pEntry->name );
-ESP_LOGI(TAG, "...Record state is             : %d", (int) pEntry->state );
-//ESP_LOGI(TAG, "...Record callback pointer is:         %p", pEntry->found );
-ESP_LOGI(TAG, "...Record IP address           : " IPSTR, IP2STR(&pEntry->ipaddr));
+/** do_forward_start() is resolv_forward_start() in the writer context */
+static err_t
+do_forward_start(struct tcpip_api_call_data *call)
+{
+  RESOLV_CALL *msg = (RESOLV_CALL *)call;
+  static const char *TAG = "resolv_fwd  ";
 
-seqno = lseqi + 1;
+  if(fwd_pcb != NULL)
+    return ERR_ISCONN;
+  fwd_pcb = udp_new_ip_type(IPADDR_TYPE_ANY);
+  if(fwd_pcb == NULL)
+    return ERR_MEM;
+  if(udp_bind(fwd_pcb, msg->addr, DNS_SERVER_PORT) != ERR_OK){
+    ESP_LOGI(TAG, "...port %d is taken", DNS_SERVER_PORT);
+    udp_remove(fwd_pcb);
+    fwd_pcb = NULL;
+    return ERR_USE;
+  }
+  udp_recv(fwd_pcb, forward_recv, NULL);
+  memset(fwd_clients, 0, sizeof(fwd_clients));
+  ESP_LOGI(TAG, "...forwarding on %s", ipaddr_ntoa(msg->addr));
+  return ERR_OK;
 }
 
-/*---------------------------------------------------------------------------*
- * Look up a hostname in the array of known hostnames.
- *
- * \note This function only looks in the internal array of known
- * hostnames, it does not send out a query for the hostname if none
- * was found. The function resolv_query() can be used to send a query
- * for a hostname.
- *
- * return A pointer to a 4-byte representation of the hostname's IP
- * address, or NULL if the hostname was not found in the array of
- * hostnames.
- *---------------------------------------------------------------------------*/
-u32_t
-resolv_lookup(char *name)
+/** do_forward_stop() is resolv_forward_stop() in the writer context. Clients
+  * still waiting get no reply. */
+static err_t
+do_forward_stop(struct tcpip_api_call_data *call)
+{
+  if(fwd_pcb != NULL){
+    udp_remove(fwd_pcb);
+    fwd_pcb = NULL;
+  }
+  memset(fwd_clients, 0, sizeof(fwd_clients));
+  return ERR_OK;
+}
+#endif
+
+esp_err_t
+resolv_forward_start(esp_netif_t *netif)
+{
+#if RESOLV_FORWARD
+  RESOLV_CALL msg;
+  esp_netif_ip_info_t info;
+  ip_addr_t listen;
+  err_t ret;
+
+  /* never every interface, that would answer the upstream network too */
+  if(netif == NULL)
+    return ESP_ERR_INVALID_ARG;
+  if(!__atomic_load_n(&initFlag, __ATOMIC_ACQUIRE))
+    return ESP_ERR_INVALID_STATE;
+  if(esp_netif_get_ip_info(netif, &info) != ESP_OK || info.ip.addr == 0)
+    return ESP_ERR_INVALID_STATE;
+  memset(&listen, 0, sizeof(listen));
+  listen.u_addr.ip4.addr = info.ip.addr;
+  listen.type = IPADDR_TYPE_V4;
+  msg.addr = &listen;
+  ret = resolv_call(do_forward_start, &msg);
+  if(ret == ERR_MEM)
+    return ESP_ERR_NO_MEM;
+  if(ret == ERR_ISCONN)
+    return ESP_ERR_INVALID_STATE;
+  return (ret == ERR_OK) ? ESP_OK : ESP_FAIL;
+#else
+  return ESP_ERR_NOT_SUPPORTED;
+#endif
+}
+
+esp_err_t
+resolv_forward_stop(void)
+{
+#if RESOLV_FORWARD
+  RESOLV_CALL msg;
+
+  resolv_call(do_forward_stop, &msg);
+  return ESP_OK;
+#else
+  return ESP_ERR_NOT_SUPPORTED;
+#endif
+}
+
+#if RESOLV_COMPLETION_QUEUE
+/** dispatch() runs the callbacks of the completion queue, waiting up to
+  * wait ticks for the first one.
+  *
+  * @returns the number of callbacks run */
+static int
+dispatch(TickType_t wait)
+{
+  static const char *TAG = "resolv_disp ";
+  RESOLV_EVENT *ev;
+  u32_t lost;
+  int n = 0;
+
+  for(;;){
+    xSemaphoreTake(completion_lock, portMAX_DELAY);
+    ev = completion_head;
+    if(ev != NULL){
+      completion_head = ev->next;
+      if(completion_head == NULL)
+        completion_tail = NULL;
+    }
+    lost = completion_lost;
+    completion_lost = 0;
+    xSemaphoreGive(completion_lock);
+    if(lost > 0)
+      ESP_LOGE(TAG, "...%u results lost, the completion queue was full", (unsigned)lost);
+    if(ev == NULL){
+      /* the wakeup may be left from events already run, wait once only */
+      if(n > 0 || xSemaphoreTake(completion_wake, wait) != pdTRUE)
+        return n;
+      wait = 0;
+      continue;
+    }
+    if(ev->kind == EVENT_REVERSE)
+      (*ev->rev_cb)(&ev->addr, ev->has_name ? ev->name : NULL);
+#if RESOLV_BROWSE
+    else if(ev->kind == EVENT_BROWSE)
+      (*ev->browse_cb)(ev->name, (ev->inst != NULL) ? &ev->inst->inst : NULL);
+#endif
+    else
+      (*ev->cb)(ev->name, ev->has_addr ? &ev->addr : NULL, ev->status, ev->ttl);
+    xSemaphoreTake(completion_lock, portMAX_DELAY);
+#if RESOLV_BROWSE
+    if(ev->inst != NULL){
+      ev->inst->next = completion_inst_free;
+      completion_inst_free = ev->inst;
+    }
+#endif
+    ev->next = completion_free;
+    completion_free = ev;
+    xSemaphoreGive(completion_lock);
+    ++n;
+  }
+}
+
+#if RESOLV_COMPLETION_TASK
+/** completion_task() runs the callbacks of the completion queue as they
+  * come in */
+static void
+completion_task(void *arg)
+{
+  for(;;)
+    dispatch(portMAX_DELAY);
+}
+#endif
+#endif
+
+esp_err_t
+resolv_dispatch(u32_t wait_ms)
+{
+#if RESOLV_COMPLETION_QUEUE
+  if(completion_lock == NULL || xTaskGetCurrentTaskHandle() == writer_task)
+    return ESP_ERR_INVALID_STATE;
+  return (dispatch(wait_ms / portTICK_PERIOD_MS) > 0) ? ESP_OK : ESP_ERR_TIMEOUT;
+#else
+  return ESP_ERR_NOT_SUPPORTED;
+#endif
+}
+
+/** do_set_servers() is resolv_set_servers() in the writer context */
+static err_t
+do_set_servers(struct tcpip_api_call_data *call)
 {
-  static u8_t i;
+  RESOLV_CALL *msg = (RESOLV_CALL *)call;
+  static const char *TAG = "set servers ";
+  DNS_SERVER old[RESOLV_MAX_SERVERS];
   DNS_TABLE_ENTRY *pEntry;
+  u8_t old_count = nservers;
+  u8_t i, k, fam;
+#if RESOLV_BROWSE
+  BROWSE_QUERY *q;
+#endif
 
-  /* Walk through name list, return entry if found. If not, return NULL. */
-  for(i=0; i<LWIP_RESOLV_ENTRIES; ++i)
-  {
+  memcpy(old, servers, sizeof(old));
+  for(k = 0; k < msg->server_count; ++k){
+    servers[k].addr = msg->server_list[k];
+    servers[k].edns_off = 0;
+    servers[k].tcp_off = 0;
+    /* keep what was learned about a server that stays */
+    for(i = 0; i < old_count; ++i){
+      if(ip_addr_cmp(&old[i].addr, &servers[k].addr)){
+        servers[k].edns_off = old[i].edns_off;
+        servers[k].tcp_off = old[i].tcp_off;
+      }
+    }
+    ESP_LOGI(TAG, "...dnsserver %d is              : %s", k, ipaddr_ntoa(&servers[k].addr));
+  }
+  nservers = msg->server_count;
+  use_server(0);
+#if RESOLV_TCP
+  /* connections are per index in servers, open them again on demand */
+  tcp_conn_close_all();
+#endif
+
+  for(i = 0; i < LWIP_RESOLV_ENTRIES; ++i){
     pEntry = &dns_table[i];
-    if ( (pEntry->state==STATE_DONE) && (strcmp(name, pEntry->name)==0) )
-      return pEntry->ipaddr.addr;
+    if(pEntry->state == STATE_NEW || pEntry->state == STATE_ASKING){
+      /* retarget: ask the new servers now, with a fresh set of retries */
+      pEntry->server = 0;
+      if(pEntry->state == STATE_ASKING){
+        pEntry->tmr = 1;
+        pEntry->retries = 0;
+        for(fam = 0; fam < FAM_COUNT; ++fam){
+          if(pEntry->fam[fam].state == STATE_ASKING)
+            send_or_defer(i, fam);
+        }
+      }
+    }
+    else if(msg->flush && pEntry->state != STATE_UNUSED){
+      /* answers from another network may not hold here */
+      entry_write_begin(pEntry);
+      clear_entry(pEntry);
+      entry_write_end(pEntry);
+    }
   }
-  return 0;
+
+  for(i = 0; i < RESOLV_REVERSE_ENTRIES; ++i){
+    if(rev_table[i].state == STATE_ASKING){
+      /* as for the dns table, ask the new servers now */
+      rev_table[i].server = 0;
+      rev_table[i].tmr = 1;
+      rev_table[i].retries = 0;
+      rate_defer(&rev_table[i].deferred);
+    }
+    else if(msg->flush && rev_table[i].state != STATE_NEW && rev_table[i].state != STATE_UNUSED){
+      entry_write_begin(&rev_table[i]);
+      rev_table[i].state = STATE_UNUSED;
+      entry_write_end(&rev_table[i]);
+    }
+  }
+#if RESOLV_BROWSE
+  for(fam = FAM_BROWSE_PTR; fam <= FAM_BROWSE_TXT; ++fam){
+    for(k = 0; k < RESOLV_BROWSE_INSTANCES; ++k){
+      q = browse_query(fam, k);
+      if(q != NULL && q->state == STATE_ASKING){
+        q->server = 0;
+        q->tmr = 1;
+        q->retries = 0;
+        rate_defer(&q->deferred);
+      }
+    }
+  }
+#endif
+  if(msg->flush)
+    memset(cname_table, 0, sizeof(cname_table));
+
+#if RESOLV_RES_QUERY
+  /* a res_query_jps() call still waiting has its query sent again */
+  if(user_buffer_ptr != NULL && res_query_msg != NULL)
+    send_msg(cur_server, res_query_msg, res_query_len);
+#endif
+  return ERR_OK;
 }
 
+err_t
+resolv_set_servers(const ip_addr_t *server_list, u8_t count, u8_t flush)
+{
+  RESOLV_CALL msg;
 
-/*---------------------------------------------------------------------------*
- * Obtain the currently configured DNS server.
- * return unsigned long encoding of the IP address of
- * the currently configured DNS server or NULL if no DNS server has
- * been configured.
- *---------------------------------------------------------------------------*/
-u32_t
-resolv_getserver(void)
+  if(server_list == NULL || count == 0 || count > RESOLV_MAX_SERVERS)
+    return ERR_ARG;
+  if(!__atomic_load_n(&initFlag, __ATOMIC_ACQUIRE))
+    return ERR_CONN;
+  msg.server_list = server_list;
+  msg.server_count = count;
+  msg.flush = flush;
+  return resolv_call(do_set_servers, &msg);
+}
+
+/** search_parse() sets the search list from a string of domains separated by
+  * spaces or commas, in the writer context. Trailing dots are dropped, domains
+  * past RESOLV_MAX_SEARCH or too long for the dns table are left out.
+  *
+  * @param domains the search list, NULL or "" for none
+  * @param ndots names with fewer dots try the search domains first */
+static void
+search_parse(const char *domains, u8_t ndots)
 {
-  if(resolv_pcb == NULL)
-    return 0;
-  return resolv_pcb->remote_ip.u_addr.ip4.addr;
+  static const char *TAG = "set search  ";
+  const char *p = domains;
+  size_t len;
+
+  seq_write_begin(&search_conf.seq);
+  search_conf.count = 0;
+  search_conf.ndots = ndots;
+  while(p != NULL && *p){
+    p += strspn(p, " ,");
+    len = strcspn(p, " ,");
+    if(len == 0)
+      break;
+    if(p[len - 1] == '.')
+      --len;
+    if(len == 0 || len + 2 >= MAX_NAME_LENGTH || search_conf.count == RESOLV_MAX_SEARCH){
+      ESP_LOGI(TAG, "...search domain left out      : %.*s", (int)len, p);
+    }
+    else{
+      memcpy(search_conf.domains[search_conf.count], p, len);
+      search_conf.domains[search_conf.count][len] = 0;
+      ESP_LOGI(TAG, "...search domain               : %s", search_conf.domains[search_conf.count]);
+      search_conf.count++;
+    }
+    p += strcspn(p, " ,");
+  }
+  seq_write_end(&search_conf.seq);
+}
+
+/** do_set_search() is resolv_set_search() in the writer context */
+static err_t
+do_set_search(struct tcpip_api_call_data *call)
+{
+  RESOLV_CALL *msg = (RESOLV_CALL *)call;
+
+  search_parse(msg->search, msg->ndots);
+  return ERR_OK;
 }
 
 err_t
-resolv_init(ip_addr_t *dnsserver_ip_addr_ptr) {
+resolv_set_search(const char *domains, u8_t ndots)
+{
+  RESOLV_CALL msg;
+
+  if(ndots > 15)
+    return ERR_ARG;
+  if(!__atomic_load_n(&initFlag, __ATOMIC_ACQUIRE))
+    return ERR_CONN;
+  msg.search = domains;
+  msg.ndots = ndots;
+  return resolv_call(do_set_search, &msg);
+}
+
+/** do_init() is resolv_init() in the writer context */
+static err_t
+do_init(struct tcpip_api_call_data *call) {
+  RESOLV_CALL *msg = (RESOLV_CALL *)call;
+  ip_addr_t *dnsserver_ip_addr_ptr = msg->server;
   static const char *TAG = "resolv init ";
-  ESP_LOGI(TAG, "...dnsserver is                : " IPSTR, IP2STR(&dnsserver_ip_addr_ptr->u_addr.ip4));
-  static u8_t i;
+  ESP_LOGI(TAG, "...dnsserver is                : %s", ipaddr_ntoa(dnsserver_ip_addr_ptr));
+  u8_t i;
 
-  serverIP.addr = dnsserver_ip_addr_ptr->u_addr.ip4.addr;
+  writer_task = xTaskGetCurrentTaskHandle();
+  servers[0].addr = *dnsserver_ip_addr_ptr;
+  servers[0].edns_off = 0; /* a new server gets a fresh chance at EDNS */
+  servers[0].tcp_off = 0;
+  nservers = 1;
+  use_server(0);
+#if RESOLV_TCP
+  tcp_conn_close_all();
+#endif
 
   for(i=0; i<LWIP_RESOLV_ENTRIES; ++i){
-    dns_table[i].state = STATE_UNUSED;
-    dns_table[i].seqno = 0;
+    if(dns_table[i].he_wait)
+      resolv_untimeout(he_timeout, (void *)(mem_ptr_t)i);
+    entry_write_begin(&dns_table[i]);
+    clear_entry(&dns_table[i]);
+    entry_write_end(&dns_table[i]);
+  }
+  for(i=0; i<RESOLV_SEARCH_GROUPS; ++i){
+    search_groups[i].active = 0;
+  }
+  for(i=0; i<RESOLV_REVERSE_ENTRIES; ++i){
+    entry_write_begin(&rev_table[i]);
+    memset((u8_t *)&rev_table[i] + sizeof(u32_t), 0, sizeof(REVERSE_ENTRY) - sizeof(u32_t));
+    entry_write_end(&rev_table[i]);
   }
+  memset(cname_table, 0, sizeof(cname_table));
+#if RESOLV_FORWARD
+  /* the lookups they waited for are gone, the clients ask again */
+  memset(fwd_clients, 0, sizeof(fwd_clients));
+#endif
+#if RESOLV_BROWSE
+  /* a browse still running ends without its callback */
+  memset(&browse, 0, sizeof(browse));
+  memset(browse_inst, 0, sizeof(browse_inst));
+#endif
+  search_parse(RESOLV_SEARCH, RESOLV_NDOTS);
+  resolv_untimeout(rate_resume, NULL);
+#if RESOLV_SIM
+  memset(sim_held, 0, sizeof(sim_held));
+  memset(sim_timers, 0, sizeof(sim_timers));
+#endif
+#if RESOLV_RATE
+  rate_tokens = RESOLV_BURST * 1000;
+  rate_stamp = (u32_t)(resolv_time_us() / 1000);
+#endif
+#if RESOLV_PERSIST
+  if(msg->snap != NULL)
+    snapshot_load(msg->snap, msg->snap_len, msg->snap_age);
+#endif
 
   if(resolv_pcb != NULL){
     ESP_LOGI(TAG, "...resolv_pcb exists...delete it");
     udp_remove(resolv_pcb);
   }
-    /* TODO: check for valid IP address for DNS server? */
-  resolv_pcb = udp_new();
-  udp_bind(resolv_pcb, IP_ADDR_ANY, 0);
+  /* not connected: queries go to whichever server resolv_set_servers() picked,
+     over IPv4 or IPv6 */
+  resolv_pcb = udp_new_ip_type(IPADDR_TYPE_ANY);
+  if (resolv_pcb == NULL){
+    ESP_LOGI(TAG, "...udp pcb could not be created");
+    return ERR_MEM;
+  }
 
   err_t ret;
-  ret = udp_connect(resolv_pcb, dnsserver_ip_addr_ptr, DNS_SERVER_PORT);
+  ret = udp_bind(resolv_pcb, IP_ANY_TYPE, 0);
   if (ret < 0 ){
-
-    ESP_LOGI(TAG, "...udp connect failed to       : " IPSTR, IP2STR(&dnsserver_ip_addr_ptr->u_addr.ip4));
-  }
-  else{
-    ESP_LOGI(TAG, "...udp connected to            : " IPSTR, IP2STR(&dnsserver_ip_addr_ptr->u_addr.ip4));
+    ESP_LOGI(TAG, "...udp bind failed");
   }
 
   typedef void(* udp_recv_fn) (void *arg, struct udp_pcb *pcb, struct pbuf *p, const ip_addr_t *addr, u16_t port);
   udp_recv_fn udp_r = &resolv_recv;
   udp_recv (resolv_pcb, udp_r, NULL);
 
-  initFlag = 1;
+  __atomic_store_n(&initFlag, 1, __ATOMIC_RELEASE);
   return ERR_OK;
 }
+
+err_t
+resolv_init(ip_addr_t *dnsserver_ip_addr_ptr) {
+  RESOLV_CALL msg;
+#if RESOLV_COMPLETION_QUEUE
+  int i;
+#endif
+
+#if RESOLV_RES_QUERY
+  if (res_query_mutex == NULL){
+    res_query_mutex = xSemaphoreCreateMutex();
+    res_query_sem = xSemaphoreCreateBinary();
+  }
+#endif
+#if RESOLV_COMPLETION_QUEUE
+  if (completion_lock == NULL){
+    completion_free = NULL;
+    for (i = 0; i < RESOLV_COMPLETION_EVENTS; ++i){
+      completion_pool[i].next = completion_free;
+      completion_free = &completion_pool[i];
+    }
+#if RESOLV_BROWSE
+    completion_inst_free = NULL;
+    for (i = 0; i < RESOLV_BROWSE_INSTANCES; ++i){
+      completion_inst[i].next = completion_inst_free;
+      completion_inst_free = &completion_inst[i];
+    }
+#endif
+    completion_wake = xSemaphoreCreateBinary();
+    if (completion_wake == NULL)
+      return ERR_MEM;
+    completion_lock = xSemaphoreCreateMutex();
+    if (completion_lock == NULL){
+      vSemaphoreDelete(completion_wake);
+      completion_wake = NULL;
+      return ERR_MEM;
+    }
+#if RESOLV_COMPLETION_TASK
+    if (xTaskCreate(completion_task, "resolv_cb", RESOLV_COMPLETION_STACK, NULL,
+                    RESOLV_COMPLETION_PRIO, NULL) != pdPASS){
+      vSemaphoreDelete(completion_lock);
+      vSemaphoreDelete(completion_wake);
+      completion_lock = NULL;
+      completion_wake = NULL;
+      return ERR_MEM;
+    }
+#endif
+  }
+#endif
+  msg.server = dnsserver_ip_addr_ptr;
+  msg.snap = NULL;
+#if RESOLV_PERSIST
+  /* read the snapshot here, flash access does not belong in the tcpip thread */
+  nvs_handle_t handle;
+  if(nvs_open(RESOLV_NVS_NAMESPACE, NVS_READONLY, &handle) == ESP_OK){
+    msg.snap_len = RESOLV_SNAP_MAX;
+    msg.snap = malloc(RESOLV_SNAP_MAX);
+    if(msg.snap != NULL && (nvs_get_blob(handle, RESOLV_NVS_KEY, msg.snap, &msg.snap_len) != ESP_OK ||
+                            msg.snap_len < RESOLV_SNAP_HDR_LEN)){
+      free(msg.snap);
+      msg.snap = NULL;
+    }
+    nvs_close(handle);
+  }
+  if(msg.snap != NULL)
+    msg.snap_age = snapshot_age(msg.snap);
+#endif
+  err_t err = resolv_call(do_init, &msg);
+  free(msg.snap);
+  return err;
+}
@@ -33,17 +33,74 @@
 #ifndef STI_RESOLV_H
 #define STI_RESOLV_H
 
-/* enumerated list of possible result values returned by gethostname() */
+#include "esp_err.h"
+#include "esp_netif.h"
+
+/* enumerated list of possible result values returned by resolv_gethostbyname() */
 typedef enum e_resolv_result {
   RESOLV_QUERY_INVALID,
   RESOLV_QUERY_QUEUED,
   RESOLV_COMPLETE
 } RESOLV_RESULT;
 
+/* address families a query asks for, see resolv_query_family() */
+typedef enum e_resolv_family {
+  RESOLV_FAMILY_IPV4,    /**< A records only */
+  RESOLV_FAMILY_IPV6,    /**< AAAA records only */
+  RESOLV_FAMILY_DUAL_V4, /**< A and AAAA in parallel, IPv4 preferred */
+  RESOLV_FAMILY_DUAL_V6  /**< A and AAAA in parallel, IPv6 preferred */
+} RESOLV_FAMILY;
+
+/* priority class of a query, see resolv_query_prio() */
+typedef enum e_resolv_priority {
+  RESOLV_PRIO_HIGH,   /**< a lookup something user visible waits for */
+  RESOLV_PRIO_NORMAL, /**< the default of the other functions */
+  RESOLV_PRIO_LOW     /**< background work such as telemetry */
+} RESOLV_PRIORITY;
+
 //typedef void(* user_cb_fn) (int i);
-typedef void(* user_cb_fn) (char *name, struct ip4_addr *addr);
+/* addr is an IPv4 or IPv6 address, or NULL if the name could not be resolved */
+struct hostent;
+struct addrinfo;
+
+/* Callbacks run in the lwIP tcpip thread, or with the completion queue
+ * enabled in menuconfig in the task that calls resolv_dispatch(). They may
+ * call the functions below.
+ *
+ * status is ERR_OK with an address. Without one it is ERR_VAL if the server
+ * said the name or the record type does not exist, or replied with an error,
+ * ERR_TIMEOUT if no server replied or the query gave way to a more urgent
+ * one, ERR_ARG if the name is too long and ERR_MEM if the dns table is full.
+ * ttl is the number of seconds the address, or the answer that there is
+ * none, stays in the dns table; 0 if nothing was cached. */
+typedef void(* user_cb_fn) (char *name, ip_addr_t *addr, err_t status, u32_t ttl);
+/* Callback of resolv_reverse(): name is NULL if the address has no name */
+typedef void(* reverse_cb_fn) (const ip_addr_t *addr, const char *name);
+
+/* A service instance found by resolv_browse() */
+typedef struct s_resolv_service {
+  const char *name;   /**< the instance, for example "Office._ipp._tcp.example.com" */
+  const char *target; /**< the host of its SRV record */
+  u16_t port;
+  u16_t priority;
+  u16_t weight;
+  const u8_t *txt;    /**< its TXT record, strings each led by their length */
+  u16_t txt_len;      /**< bytes in txt, 0 if it has none */
+  ip_addr_t addr;     /**< an address of target */
+  u32_t ttl;          /**< seconds the first of these records expires in */
+} RESOLV_SERVICE;
+
+/* Callback of resolv_browse(), run where the query callbacks run: once for
+ * each instance as soon as it is resolved, then with inst NULL when the
+ * browse is over. The pointers in inst are only valid during the call. */
+typedef void(* browse_cb_fn) (const char *service, const RESOLV_SERVICE *inst);
 /* Functions. */
 
+/* Thread safety: every function may be called from any task. The dns table is
+ * only changed in the lwIP tcpip thread; calls that change it are passed there
+ * with tcpip_api_call(). The lookup functions read the table from the calling
+ * task without taking a lock. */
+
 /** @brief Initialize this resolver
   *
   * Create a UDP connection with the DNS server so that DNS record queries can be made
@@ -51,6 +108,14 @@ typedef void(* user_cb_fn) (char *name, struct ip4_addr *addr);
   * @note This function uses lwip directly. Other IP implementations will need to
   * provide there own IP stack implementations
   *
+  * @note Call it once before the other functions. It clears the dns table;
+  * use resolv_set_servers() to change servers later on.
+  *
+  * @note With the persistent cache enabled in menuconfig, the names saved by
+  * resolv_save() are loaded again, so a warm boot starts with their addresses.
+  * Their TTLs are reduced by the time since the save. nvs_flash_init() must be
+  * called first.
+  *
   * @param dnsserver_ip_addr_ptr  the IP address of the DNS Server.
   * @returns ERR_OK: UDP connection succeeded LWIP error code
   */
@@ -59,6 +124,20 @@ resolv_init(ip_addr_t *dnsserver_ip_addr_ptr); /* working to pass ip_addr_t*/
 
 
 /** @brief Enter a request to get information for a hostname into the dns table
+  *
+  * Asks for the address family selected in menuconfig (IPv4 unless changed).
+  * If the name is already in the table with a valid address the callback is
+  * called straight away.
+  *
+  * @note Queries go over UDP, or over TCP if enabled in menuconfig. Over TCP
+  * every query to a server shares one connection and replies may come back
+  * in any order.
+  *
+  * @note A name of the static host table (menuconfig) is answered straight
+  * away from flash. The lookup functions also look there first.
+  *
+  * @note A name ending in .local is asked by multicast DNS on the local
+  * network if enabled in menuconfig, and never with a search domain.
   *
   * @param name pointer to a character array containing the hostname
   * @param sti_cb_ptr optional user secified callback function when an IP address is received
@@ -66,9 +145,75 @@ resolv_init(ip_addr_t *dnsserver_ip_addr_ptr); /* working to pass ip_addr_t*/
   **/
 void resolv_query(char *name, user_cb_fn sti_cb_ptr);
 
+/** @brief Enter a request for one or both address families of a hostname
+  *
+  * For the dual stack families the A and AAAA queries are sent together. The
+  * callback fires as soon as the preferred family has an address. If only the
+  * other family has answered, the callback waits a short delay (menuconfig)
+  * for the preferred one before reporting the other (Happy Eyeballs).
+  * Each family is cached with its own time to live.
+  *
+  * A request for a name already being asked for joins that query, whatever
+  * its callback; every callback is called once with the result. Up to four
+  * different callbacks share a query, a fifth gets NULL with ERR_MEM.
+  *
+  * A name without a trailing dot is expanded through the search list (see
+  * resolv_set_search()). Every candidate is asked for at once; the callback
+  * gets the name as passed in and the address of the first candidate in
+  * search order that has one. Answers that a name or record does not exist
+  * are cached per candidate for the time the server allows.
+  *
+  * @param name pointer to a character array containing the hostname
+  * @param sti_cb_ptr optional user secified callback function when an IP address is received
+  * @param family the family or families to ask for
+  * @returns void
+  **/
+void resolv_query_family(char *name, user_cb_fn sti_cb_ptr, RESOLV_FAMILY family);
+
+/** @brief Enter a request with a priority class
+  *
+  * As resolv_query_family(), which uses RESOLV_PRIO_NORMAL. The classes
+  * matter when the resolver is busy:
+  * - check_entries() sends and retries the most urgent queries first.
+  * - With a rate limit set in menuconfig, queries wait for their turn in that
+  *   order rather than flooding the DNS server.
+  * - When the dns table is full, a more urgent query takes the entry of a
+  *   less urgent one still in flight, whose callback gets NULL. A low priority
+  *   query is refused (callback with NULL) rather than use the last entries.
+  *
+  * A name already being asked for moves up to the most urgent class asking.
+  *
+  * @param name pointer to a character array containing the hostname
+  * @param sti_cb_ptr optional user secified callback function when an IP address is received
+  * @param family the family or families to ask for
+  * @param prio the priority class
+  * @returns void
+  **/
+void resolv_query_prio(char *name, user_cb_fn sti_cb_ptr, RESOLV_FAMILY family, RESOLV_PRIORITY prio);
+
 /** @brief a full function resolv query
   * this function allows small computers to get a return
   * buffer from the dns server
+  *
+  * @note When EDNS is enabled in menuconfig the query carries an OPT record
+  * and the reply may be larger than 512 bytes. Replies longer than anslen
+  * are cut to anslen bytes. The calling task blocks until the reply arrives
+  * or two seconds pass. Calls from several tasks are served one at a time.
+  * Do not call it from a resolver callback.
+  *
+  * @note With DNS over TCP enabled in menuconfig the query goes over the TCP
+  * connection to the server like the others.
+  *
+  * @note An A or AAAA question for a name of the static host table (menuconfig)
+  * is answered with a reply made up from the table, without a query.
+  *
+  * @param dname the fully qualified domain name to ask for
+  * @param class the query class, 1 for Internet
+  * @param type the query type, for example 1 for A or 33 for SRV records
+  * @param answer user supplied buffer the reply is copied into
+  * @param anslen size of the answer buffer in bytes
+  * @returns the number of bytes copied into answer, or 0 if no reply arrived
+  * or the raw query API is not enabled in menuconfig
   */
 int
 res_query_jps(const char *dname, int class, int type, unsigned char *answer, int anslen);
@@ -93,12 +238,484 @@ res_query_jps(const char *dname, int class, int type, unsigned char *answer, int
 u32_t
 resolv_lookup(char *name);
 
+/** @brief Look up an IPv4 or IPv6 address of a hostname in the dns table
+  *
+  * Like resolv_lookup() this does not send a query. For the dual stack
+  * families the preferred family is returned if it is valid, else the other.
+  * With address health enabled in menuconfig it is the first address
+  * resolv_lookup_all() would return.
+  *
+  * @param name pointer to a character array containing the full DNS name
+  * @param family the family or families wanted
+  * @param addr filled with the address if one was found
+  * @returns ERR_OK if an address was found, ERR_VAL if not
+  */
+err_t
+resolv_lookup_addr(char *name, RESOLV_FAMILY family, ip_addr_t *addr);
+
+/** @brief Get every cached address of a hostname
+  *
+  * All addresses of the record set are kept, up to the maximum set in
+  * menuconfig, in the order the DNS server sent them. For the dual stack
+  * families the addresses of the preferred family come first.
+  *
+  * @note With address health enabled in menuconfig the addresses are sorted
+  * by what resolv_report_connect() has reported for them: lowest smoothed
+  * connect RTT plus failure penalty first, whatever the family. An address
+  * never reported ranks as one that connects in 200 ms, and addresses of
+  * equal rank keep the order above.
+  *
+  * @param name pointer to a character array containing the full DNS name
+  * @param family the family or families wanted
+  * @param addrs array filled with the addresses
+  * @param max number of entries in addrs
+  * @returns the number of addresses written, 0 if the name was not found
+  */
+int
+resolv_lookup_all(char *name, RESOLV_FAMILY family, ip_addr_t *addrs, int max);
+
+/** @brief Get the next cached address of a hostname, round robin
+  *
+  * Each call returns the next address of the record set, so a client can
+  * spread its connections over all of them or fail over to the next address
+  * without another query. The rotation goes over the addresses in the order
+  * of resolv_lookup_all() and, with address health enabled, passes over the
+  * ones whose connects failed within the last half life of a failure,
+  * unless every address did.
+  *
+  * @param name pointer to a character array containing the full DNS name
+  * @param family the family or families wanted
+  * @param addr filled with the address if one was found
+  * @returns ERR_OK if an address was found, ERR_VAL if not
+  */
+err_t
+resolv_lookup_next(char *name, RESOLV_FAMILY family, ip_addr_t *addr);
+
+/** @brief Report how a connect to an address went
+  *
+  * Call it after a connect to an address the resolver returned succeeds or
+  * fails, for instance once the TLS handshake is done. The resolver keeps a
+  * smoothed RTT and a failure penalty per address; the penalty halves every
+  * half life set in menuconfig, so an address that failed is tried again
+  * later. resolv_lookup_all() and the functions built on it return the
+  * healthiest, fastest addresses first.
+  *
+  * @param addr the address
+  * @param ok 1 if the connect succeeded, 0 if it failed or timed out
+  * @param rtt_ms time the connect took, 0 if not measured
+  * @returns ESP_OK, ESP_ERR_INVALID_ARG if addr is NULL,
+  * ESP_ERR_INVALID_STATE before resolv_init() or ESP_ERR_NOT_SUPPORTED if
+  * address health is not enabled in menuconfig
+  */
+esp_err_t
+resolv_report_connect(const ip_addr_t *addr, u8_t ok, u32_t rtt_ms);
+
+
+/** @brief Get an address of a hostname without blocking
+  *
+  * Address literals and names with a valid address in the dns table are
+  * answered straight away. Otherwise the query is entered as with
+  * resolv_query_family() and the callback fires when the answer is in.
+  *
+  * @param name pointer to a character array containing the hostname
+  * @param addr filled with the address if RESOLV_COMPLETE is returned
+  * @param sti_cb_ptr optional callback for a queued query
+  * @param family the family or families to ask for
+  * @returns RESOLV_COMPLETE if addr is set, RESOLV_QUERY_QUEUED if a query was
+  * entered, RESOLV_QUERY_INVALID if the name is too long or the table is full
+  */
+RESOLV_RESULT
+resolv_gethostbyname(char *name, ip_addr_t *addr, user_cb_fn sti_cb_ptr, RESOLV_FAMILY family);
+
+/** @brief gethostbyname_r() served from the dns table
+  *
+  * Same arguments and results as lwIP's gethostbyname_r(), IPv4 only. A name
+  * that is not in the table is asked for, joining a query that is already
+  * running for it, and the calling task blocks until the answer is in or the
+  * wait set in menuconfig runs out. All addresses of the record set are
+  * returned in h_addr_list.
+  *
+  * @note Must not be called from a resolver callback.
+  *
+  * @returns 0 on success, -1 with *h_errnop set to HOST_NOT_FOUND, TRY_AGAIN,
+  * NO_RECOVERY, EINVAL or ERANGE (buf too small) on failure
+  */
+int
+sti_gethostbyname_r(const char *name, struct hostent *ret, char *buf,
+                    size_t buflen, struct hostent **result, int *h_errnop);
+
+/** @brief getaddrinfo() served from the dns table
+  *
+  * Same arguments and results as lwIP's getaddrinfo(), except that one
+  * addrinfo is returned for every address of the record set. AF_UNSPEC asks
+  * for the address family selected in menuconfig. Blocks like
+  * sti_gethostbyname_r(). Only numeric service names are supported.
+  *
+  * @note The list must be released with sti_freeaddrinfo(), not freeaddrinfo().
+  *
+  * @returns 0 on success or EAI_NONAME, EAI_SERVICE, EAI_FAMILY, EAI_MEMORY
+  * or EAI_FAIL (no answer from the DNS server)
+  */
+int
+sti_getaddrinfo(const char *nodename, const char *servname,
+                const struct addrinfo *hints, struct addrinfo **res);
+
+/** @brief Free a list returned by sti_getaddrinfo()
+  *
+  * @param ai the list, may be NULL
+  */
+void
+sti_freeaddrinfo(struct addrinfo *ai);
+
+
+/** @brief Save the dns table to NVS
+  *
+  * The names with valid addresses, and with stale addresses still within the
+  * serve stale window, are written as a snapshot that resolv_init() loads
+  * after a reboot or deep sleep. Call it before going to sleep or after a
+  * lookup, not on a timer, to spare the flash.
+  *
+  * The TTLs are aged by the wall clock. After a power-on reset before the
+  * clock is set, by SNTP for example, the age of the snapshot is unknown: its
+  * addresses count as expired and are only served stale, or not loaded at all
+  * if serving stale is off.
+  *
+  * @returns ESP_OK, ESP_ERR_NOT_SUPPORTED if the persistent cache is not
+  * enabled in menuconfig, or the NVS error
+  */
+esp_err_t
+resolv_save(void);
+
+
+/** @brief Change the DNS servers without losing the dns table
+  *
+  * For a DHCP renewal or a move to another access point. The new set takes
+  * the place of the old one at once. Queries in progress are sent again to
+  * the new servers with a fresh set of retries, so their callbacks still fire.
+  * Cached answers are kept unless flush is set. Each retry of a query goes to
+  * the next server in the list.
+  *
+  * @param server_list the IPv4 or IPv6 addresses of the servers, in order of preference
+  * @param count number of servers, 1 to RESOLV_MAX_SERVERS (3 by default)
+  * @param flush set to 1 to drop the cached answers, when the new network
+  * may resolve names differently
+  * @returns ERR_OK, ERR_ARG for a bad count or ERR_CONN before resolv_init()
+  */
+err_t
+resolv_set_servers(const ip_addr_t *server_list, u8_t count, u8_t flush);
+
+
+/** @brief Set the search list, as the search and ndots lines of resolv.conf
+  *
+  * A name with fewer than ndots dots is tried with each search domain appended
+  * first and as it is last; other names are tried as they are first. A name
+  * with a trailing dot is only tried as it is. The lookup functions return the
+  * address of the first candidate in that order that has one. The default
+  * comes from menuconfig.
+  *
+  * @param domains up to three domains separated by spaces or commas, for
+  * example the domain name handed out by DHCP, NULL or "" for none
+  * @param ndots 0 to 15, 1 as in resolv.conf
+  * @returns ERR_OK, ERR_ARG for a bad ndots or ERR_CONN before resolv_init()
+  */
+err_t
+resolv_set_search(const char *domains, u8_t ndots);
+
+
+/** @brief Enter a request for the name of an address (PTR lookup)
+  *
+  * Asks for the PTR record of the in-addr.arpa or ip6.arpa name of the
+  * address. Answers go in a reverse index, which forward A and AAAA answers
+  * fill too, so the name of a peer that was looked up is known without a
+  * query. An address without a name is cached as such, as long as the server
+  * allows. As for resolv_query(), the query goes out on the next call of
+  * check_entries() unless the answer is already cached, in which case the
+  * callback is called straight away.
+  *
+  * @param addr an IPv4 or IPv6 address
+  * @param cb optional callback with the name, or NULL if there is none
+  * @returns ERR_OK, ERR_MEM if the reverse index is full of queries in flight,
+  * ERR_ARG for a bad address or ERR_CONN before resolv_init()
+  */
+err_t
+resolv_reverse(const ip_addr_t *addr, reverse_cb_fn cb);
+
+
+/** @brief Get the name of an address from the reverse index
+  *
+  * Does not send a query, see resolv_reverse().
+  *
+  * @param addr an IPv4 or IPv6 address
+  * @param name buffer for the name
+  * @param len size of name
+  * @returns ERR_OK, ERR_VAL if no name is known, ERR_BUF if name is too small
+  * or ERR_ARG
+  */
+err_t
+resolv_reverse_lookup(const ip_addr_t *addr, char *name, size_t len);
+
+
+/** @brief Find the instances of a service with unicast DNS-SD
+  *
+  * Asks for the PTR records of the service, then for the SRV and TXT
+  * records of every instance it lists and for the address of each SRV
+  * target. Each query goes out as soon as the one before it has answered,
+  * and the queries of different instances run in parallel. Records the
+  * server sends along in the additional section are used without a query.
+  * The addresses are looked up in the dns table like any other name.
+  *
+  * An instance whose SRV record or address cannot be found is left out. An
+  * instance without a TXT record is reported with txt_len 0.
+  *
+  * The instance label may contain dots (RFC 6763 section 4.3); the queries
+  * keep it as one label, and name in the callback shows it as it is.
+  *
+  * @param service the service, for example "_ipp._tcp.example.com"
+  * @param cb the callback for the instances
+  * @returns ESP_OK, ESP_ERR_INVALID_ARG if service is empty or too long or cb
+  * is NULL, ESP_ERR_INVALID_STATE before resolv_init() or while another
+  * browse runs, or ESP_ERR_NOT_SUPPORTED if browsing is not enabled in
+  * menuconfig
+  */
+esp_err_t
+resolv_browse(const char *service, browse_cb_fn cb);
+
+
+/** @brief Start or stop the capture of DNS messages
+  *
+  * The queries sent and the replies received are kept in a ring in RAM
+  * (size in menuconfig), the oldest dropped first. Starting clears the ring;
+  * stopping keeps it for resolv_capture_export().
+  *
+  * @param on 1 to start, 0 to stop
+  * @returns ESP_OK or ESP_ERR_NOT_SUPPORTED if the capture is not enabled in
+  * menuconfig
+  */
+esp_err_t
+resolv_capture(u8_t on);
+
+
+/** @brief Copy the capture out as a pcap file
+  *
+  * Each message gets an IPv4 or IPv6 and a UDP header, so Wireshark and
+  * tcpdump show it as DNS (link type raw IP). Messages sent over TCP look the
+  * same. The oldest messages come first; those that do not fit are left out.
+  *
+  * @param buf where the file goes, or NULL to get the size it needs
+  * @param len size of buf
+  * @returns bytes written, the size needed if buf is NULL, or 0 if the capture
+  * is not enabled in menuconfig
+  */
+int
+resolv_capture_export(u8_t *buf, size_t len);
+
+
+/** @brief Replay the replies of a pcap capture
+  *
+  * The replies from port 53 in the capture are handed to the resolver with
+  * their original timing, counted from this call, as if they came from the
+  * server. Nothing is sent to the network until the replay is done. Start the
+  * replay then make the lookups of the capture again, in the same order and
+  * with the same dns table (after resolv_init() for instance): the query ID
+  * is the table slot, so the replies match. The buffer must stay valid until
+  * the replay is done.
+  *
+  * @param pcap a pcap file of link type raw IP, as made by
+  * resolv_capture_export(), or NULL to stop the replay
+  * @param len size of pcap
+  * @returns ESP_OK, ESP_ERR_INVALID_ARG if it is not such a file,
+  * ESP_ERR_INVALID_STATE before resolv_init() or ESP_ERR_NOT_SUPPORTED if the
+  * capture is not enabled in menuconfig
+  */
+esp_err_t
+resolv_replay(const u8_t *pcap, size_t len);
+
+
+/** @brief Clock and network of a simulation, see resolv_sim_hooks() */
+typedef struct s_resolv_sim_hooks {
+  int64_t (*now_us)(void *arg); /**< virtual time in microseconds, or NULL for the real clock */
+  void (*send)(const ip_addr_t *to, u16_t port, const u8_t *msg, u16_t len, void *arg); /**< takes the queries, or NULL for the network */
+  void *arg; /**< passed to both */
+} RESOLV_SIM_HOOKS;
+
+
+/** @brief Faults put on the queries sent, see resolv_sim_faults() */
+typedef struct s_resolv_sim_faults {
+  u8_t loss; /**< percent of queries dropped */
+  u8_t dup; /**< percent of queries sent twice */
+  u8_t delay; /**< percent of queries held back */
+  u16_t delay_ms; /**< how long they are held */
+  u32_t seed; /**< same seed, same faults */
+} RESOLV_SIM_FAULTS;
+
+
+/** @brief Run the resolver on a virtual clock and an in-memory network
+  *
+  * With now_us set, cache ages, TTLs, the rate limit and the replay of a
+  * capture follow the virtual clock. The retry timers of the lookups count
+  * calls to check_entries(), so a simulation calls it once per virtual second
+  * after moving its clock. The Happy Eyeballs delay, the resume of a rate
+  * limited queue and the steps of a replay wait for the virtual clock too and
+  * run from check_entries(), resolv_sim_deliver() or resolv_sim_run(). The
+  * blocking lookups and res_query_jps() time out on the virtual clock, so the
+  * simulation must keep moving it while one of them waits. Every timeout of
+  * the resolver stays on the virtual clock; one it has no slot for aborts
+  * the program rather than fall back to the real clock.
+  *
+  * With send set, the queries go to it instead of the network (TCP is not
+  * used) and the simulation answers with resolv_sim_deliver().
+  *
+  * @param hooks the hooks, copied, or NULL to go back to the real clock and
+  * network
+  * @returns ESP_OK or ESP_ERR_NOT_SUPPORTED if the simulation hooks are not
+  * enabled in menuconfig
+  */
+esp_err_t
+resolv_sim_hooks(const RESOLV_SIM_HOOKS *hooks);
+
+
+/** @brief Drop, duplicate or delay the queries sent over UDP
+  *
+  * Works with the real network as well as with resolv_sim_hooks(). The faults
+  * come from a pseudo random sequence started from the seed, so a run with
+  * the same seed, clock and replies is repeated exactly. Held queries are
+  * sent by the first check_entries(), send, resolv_sim_deliver() or
+  * resolv_sim_run() after their delay.
+  *
+  * @param faults the faults, copied, or NULL for none
+  * @returns ESP_OK, ESP_ERR_INVALID_ARG if a percentage is over 100 or
+  * ESP_ERR_NOT_SUPPORTED if the simulation hooks are not enabled in menuconfig
+  */
+esp_err_t
+resolv_sim_faults(const RESOLV_SIM_FAULTS *faults);
+
+
+/** @brief Run what is due on the virtual clock
+  *
+  * Sends the held queries and runs the timeouts whose time has come, then
+  * tells when the next one is due, so a simulation can move its clock
+  * straight there.
+  *
+  * @param next_us set to the resolv_sim_hooks() time of the next timeout or
+  * held query, or -1 if none is waiting; may be NULL
+  * @returns ESP_OK, ESP_ERR_INVALID_STATE before resolv_init() or
+  * ESP_ERR_NOT_SUPPORTED if the simulation hooks are not enabled in
+  * menuconfig
+  */
+esp_err_t
+resolv_sim_run(int64_t *next_us);
+
+
+/** @brief Hand a reply to the resolver as if it came from the network
+  *
+  * @param from the server that answers
+  * @param port its port, 53 or 5353 for mDNS
+  * @param msg the DNS message
+  * @param len its length
+  * @returns ESP_OK, ESP_ERR_INVALID_ARG, ESP_ERR_NO_MEM,
+  * ESP_ERR_INVALID_STATE before resolv_init() or ESP_ERR_NOT_SUPPORTED if the
+  * simulation hooks are not enabled in menuconfig
+  */
+esp_err_t
+resolv_sim_deliver(const ip_addr_t *from, u16_t port, const u8_t *msg, u16_t len);
+
+
+/** @brief Time the name and record parsers and log the result
+  *
+  * Runs the name encoder, the name decoder, the reply parser and the answer
+  * walk over a built in corpus of replies, each a hundred times, and logs the
+  * fastest pass of each in cycles per byte and per record. Runs in the
+  * calling task, on its own copies of the parser state, so the resolver keeps
+  * working meanwhile; call it from one task at a time.
+  *
+  * @returns ESP_OK or ESP_ERR_NOT_SUPPORTED if the benchmarks are not enabled
+  * in menuconfig
+  */
+esp_err_t
+resolv_bench(void);
+
+
+/** @brief Check the lock free reads of the dns table against the writer
+  *
+  * Starts four reader tasks, pinned in turn to each core, that copy an entry
+  * of its own with the same seqlock as the lookups, while the calling task
+  * has the lwIP tcpip thread change every byte of the entry to a new value
+  * in a loop. A copy whose bytes are not all the same mixes two changes and
+  * is counted as torn. Logs the writes, reads and torn copies. The dns table
+  * itself is not touched, so the resolver keeps working meanwhile.
+  *
+  * @param ms how long to run
+  * @returns ESP_OK if no copy was torn, ESP_FAIL if one was,
+  * ESP_ERR_NO_MEM if the reader tasks could not be started,
+  * ESP_ERR_INVALID_STATE before resolv_init() or in the tcpip thread, or
+  * ESP_ERR_NOT_SUPPORTED if the stress test is not enabled in menuconfig
+  */
+esp_err_t
+resolv_stress(u32_t ms);
+
+
+/** @brief Answer DNS queries of downstream clients on UDP port 53
+  *
+  * Makes the resolver a caching forwarder, for instance for the stations of a
+  * soft-AP. A and AAAA queries are answered from the dns table while the
+  * answer is valid. A miss is looked up like any other name, and clients
+  * asking for a name already being looked up wait for the same query, so the
+  * queries sent upstream grow with the number of names, not of clients. The
+  * reply carries the addresses with the time they have left to live. Other
+  * query types are refused.
+  *
+  * @param netif the interface to listen on, at its IPv4 address. Required:
+  * listening on every interface would make the device an open resolver on
+  * its upstream network too
+  * @returns ESP_OK, ESP_ERR_INVALID_ARG without an interface,
+  * ESP_ERR_INVALID_STATE before resolv_init(), if the forwarder already runs
+  * or the interface has no address, ESP_ERR_NO_MEM,
+  * ESP_FAIL if port 53 is taken or ESP_ERR_NOT_SUPPORTED if the forwarder is
+  * not enabled in menuconfig
+  */
+esp_err_t
+resolv_forward_start(esp_netif_t *netif);
+
+
+/** @brief Stop answering downstream clients
+  *
+  * Clients still waiting for a lookup get no reply.
+  *
+  * @returns ESP_OK or ESP_ERR_NOT_SUPPORTED if the forwarder is not enabled in
+  * menuconfig
+  */
+esp_err_t
+resolv_forward_stop(void);
+
+
+/** @brief Run the callbacks waiting in the completion queue
+  *
+  * With the completion queue enabled in menuconfig, the result of a query,
+  * of resolv_reverse() or of resolv_browse() is queued rather than passed to
+  * its callback in the lwIP tcpip thread, so a slow callback does not hold
+  * up the network. An application without the resolver task of menuconfig
+  * calls this function from a task of its own; the callbacks run in that
+  * task and never in the tcpip thread. The events come from a fixed pool
+  * sized from the tables; if callbacks are left waiting until it runs out,
+  * a new result is lost and logged as an error, as is the count of lost
+  * results at the next call. A name longer than the table holds, only
+  * passed on with ERR_ARG, is cut to fit.
+  *
+  * @param wait_ms how long to wait for a first callback, 0 to only run those
+  * already queued
+  * @returns ESP_OK if callbacks were run, ESP_ERR_TIMEOUT if none came in,
+  * ESP_ERR_INVALID_STATE before resolv_init() or in the tcpip thread, or
+  * ESP_ERR_NOT_SUPPORTED if the completion queue is not enabled in menuconfig
+  */
+esp_err_t
+resolv_dispatch(u32_t wait_ms);
+
 
 /** @brief Obtain the currently configured DNS server
   *
   * @returns unsigned long encoding of the IP address of
-  * the currently configured DNS server or NULL if no DNS server has
-  * been configured.
+  * the DNS server in use, the one that answered last, or NULL if no DNS
+  * server has been configured or it is an IPv6 server.
   **/
 u32_t
 resolv_getserver(void);
@@ -116,12 +733,6 @@ resolv_getserver(void);
 void
 check_entries(void);
 
-/** @brief get_qname_len() - Walk through the encoded answer buffer and return
- * the length of the encoded name in chars.
- *---------------------------------------------------------------------------*/
-int
-get_qname_len(unsigned char *name_ptr);
-
 /** print_buf prints out a buffer. This makes it easier to troubleshoot
   * buffers sent or ceived from the DNS server */
 void print_buf(unsigned char *buf, int length);
@@ -0,0 +1,160 @@
+#!/usr/bin/env python3
+#
+# Print the flash and RAM cost of sti_resolv.c in each profile of this
+# directory, and of each feature of the full profile.
+#
+# sti_resolv.c is compiled again with the command of an ESP-IDF CMake build
+# (compile_commands.json), once per profile, with a sdkconfig.h made from the
+# sdkconfig.h of the build and the options of the profile. The options of a
+# profile are applied as they are, without menuconfig, so a profile lists
+# every option it changes. Flash is text and data, RAM is data and bss, as
+# reported by the size tool of the toolchain.
+#
+# cmake --build build --target sti-size-report runs it on the build directory.
+
+import argparse
+import glob
+import json
+import os
+import re
+import shlex
+import subprocess
+import sys
+import tempfile
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+MAIN = os.path.join(os.path.dirname(HERE), 'main')
+PREFIX = 'CONFIG_STI_RESOLV_'
+
+
+def compile_command(build_dir):
+    """The compiler arguments of sti_resolv.c in the build"""
+    path = os.path.join(build_dir, 'compile_commands.json')
+    try:
+        with open(path) as f:
+            commands = json.load(f)
+    except OSError:
+        sys.exit('%s not found, configure the project with idf.py first' % path)
+    for c in commands:
+        if os.path.basename(c['file']) == 'sti_resolv.c':
+            args = c.get('arguments') or shlex.split(c['command'])
+            return args, c['directory']
+    sys.exit('sti_resolv.c is not in %s' % path)
+
+
+def parse_sdkconfig(path):
+    """Options of a sdkconfig file, None for those not set"""
+    options = {}
+    with open(path) as f:
+        for line in f:
+            line = line.strip()
+            m = re.match(r'# (CONFIG_\w+) is not set', line)
+            if m:
+                options[m.group(1)] = None
+            elif line.startswith('CONFIG_'):
+                name, value = line.split('=', 1)
+                options[name] = '1' if value == 'y' else value
+    return options
+
+
+def make_header(base, options, out):
+    """sdkconfig.h of the build with the resolver options replaced"""
+    lines = [l for l in base if not l.startswith('#define ' + PREFIX)]
+    for name, value in sorted(options.items()):
+        if name.startswith(PREFIX) and value is not None:
+            lines.append('#define %s %s\n' % (name, value))
+    with open(out, 'w') as f:
+        f.writelines(lines)
+
+
+def base_options(base):
+    options = {}
+    for l in base:
+        m = re.match(r'#define (%s\w+) (.*)' % PREFIX, l)
+        if m:
+            options[m.group(1)] = m.group(2).strip()
+    return options
+
+
+def measure(args, cwd, size_tool, options, base, tmp):
+    """Compile sti_resolv.c with options, return (text, data, bss)"""
+    make_header(base, options, os.path.join(tmp, 'sdkconfig.h'))
+    if options.get(PREFIX + 'STATIC_HOSTS'):
+        hosts = options.get(PREFIX + 'STATIC_HOSTS_FILE', '"static_hosts"').strip('"')
+        subprocess.check_call([sys.executable, os.path.join(MAIN, 'gen_static_hosts.py'),
+                               '--file', os.path.join(MAIN, hosts),
+                               '--list', options.get(PREFIX + 'STATIC_HOSTS_LIST', '""').strip('"'),
+                               '--output', os.path.join(tmp, 'static_hosts.h')])
+    obj = os.path.join(tmp, 'sti_resolv.o')
+    cmd = [args[0], '-I' + tmp]
+    skip = False
+    for a in args[1:]:
+        if skip:
+            skip = False
+            continue
+        if a in ('-o', '-MF', '-MT', '-MQ'):
+            skip = True
+            continue
+        if a in ('-MD', '-MMD'):
+            continue
+        cmd.append(a)
+    cmd += ['-o', obj]
+    if subprocess.call(cmd, cwd=cwd) != 0:
+        return None
+    out = subprocess.check_output([size_tool, obj], universal_newlines=True).splitlines()
+    text, data, bss = (int(v) for v in out[1].split()[:3])
+    return text, data, bss
+
+
+def row(name, sizes, ref=None):
+    if sizes is None:
+        return '%-24s %s' % (name, 'does not build')
+    flash, ram = sizes[0] + sizes[1], sizes[1] + sizes[2]
+    if ref is None:
+        return '%-24s %8d %8d' % (name, flash, ram)
+    return '%-24s %+8d %+8d' % (name, ref[0] + ref[1] - flash, ref[1] + ref[2] - ram)
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Flash and RAM cost of sti_resolv.c per profile and feature')
+    parser.add_argument('--build-dir', default='build', help='ESP-IDF CMake build directory')
+    parser.add_argument('--size', help='size tool, by default the one next to the compiler')
+    args = parser.parse_args()
+
+    build_dir = os.path.abspath(args.build_dir)
+    cc_args, cwd = compile_command(build_dir)
+    size_tool = args.size or re.sub(r'g?cc$', 'size', cc_args[0])
+    with open(os.path.join(build_dir, 'config', 'sdkconfig.h')) as f:
+        base = f.readlines()
+
+    profiles = {}
+    for path in sorted(glob.glob(os.path.join(HERE, 'sdkconfig.*'))):
+        options = base_options(base)
+        options.update(parse_sdkconfig(path))
+        profiles[path.split('sdkconfig.', 1)[1]] = options
+
+    with tempfile.TemporaryDirectory() as tmp:
+        print('%-24s %8s %8s' % ('profile', 'flash', 'RAM'))
+        print(row('build', measure(cc_args, cwd, size_tool, base_options(base), base, tmp)))
+        for name, options in profiles.items():
+            print(row(name, measure(cc_args, cwd, size_tool, options, base, tmp)))
+
+        full = profiles.get('full')
+        if full is None:
+            return
+        ref = measure(cc_args, cwd, size_tool, full, base, tmp)
+        if ref is None:
+            return
+        # a feature costs what the full profile saves without it
+        print()
+        print('%-24s %8s %8s' % ('feature of full', 'flash', 'RAM'))
+        for name, value in sorted(full.items()):
+            if value != '1' or name.startswith(PREFIX + 'PROFILE') or name.startswith(PREFIX + 'FAMILY'):
+                continue
+            options = dict(full)
+            options[name] = None
+            print(row(name[len(PREFIX):], measure(cc_args, cwd, size_tool, options, base, tmp), ref))
+
+
+if __name__ == '__main__':
+    main()